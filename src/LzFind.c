@@ -20,7 +20,7 @@ void MatchFinder_Create(CMatchFinder *p)
   p->hash = (UInt32*)malloc(131072 * sizeof(UInt32));
   if (!p->hash)
   {
-    exit(1);
+    ZopfliOutOfMemory();
   }
   p->son = p->hash + 65536;
 
@@ -170,7 +170,7 @@ void CopyMF(const CMatchFinder *p, CMatchFinder* copy){
   copy->hash = (UInt32*)malloc(131072 * sizeof(UInt32));
   if (!copy->hash)
   {
-    exit(1);
+    ZopfliOutOfMemory();
   }
   copy->son = copy->hash + 65536;
   memcpy(copy->hash, p->hash, 131072 * sizeof(UInt32));
@@ -0,0 +1,597 @@
+//  bench.cpp
+//  Efficient Compression Tool
+//  Runs the PNG, JPEG, gzip and ZIP paths over a generated corpus and records throughput, output size and
+//  peak memory per file class and mode. Built and run with "make bench", not part of ECT itself.
+//  Usage: bench-ect [-n runs] [-m modes] [-o results.json] [-c baseline.json] [-t percent]
+//  -m takes a comma separated list of modes. With -c, results worse than the baseline are listed and the
+//  exit code is 1: throughput or peak memory more than -t percent (default 10) worse, or any larger output.
+
+#include "../main.h"
+#include "../support.h"
+#include "../zlib/zlib.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "../mozjpeg/jpeglib.h"
+
+#define CORPUS_DIR "bench-ect.tmp/corpus/"
+#define RUN_DIR "bench-ect.tmp/run/"
+
+enum FileClass {CLASS_PNG, CLASS_JPEG, CLASS_GZIP, CLASS_ZIP, CLASSES};
+static const char* const class_names[CLASSES] = {"png", "jpeg", "gzip", "zip"};
+
+struct Result {
+    std::string name;
+    unsigned mode;
+    unsigned files;
+    unsigned long long in;
+    unsigned long long out;
+    double seconds;
+    long rss;
+};
+
+//The corpus has to be the same on every machine, so it doesn't use rand()
+static unsigned long long seed = 0x9E3779B97F4A7C15ULL;
+static unsigned random32() {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return (unsigned)((seed * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static bool writeFile(const std::string& path, const std::vector<unsigned char>& data) {
+    FILE* f = fopen(path.c_str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return !fclose(f) && ok;
+}
+
+static void appendChunk(std::vector<unsigned char>& png, const char* type, const std::vector<unsigned char>& data) {
+    unsigned char header[8] = {(unsigned char)(data.size() >> 24), (unsigned char)(data.size() >> 16),
+                               (unsigned char)(data.size() >> 8), (unsigned char)data.size()};
+    memcpy(header + 4, type, 4);
+    png.insert(png.end(), header, header + 8);
+    png.insert(png.end(), data.begin(), data.end());
+    //crc32 returns its initial value for a null buffer, which an empty vector may have
+    unsigned crc = crc32(0, header + 4, 4);
+    if (data.size()) {
+        crc = crc32(crc, data.data(), data.size());
+    }
+    unsigned char trailer[4] = {(unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc};
+    png.insert(png.end(), trailer, trailer + 4);
+}
+
+//Writes pixels as a PNG the way a simple encoder would: no filters and default zlib compression
+static bool writePNG(const std::string& path, const std::vector<unsigned char>& pixels, unsigned w, unsigned h,
+                     unsigned char colortype, unsigned char bitdepth) {
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    std::vector<unsigned char> png(signature, signature + 8);
+    unsigned char ihdr[13] = {(unsigned char)(w >> 24), (unsigned char)(w >> 16), (unsigned char)(w >> 8), (unsigned char)w,
+                              (unsigned char)(h >> 24), (unsigned char)(h >> 16), (unsigned char)(h >> 8), (unsigned char)h,
+                              bitdepth, colortype, 0, 0, 0};
+    appendChunk(png, "IHDR", std::vector<unsigned char>(ihdr, ihdr + 13));
+    size_t linebytes = pixels.size() / h;
+    std::vector<unsigned char> raw;
+    for (unsigned y = 0; y < h; y++) {
+        raw.push_back(0);
+        raw.insert(raw.end(), pixels.begin() + y * linebytes, pixels.begin() + (y + 1) * linebytes);
+    }
+    z_stream def;
+    memset(&def, 0, sizeof(def));
+    if (deflateInit2(&def, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    std::vector<unsigned char> idat(deflateBound(&def, raw.size()));
+    def.next_in = raw.data();
+    def.avail_in = raw.size();
+    def.next_out = idat.data();
+    def.avail_out = idat.size();
+    int error = deflate(&def, Z_FINISH);
+    idat.resize(def.total_out);
+    deflateEnd(&def);
+    if (error != Z_STREAM_END) {
+        return false;
+    }
+    appendChunk(png, "IDAT", idat);
+    appendChunk(png, "IEND", std::vector<unsigned char>());
+    return writeFile(path, png);
+}
+
+//ECT's libjpeg can't do a forward DCT, so the JPEGs are written from coefficients: smooth DC gradients and
+//sparse small AC values, which are coded like those of a photo
+static bool writeJPEG(const std::string& path, unsigned w, unsigned h, int components) {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    unsigned char* out = 0;
+    unsigned long outsize = 0;
+    jpeg_mem_dest(&cinfo, &out, &outsize);
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = components;
+    cinfo.in_color_space = components == 3 ? JCS_RGB : JCS_GRAYSCALE;
+    //A plain baseline JPEG with the standard Huffman tables, like most cameras write
+    jpeg_c_set_int_param(&cinfo, JINT_COMPRESS_PROFILE, JCP_FASTEST);
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    cinfo.optimize_coding = FALSE;
+    jvirt_barray_ptr arrays[3];
+    unsigned bw = (w + 7) / 8, bh = (h + 7) / 8;
+    for (int c = 0; c < components; c++) {
+        cinfo.comp_info[c].h_samp_factor = cinfo.comp_info[c].v_samp_factor = 1;
+        arrays[c] = cinfo.mem->request_virt_barray((j_common_ptr)&cinfo, JPOOL_IMAGE, TRUE, bw, bh, 1);
+    }
+    cinfo.mem->realize_virt_arrays((j_common_ptr)&cinfo);
+    for (int c = 0; c < components; c++) {
+        for (unsigned y = 0; y < bh; y++) {
+            JBLOCKROW row = cinfo.mem->access_virt_barray((j_common_ptr)&cinfo, arrays[c], y, 1, TRUE)[0];
+            for (unsigned x = 0; x < bw; x++) {
+                row[x][0] = c ? (int)(x * 16 / bw) - 8 : (int)((x + y) * 96 / (bw + bh)) - 48 + random32() % 3;
+                for (unsigned k = 1; k < DCTSIZE2; k++) {
+                    if (random32() % (k * (c ? 4 : 1) + 2) < 2) {
+                        row[x][k] = (int)(random32() % 7) - 3;
+                    }
+                }
+            }
+        }
+    }
+    jpeg_write_coefficients(&cinfo, arrays);
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    bool ok = writeFile(path, std::vector<unsigned char>(out, out + outsize));
+    free(out);
+    return ok;
+}
+
+//Gradients with noise, compresses about like a photo
+static std::vector<unsigned char> photo(unsigned w, unsigned h, unsigned channels) {
+    std::vector<unsigned char> pixels(w * h * channels);
+    for (unsigned y = 0; y < h; y++) {
+        for (unsigned x = 0; x < w; x++) {
+            for (unsigned c = 0; c < channels; c++) {
+                unsigned base = c == 0 ? x * 255 / w : c == 1 ? y * 255 / h : (x + y) * 255 / (w + h);
+                pixels[(y * w + x) * channels + c] = (unsigned char)(base + random32() % 9);
+            }
+        }
+    }
+    return pixels;
+}
+
+static bool generatePNGs(std::vector<std::string>& files) {
+    unsigned w = 256, h = 256;
+    std::vector<unsigned char> pixels = photo(w, h, 3);
+    files.push_back("photo.png");
+    if (!writePNG(CORPUS_DIR "photo.png", pixels, w, h, 2, 8)) {
+        return false;
+    }
+
+    //An opaque disc on fully transparent pixels with leftover colors
+    w = h = 192;
+    pixels = photo(w, h, 4);
+    for (unsigned y = 0; y < h; y++) {
+        for (unsigned x = 0; x < w; x++) {
+            int dx = x - w / 2, dy = y - h / 2;
+            pixels[(y * w + x) * 4 + 3] = dx * dx + dy * dy < 80 * 80 ? 255 : 0;
+        }
+    }
+    files.push_back("alpha.png");
+    if (!writePNG(CORPUS_DIR "alpha.png", pixels, w, h, 6, 8)) {
+        return false;
+    }
+
+    //Rectangles in 12 colors, becomes a palette image
+    w = 320, h = 240;
+    unsigned char palette[12][3];
+    for (unsigned i = 0; i < 12; i++) {
+        for (unsigned c = 0; c < 3; c++) {
+            palette[i][c] = random32();
+        }
+    }
+    pixels.assign(w * h * 3, 0);
+    for (unsigned r = 0; r < 60; r++) {
+        unsigned x0 = random32() % w, y0 = random32() % h, color = random32() % 12;
+        unsigned x1 = x0 + random32() % 80, y1 = y0 + random32() % 60;
+        for (unsigned y = y0; y < y1 && y < h; y++) {
+            for (unsigned x = x0; x < x1 && x < w; x++) {
+                memcpy(&pixels[(y * w + x) * 3], palette[color], 3);
+            }
+        }
+    }
+    files.push_back("shapes.png");
+    if (!writePNG(CORPUS_DIR "shapes.png", pixels, w, h, 2, 8)) {
+        return false;
+    }
+
+    //Lines of dark glyph-like runs on white, like a screenshot of text
+    w = 400, h = 300;
+    pixels.assign(w * h, 255);
+    for (unsigned line = 0; line + 12 < h; line += 16) {
+        for (unsigned x = 8; x + 8 < w; x += 1 + random32() % 4) {
+            unsigned top = line + random32() % 4, bottom = line + 8 + random32() % 4;
+            unsigned char shade = random32() % 96;
+            for (unsigned y = top; y < bottom; y++) {
+                pixels[y * w + x] = shade;
+            }
+        }
+    }
+    files.push_back("text.png");
+    if (!writePNG(CORPUS_DIR "text.png", pixels, w, h, 0, 8)) {
+        return false;
+    }
+
+    w = h = 128;
+    pixels.resize(w * h * 2);
+    for (unsigned i = 0; i < w * h; i++) {
+        unsigned v = (i % w + i / w) * 256 + random32() % 512;
+        pixels[i * 2] = v >> 8;
+        pixels[i * 2 + 1] = v;
+    }
+    files.push_back("grey16.png");
+    if (!writePNG(CORPUS_DIR "grey16.png", pixels, w, h, 0, 16)) {
+        return false;
+    }
+
+    //Icons, where the fixed costs per image dominate
+    for (unsigned i = 0; i < 4; i++) {
+        w = h = 16 + 8 * i;
+        pixels.resize(w * h * 4);
+        for (unsigned k = 0; k < w * h; k++) {
+            unsigned color = random32() % 4 ? 0x3080C0FF : random32() | 0xFF;
+            for (unsigned c = 0; c < 4; c++) {
+                pixels[k * 4 + c] = color >> (24 - c * 8);
+            }
+        }
+        files.push_back("icon" + std::to_string(i) + ".png");
+        if (!writePNG(CORPUS_DIR + files.back(), pixels, w, h, 6, 8)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool generateJPEGs(std::vector<std::string>& files) {
+    files.push_back("photo.jpg");
+    files.push_back("large.jpg");
+    files.push_back("grey.jpg");
+    return writeJPEG(CORPUS_DIR "photo.jpg", 320, 240, 3) && writeJPEG(CORPUS_DIR "large.jpg", 800, 600, 3)
+        && writeJPEG(CORPUS_DIR "grey.jpg", 200, 200, 1);
+}
+
+static bool generateData(std::vector<std::string>& files) {
+    //Words from a small vocabulary, common ones more often
+    std::vector<std::string> words;
+    for (unsigned i = 0; i < 300; i++) {
+        std::string word;
+        for (unsigned k = 2 + random32() % 8; k; k--) {
+            word += (char)('a' + random32() % 26);
+        }
+        words.push_back(word);
+    }
+    std::string text;
+    while (text.size() < 200000) {
+        text += words[random32() % (random32() % 300 + 1)];
+        text += random32() % 12 ? " " : ".\n";
+    }
+    files.push_back("text.txt");
+    if (!writeFile(CORPUS_DIR "text.txt", std::vector<unsigned char>(text.begin(), text.end()))) {
+        return false;
+    }
+
+    std::string csv = "id,time,value,count\n";
+    for (unsigned i = 0; csv.size() < 150000; i++) {
+        char line[80];
+        snprintf(line, sizeof(line), "%u,%u,%u.%02u,%u\n", i, 1600000000 + i * 60 + random32() % 60, random32() % 1000, random32() % 100, random32() % 16);
+        csv += line;
+    }
+    files.push_back("data.csv");
+    if (!writeFile(CORPUS_DIR "data.csv", std::vector<unsigned char>(csv.begin(), csv.end()))) {
+        return false;
+    }
+
+    //Fixed size little endian records
+    std::vector<unsigned char> records;
+    for (unsigned i = 0; records.size() < 150000; i++) {
+        unsigned fields[4] = {i, random32() % 256, 1000 + random32() % 50, random32() % 4 ? 0 : random32()};
+        for (unsigned f = 0; f < 4; f++) {
+            for (unsigned b = 0; b < 4; b++) {
+                records.push_back(fields[f] >> (b * 8));
+            }
+        }
+    }
+    files.push_back("records.bin");
+    if (!writeFile(CORPUS_DIR "records.bin", records)) {
+        return false;
+    }
+
+    std::vector<unsigned char> noise(32768);
+    for (size_t i = 0; i < noise.size(); i++) {
+        noise[i] = random32();
+    }
+    files.push_back("noise.bin");
+    return writeFile(CORPUS_DIR "noise.bin", noise);
+}
+
+static bool copyFile(const std::string& from, const std::string& to) {
+    FILE* f = fopen(from.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    std::vector<unsigned char> data(filesize(from.c_str()));
+    bool ok = fread(data.data(), 1, data.size(), f) == data.size();
+    fclose(f);
+    return ok && writeFile(to, data);
+}
+
+static void defaultOptions(ECTOptions& Options, unsigned mode) {
+    Options.Mode = mode;
+    Options.palette_sort = 0;
+    Options.strip = false;
+    Options.Progressive = false;
+    Options.JPEG_ACTIVE = true;
+    Options.PNG_ACTIVE = true;
+    Options.SavingsCounter = false;
+    Options.Strict = false;
+    Options.Arithmetic = false;
+    Options.Gzip = false;
+    Options.Zip = false;
+    Options.Reuse = false;
+    Options.Allfilters = false;
+    Options.Allfiltersbrute = false;
+    Options.Allfilterscheap = false;
+#ifdef BOOST_SUPPORTED
+    Options.Recurse = false;
+#endif
+    Options.DeflateMultithreading = 0;
+    Options.Threads = 0;
+    Options.keep = false;
+    Options.ZipManifest = false;
+}
+
+//Optimizes fresh copies of the files in a child process, so its peak memory belongs to this run alone
+static bool runClass(FileClass type, const std::vector<std::string>& files, unsigned mode, Result& result) {
+    std::vector<std::string> paths;
+    result.in = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        paths.push_back(RUN_DIR + files[i]);
+        unlink(paths[i].c_str());
+        unlink((paths[i] + ".gz").c_str());
+        if (!copyFile(CORPUS_DIR + files[i], paths[i])) {
+            return false;
+        }
+        result.in += filesize(paths[i].c_str());
+    }
+    //zipHandler names the archive after the first file
+    std::string archive = paths[0].substr(0, paths[0].find_last_of('.')) + ".zip";
+    unlink(archive.c_str());
+    fflush(stdout);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return false;
+    }
+    if (!pid) {
+        ECTOptions Options;
+        defaultOptions(Options, mode);
+        unsigned error = 0;
+        if (type == CLASS_ZIP) {
+            Options.Gzip = Options.Zip = true;
+            std::vector<const char*> names;
+            std::vector<int> args;
+            for (size_t i = 0; i < paths.size(); i++) {
+                names.push_back(paths[i].c_str());
+                args.push_back(i);
+            }
+            error = zipHandler(args, names.data(), names.size(), Options);
+        }
+        else {
+            Options.Gzip = type == CLASS_GZIP;
+            for (size_t i = 0; i < paths.size(); i++) {
+                error |= fileHandler(paths[i].c_str(), Options, 0);
+            }
+        }
+        fflush(stdout);
+        _exit(error ? 1 : 0);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        return false;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+#ifdef __APPLE__
+    result.rss = usage.ru_maxrss / 1024;
+#else
+    result.rss = usage.ru_maxrss;
+#endif
+
+    result.out = 0;
+    if (type == CLASS_ZIP) {
+        result.out = filesize(archive.c_str());
+    }
+    for (size_t i = 0; i < paths.size() && type != CLASS_ZIP; i++) {
+        result.out += filesize(type == CLASS_GZIP ? (paths[i] + ".gz").c_str() : paths[i].c_str());
+    }
+    result.name = class_names[type];
+    result.mode = mode;
+    result.files = files.size();
+    return true;
+}
+
+static double throughput(const Result& r) {
+    return r.in / r.seconds / 1e6;
+}
+
+static bool writeResults(const char* path, const std::vector<Result>& results, int runs) {
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        return false;
+    }
+    //One result per line, readResults depends on it
+    fprintf(f, "{\"ect_bench\": 1, \"runs\": %d, \"results\": [\n", runs);
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        fprintf(f, "  {\"class\": \"%s\", \"mode\": %u, \"files\": %u, \"in\": %llu, \"out\": %llu, \"seconds\": %.6f, \"mb_per_s\": %.4f, \"peak_rss_kb\": %ld}%s\n",
+                r.name.c_str(), r.mode, r.files, r.in, r.out, r.seconds, throughput(r), r.rss, i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "]}\n");
+    return !fclose(f);
+}
+
+static bool readResults(const char* path, std::vector<Result>& results) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        Result r;
+        char name[16];
+        double mbs;
+        if (sscanf(line, " {\"class\": \"%15[^\"]\", \"mode\": %u, \"files\": %u, \"in\": %llu, \"out\": %llu, \"seconds\": %lf, \"mb_per_s\": %lf, \"peak_rss_kb\": %ld",
+                   name, &r.mode, &r.files, &r.in, &r.out, &r.seconds, &mbs, &r.rss) == 8) {
+            r.name = name;
+            results.push_back(r);
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+//Prints the changes against the baseline, returns the number of regressions
+static unsigned compare(const std::vector<Result>& base, const std::vector<Result>& results, double threshold) {
+    unsigned regressions = 0;
+    printf("\n%-6s %5s %10s %10s %8s %12s %12s %10s %10s\n", "class", "mode", "base MB/s", "MB/s", "change", "base out", "out", "base KB", "peak KB");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        const Result* b = 0;
+        for (size_t k = 0; k < base.size() && !b; k++) {
+            if (base[k].name == r.name && base[k].mode == r.mode) {
+                b = &base[k];
+            }
+        }
+        if (!b) {
+            printf("%-6s %5u not in baseline\n", r.name.c_str(), r.mode);
+            continue;
+        }
+        double change = (throughput(r) / throughput(*b) - 1) * 100;
+        printf("%-6s %5u %10.3f %10.3f %7.1f%% %12llu %12llu %10ld %10ld", r.name.c_str(), r.mode, throughput(*b), throughput(r), change, b->out, r.out, b->rss, r.rss);
+        if (b->in != r.in || b->files != r.files) {
+            printf("  corpus differs, only speed compared");
+        }
+        else if (r.out > b->out) {
+            printf("  LARGER OUTPUT");
+            regressions++;
+        }
+        if (change < -threshold) {
+            printf("  SLOWER");
+            regressions++;
+        }
+        if (r.rss > b->rss * (1 + threshold / 100)) {
+            printf("  MORE MEMORY");
+            regressions++;
+        }
+        printf("\n");
+    }
+    return regressions;
+}
+
+int main(int argc, const char** argv) {
+    int runs = 3;
+    std::vector<unsigned> modes;
+    const char* output = "bench.json";
+    const char* baseline = 0;
+    double threshold = 10;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "-n")) {
+            runs = atoi(argv[++i]);
+        } else if (i + 1 < argc && !strcmp(argv[i], "-m")) {
+            char* end;
+            for (const char* m = argv[++i]; *m; m = *end == ',' ? end + 1 : end) {
+                modes.push_back(strtoul(m, &end, 10));
+                if (end == m || !modes.back()) {
+                    printf("Invalid modes: %s\n", argv[i]);
+                    return 1;
+                }
+            }
+        } else if (i + 1 < argc && !strcmp(argv[i], "-o")) {
+            output = argv[++i];
+        } else if (i + 1 < argc && !strcmp(argv[i], "-c")) {
+            baseline = argv[++i];
+        } else if (i + 1 < argc && !strcmp(argv[i], "-t")) {
+            threshold = atof(argv[++i]);
+        } else {
+            printf("Usage: bench-ect [-n runs] [-m modes] [-o results.json] [-c baseline.json] [-t percent]\n");
+            return 1;
+        }
+    }
+    if (modes.empty()) {
+        modes.push_back(1);
+        modes.push_back(3);
+    }
+    if (runs < 1) {
+        runs = 1;
+    }
+
+    std::vector<Result> base;
+    if (baseline && !readResults(baseline, base)) {
+        printf("%s: can't read baseline\n", baseline);
+        return 1;
+    }
+    mkdir("bench-ect.tmp", 0777);
+    mkdir(CORPUS_DIR, 0777);
+    mkdir(RUN_DIR, 0777);
+    std::vector<std::string> files[CLASSES];
+    if (!generatePNGs(files[CLASS_PNG]) || !generateJPEGs(files[CLASS_JPEG]) || !generateData(files[CLASS_GZIP])) {
+        printf("Can't write the corpus to " CORPUS_DIR "\n");
+        return 1;
+    }
+    const char* const zipped[] = {"text.txt", "records.bin", "photo.png", "photo.jpg"};
+    files[CLASS_ZIP].assign(zipped, zipped + 4);
+
+    std::vector<Result> results;
+    printf("%-6s %5s %6s %12s %12s %10s %10s\n", "class", "mode", "files", "in", "out", "MB/s", "peak KB");
+    for (size_t m = 0; m < modes.size(); m++) {
+        for (unsigned type = 0; type < CLASSES; type++) {
+            //Fastest run, but the highest peak memory
+            Result best;
+            for (int r = 0; r < runs; r++) {
+                Result run;
+                if (!runClass((FileClass)type, files[type], modes[m], run)) {
+                    printf("%s at mode %u failed\n", class_names[type], modes[m]);
+                    return 1;
+                }
+                if (!r || run.seconds < best.seconds) {
+                    long rss = r ? best.rss : 0;
+                    best = run;
+                    best.rss = rss > run.rss ? rss : run.rss;
+                } else if (run.rss > best.rss) {
+                    best.rss = run.rss;
+                }
+            }
+            printf("%-6s %5u %6u %12llu %12llu %10.3f %10ld\n", best.name.c_str(), best.mode, best.files, best.in, best.out, throughput(best), best.rss);
+            results.push_back(best);
+        }
+    }
+    if (!writeResults(output, results, runs)) {
+        printf("%s: can't write results\n", output);
+        return 1;
+    }
+    printf("Results written to %s\n", output);
+    if (baseline) {
+        unsigned regressions = compare(base, results, threshold);
+        printf("%u regression%s\n", regressions, regressions == 1 ? "" : "s");
+        return regressions ? 1 : 0;
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+//  inflate.cpp
+//  Efficient Compression Tool
+//  Times the inflate paths used for PNG, ZIP and gzip input.
+//  Built with "make bench-inflate", not part of ECT itself.
+//  Usage: bench-inflate [-n runs] files...
+
+#include "../lodepng/lodepng.h"
+#include "../gztools.h"
+#include "../zlib/zlib.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+
+//lodepng_inflate as it was before it inflated straight into the output: through a 32 KB buffer,
+//growing the output by 32 KB at a time.
+static unsigned bounceInflate(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize) {
+    z_stream inf;
+    memset(&inf, 0, sizeof(inf));
+    inf.next_in = (z_const Byte *)in;
+    inf.avail_in = (uInt)insize;
+    unsigned char buf[32768];
+    inf.next_out = buf;
+    inf.avail_out = sizeof(buf);
+    if (inflateInit2(&inf, -15) != Z_OK) {
+        return 83;
+    }
+    while (1) {
+        int err = inflate(&inf, Z_SYNC_FLUSH);
+        size_t produced = sizeof(buf) - inf.avail_out;
+        if (err != Z_OK && err != Z_STREAM_END) {
+            inflateEnd(&inf);
+            return 95;
+        }
+        *out = (unsigned char*)realloc(*out, *outsize + produced);
+        memcpy(*out + *outsize, buf, produced);
+        *outsize += produced;
+        inf.next_out = buf;
+        inf.avail_out = sizeof(buf);
+        if (err == Z_STREAM_END) {
+            break;
+        }
+    }
+    inflateEnd(&inf);
+    return 0;
+}
+
+static std::vector<unsigned char> compress(const std::vector<unsigned char>& data) {
+    z_stream def;
+    memset(&def, 0, sizeof(def));
+    deflateInit2(&def, 9, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    std::vector<unsigned char> out(deflateBound(&def, data.size()) + 64);
+    def.next_in = (Bytef*)(data.empty() ? 0 : &data[0]);
+    def.avail_in = data.size();
+    def.next_out = &out[0];
+    def.avail_out = out.size();
+    deflate(&def, Z_FINISH);
+    out.resize(def.total_out);
+    deflateEnd(&def);
+    return out;
+}
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, const char** argv) {
+    int runs = 20;
+    int first = 1;
+    if (argc > 2 && !strcmp(argv[1], "-n")) {
+        runs = atoi(argv[2]);
+        first = 3;
+    }
+    if (first >= argc) {
+        printf("Usage: bench-inflate [-n runs] files...\n");
+        return 1;
+    }
+    const char* gzpath = "bench-inflate.tmp.gz";
+    const char* outpath = "bench-inflate.tmp";
+    printf("%-30s %10s %10s %10s %10s  (MB/s of inflated data)\n", "file", "size", "inflate", "old", "ungz");
+    double total[3] = {0, 0, 0};
+    size_t totalsize = 0;
+    for (int i = first; i < argc; i++) {
+        std::vector<unsigned char> data;
+        lodepng::load_file(data, argv[i]);
+        if (data.empty()) {
+            printf("%s: can't read\n", argv[i]);
+            continue;
+        }
+        std::vector<unsigned char> raw = compress(data);
+        //The same stream in a minimal gzip wrapper
+        unsigned char header[10] = {31, 139, 8, 0, 0, 0, 0, 0, 0, 3};
+        unsigned trailer[2] = {(unsigned)crc32(0, &data[0], data.size()), (unsigned)data.size()};
+        FILE* f = fopen(gzpath, "wb");
+        if (!f) {
+            return 1;
+        }
+        fwrite(header, 1, sizeof(header), f);
+        fwrite(&raw[0], 1, raw.size(), f);
+        for (int k = 0; k < 2; k++) {
+            unsigned char le[4] = {(unsigned char)trailer[k], (unsigned char)(trailer[k] >> 8),
+                                   (unsigned char)(trailer[k] >> 16), (unsigned char)(trailer[k] >> 24)};
+            fwrite(le, 1, 4, f);
+        }
+        fclose(f);
+
+        double t[3];
+        for (int k = 0; k < 3; k++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (int r = 0; r < runs; r++) {
+                unsigned char* out = 0;
+                size_t outsize = 0;
+                unsigned error = 0;
+                if (k == 0) {
+                    error = lodepng_inflate(&out, &outsize, &raw[0], raw.size());
+                } else if (k == 1) {
+                    error = bounceInflate(&out, &outsize, &raw[0], raw.size());
+                } else {
+                    error = ungz(gzpath, outpath);
+                    outsize = data.size();
+                }
+                if (error || outsize != data.size() || (out && memcmp(out, &data[0], outsize))) {
+                    printf("%s: decode mismatch\n", argv[i]);
+                    return 1;
+                }
+                free(out);
+            }
+            t[k] = seconds(start);
+            total[k] += t[k];
+        }
+        std::vector<unsigned char> ungzipped;
+        lodepng::load_file(ungzipped, outpath);
+        if (ungzipped != data) {
+            printf("%s: ungz mismatch\n", argv[i]);
+            return 1;
+        }
+        totalsize += data.size();
+        printf("%-30.30s %10zu %10.0f %10.0f %10.0f\n", argv[i], data.size(), data.size() * runs / t[0] / 1e6,
+               data.size() * runs / t[1] / 1e6, data.size() * runs / t[2] / 1e6);
+    }
+    unlink(gzpath);
+    unlink(outpath);
+    printf("%-30s %10zu %10.0f %10.0f %10.0f\n", "total", totalsize, totalsize * runs / total[0] / 1e6,
+           totalsize * runs / total[1] / 1e6, totalsize * runs / total[2] / 1e6);
+    return 0;
+}
@@ -0,0 +1,162 @@
+//  kernels.cpp
+//  Efficient Compression Tool
+//  Checks the SIMD PNG filter kernels against the scalar ones and times them.
+//  Built with "make bench-kernels", not part of ECT itself.
+
+#include "../lodepng/lodepng.cpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+typedef unsigned (*UnfilterScanlineFunc)(unsigned char* recon, const unsigned char* scanline,
+                                         const unsigned char* precon, size_t bytewidth,
+                                         unsigned char filterType, size_t length);
+
+struct FilterKernel {
+    const char* name;
+    FilterScanlineFunc filter;
+};
+
+static const size_t bytewidths[] = {1, 2, 3, 4, 6, 8};
+
+//Smooth rows with some noise, closer to real images than plain random bytes
+static void fillRow(unsigned char* row, size_t length, unsigned seed) {
+    srand(seed);
+    unsigned v = rand();
+    for (size_t i = 0; i < length; i++) {
+        v += rand() % 7 - 3;
+        row[i] = (unsigned char)(v + (rand() % 16 ? 0 : rand()));
+    }
+}
+
+static std::vector<FilterKernel> kernels() {
+    std::vector<FilterKernel> k;
+    FilterKernel scalar = {"scalar", filterScanlineScalar};
+    k.push_back(scalar);
+#ifdef LODEPNG_X86_SIMD
+    FilterKernel sse2 = {"sse2", filterScanlineSSE2};
+    k.push_back(sse2);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        FilterKernel avx2 = {"avx2", filterScanlineAVX2};
+        k.push_back(avx2);
+    }
+#endif
+    return k;
+}
+
+static int check(const std::vector<FilterKernel>& k) {
+    unsigned char prev[520], cur[520], ref[520], out[520], recon[520];
+    int errors = 0;
+    for (unsigned bw = 0; bw < sizeof(bytewidths) / sizeof(bytewidths[0]); bw++) {
+        size_t bytewidth = bytewidths[bw];
+        for (size_t length = bytewidth; length <= 512; length += bytewidth) {
+            fillRow(prev, length, length);
+            fillRow(cur, length, length + 1);
+            for (unsigned char type = 0; type < 5; type++) {
+                for (int hasprev = 0; hasprev < 2; hasprev++) {
+                    const unsigned char* p = hasprev ? prev : 0;
+                    filterScanlineScalar(ref, cur, p, length, bytewidth, type);
+                    for (size_t i = 1; i < k.size(); i++) {
+                        k[i].filter(out, cur, p, length, bytewidth, type);
+                        if (memcmp(out, ref, length)) {
+                            printf("%s filter mismatch: bytewidth %zu length %zu type %u prev %d\n",
+                                   k[i].name, bytewidth, length, type, hasprev);
+                            errors++;
+                        }
+                    }
+                    unfilterScanline(recon, ref, p, bytewidth, type, length);
+                    if (memcmp(recon, cur, length)) {
+                        printf("unfilter mismatch: bytewidth %zu length %zu type %u prev %d\n",
+                               bytewidth, length, type, hasprev);
+                        errors++;
+                    }
+                    unsigned count[256], naive[256] = {0};
+                    size_t sum = 0;
+                    byteHistogram(ref, length, count);
+                    for (size_t i = 0; i < length; i++) {
+                        naive[ref[i]]++;
+                        sum += type == 0 || ref[i] < 128 ? ref[i] : 255 - ref[i];
+                    }
+                    if (memcmp(count, naive, sizeof(count)) || minsumScore(ref, length, type) != sum) {
+                        printf("scoring mismatch: length %zu type %u\n", length, type);
+                        errors++;
+                    }
+                }
+            }
+        }
+    }
+    return errors;
+}
+
+static double mbps(size_t bytes, std::chrono::steady_clock::time_point start) {
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return bytes / s / 1e6;
+}
+
+int main(int argc, const char** argv) {
+    size_t length = 8192;
+    size_t rows = argc > 1 ? atoi(argv[1]) : 4096;
+    std::vector<FilterKernel> k = kernels();
+    int errors = check(k);
+    printf("correctness: %d mismatches\n", errors);
+    if (errors) {
+        return 1;
+    }
+
+    std::vector<unsigned char> prev(length), cur(length), out(length), recon(length);
+    fillRow(&prev[0], length, 1);
+    fillRow(&cur[0], length, 2);
+    printf("%-5s %-4s", "bpp", "type");
+    for (size_t i = 0; i < k.size(); i++) {
+        printf(" %10s", k[i].name);
+    }
+    printf(" %10s %10s  (MB/s)\n", "unf-scalar", "unfilter");
+    for (unsigned bw = 0; bw < sizeof(bytewidths) / sizeof(bytewidths[0]); bw++) {
+        size_t bytewidth = bytewidths[bw];
+        for (unsigned char type = 1; type < 5; type++) {
+            printf("%-5zu %-4u", bytewidth, type);
+            for (size_t i = 0; i < k.size(); i++) {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                for (size_t y = 0; y < rows; y++) {
+                    k[i].filter(&out[0], &cur[0], &prev[0], length, bytewidth, type);
+                }
+                printf(" %10.0f", mbps(length * rows, start));
+            }
+            UnfilterScanlineFunc unfilters[2] = {unfilterScanlineScalar, unfilterScanline};
+            for (int i = 0; i < 2; i++) {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                for (size_t y = 0; y < rows; y++) {
+                    unfilters[i](&recon[0], &out[0], &prev[0], bytewidth, type, length);
+                }
+                printf(" %10.0f", mbps(length * rows, start));
+            }
+            printf("\n");
+        }
+    }
+
+    const char* scores[3] = {"minsum", "histogram", "naive-hist"};
+    for (int s = 0; s < 3; s++) {
+        unsigned count[256];
+        size_t sum = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t y = 0; y < rows; y++) {
+            if (s == 0) {
+                sum += minsumScore(&out[0], length, 1);
+            } else if (s == 1) {
+                byteHistogram(&out[0], length, count);
+                sum += count[y & 255];
+            } else {
+                memset(count, 0, sizeof(count));
+                for (size_t i = 0; i < length; i++) {
+                    count[out[i]]++;
+                }
+                sum += count[y & 255];
+            }
+        }
+        printf("%-10s %10.0f MB/s (%zu)\n", scores[s], mbps(length * rows, start), sum);
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+//  manifest.cpp
+//  Efficient Compression Tool
+//  Checks that the -zip manifest only lets entries be skipped under the settings they were optimized with.
+//  Built with "make check-manifest", not part of ECT itself.
+
+#include "../leanify/zip.cpp"
+#include <cstdio>
+#include <map>
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+    if (!ok) {
+        printf("FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static ECTOptions settings(unsigned flags, unsigned palette_sort) {
+    ECTOptions Options = ECTOptions();
+    Options.Mode = 3;
+    Options.strip = flags & 1;
+    Options.Progressive = flags >> 1 & 1;
+    Options.Arithmetic = flags >> 2 & 1;
+    Options.Strict = flags >> 3 & 1;
+    Options.Reuse = flags >> 4 & 1;
+    Options.Allfilters = flags >> 5 & 1;
+    Options.Allfiltersbrute = flags >> 6 & 1;
+    Options.Allfilterscheap = flags >> 7 & 1;
+    Options.palette_sort = palette_sort << 8;
+    return Options;
+}
+
+//Every combination of flags and --pal_sort count gets its own key
+static void checkKeys() {
+    std::map<unsigned, unsigned> seen;
+    for (unsigned flags = 0; flags < 256; flags++) {
+        for (unsigned palette_sort = 0; palette_sort <= 120; palette_sort++) {
+            unsigned key = SettingsKey(settings(flags, palette_sort));
+            unsigned id = flags << 8 | palette_sort;
+            if (seen.count(key)) {
+                printf("FAIL: flags %x pal_sort %u and flags %x pal_sort %u share key %x\n",
+                       seen[key] >> 8, seen[key] & 0xFF, flags, palette_sort, key);
+                failures++;
+            }
+            seen[key] = id;
+        }
+    }
+    check(SettingsKey(settings(1, 0)) != SettingsKey(settings(0, 1)), "-strip and --pal_sort=1 share a key");
+}
+
+//An archive with one entry optimized at mode, OptimizedEntries must only accept the same mode and settings
+static size_t reuse(unsigned mode, const ECTOptions& written, const ECTOptions& Options) {
+    const char name[] = "a.png";
+    std::vector<uint8_t> base(sizeof(LocalHeader) + sizeof(name) - 1);
+    memcpy(&base[sizeof(LocalHeader)], name, sizeof(name) - 1);
+    Entry entry = Entry();
+    entry.header.crc32 = 0x12345678;
+    entry.header.compression_method = 8;
+    entry.header.filename_len = sizeof(name) - 1;
+    entry.compressed_size = 100;
+    entry.uncompressed_size = 200;
+    vector<Entry> entries(1, entry);
+    string comment = ManifestComment(mode, SettingsKey(written), entries, 1, base.data());
+    return OptimizedEntries(comment.data(), comment.size(), Options, entries, base.data());
+}
+
+static void checkModes() {
+    ECTOptions Options = settings(0, 0);
+    check(reuse(3, Options, Options) == 1, "the same mode and settings are not reused");
+    check(reuse(9, Options, Options) == 0, "-9 results are reused at -3");
+    check(reuse(10002, Options, Options) == 0, "-10002 results are reused at -3");
+    Options.Mode = 60;
+    check(reuse(9, Options, Options) == 0, "-9 results are reused at -60");
+    Options.Mode = 3;
+    check(reuse(3, settings(1, 0), settings(0, 1)) == 0, "-strip results are reused with --pal_sort=1");
+    check(reuse(3, settings(0, 1), settings(1, 0)) == 0, "--pal_sort=1 results are reused with -strip");
+}
+
+int main() {
+    checkKeys();
+    checkModes();
+    printf(failures ? "%d checks failed\n" : "All checks passed\n", failures);
+    return failures != 0;
+}
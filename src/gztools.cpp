@@ -14,6 +14,9 @@
 #include <cstdlib>
 #include <unistd.h>
 
+//At least twice GZBUFSIZE, so gzread inflates straight into buf instead of going through its own output buffer.
+#define UNGZ_CHUNK (1 << 18)
+
 int ungz(const char * Infile, const char * Outfile){
     gzFile r = gzopen(Infile, "rb");
     if (!r){
@@ -21,12 +24,18 @@ int ungz(const char * Infile, const char * Outfile){
     }
     FILE * stream = fopen (Outfile, "wb");
     if (!stream){
+        gzclose_r(r);
+        return 1;
+    }
+    char * buf = (char*)malloc(UNGZ_CHUNK);
+    if (!buf){
+        gzclose_r(r);
+        fclose(stream);
         return 1;
     }
-    char buf [8192];
     int bytes;
     do {
-        bytes = gzread(r, &buf, 8192);
+        bytes = gzread(r, buf, UNGZ_CHUNK);
       if(bytes){
         fwrite(buf, 1, bytes, stream);
       }
@@ -35,6 +44,7 @@ int ungz(const char * Infile, const char * Outfile){
       }
       else if (bytes < 0) {
         printf("%s: ungzip error\n", Infile);
+        free(buf);
         gzclose_r(r);
         fclose(stream);
         unlink(Outfile);
@@ -42,6 +52,7 @@ int ungz(const char * Infile, const char * Outfile){
       }
     }
     while (!gzeof(r));
+    free(buf);
     gzclose_r(r);
     fclose(stream);
   return 0;
@@ -0,0 +1,755 @@
+//  handlers.cpp
+//  Efficient Compression Tool
+//  Created by Felix Hanau on 19.12.14.
+//  Copyright (c) 2014-2016 Felix Hanau.
+
+#include "main.h"
+#include "support.h"
+#include "stats.h"
+#include "lodepng/lodepng.h"
+#include "miniz/miniz.h"
+#include "leanify/zip.h"
+#include "zopfli/squeeze.h"
+#include "zlib/zlib.h"
+#include <unistd.h>
+#include <limits.h>
+#include <unordered_set>
+#include <exception>
+#include <new>
+#include <algorithm>
+
+#ifndef NOMULTI
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#endif
+
+#ifdef MP3_SUPPORTED
+#include <id3/tag.h>
+#endif
+
+static size_t processedfiles;
+static size_t bytes;
+static long long savings;
+#ifndef NOMULTI
+static std::atomic<size_t> skippedpayloads;
+#else
+static size_t skippedpayloads;
+#endif
+
+//Checks whether recompressing a deflate payload can't beat target bytes and counts skipped payloads
+bool SkipIncompressible(const unsigned char* in, size_t insize, size_t target){
+    if(!ZopfliIncompressible(in, insize, target)){
+        return false;
+    }
+    skippedpayloads++;
+    return true;
+}
+
+void ECT_ReportSavings(){
+    if (processedfiles){
+        printf("Processed %zu file%s\n", processedfiles, processedfiles > 1 ? "s":"");
+        size_t skipped = skippedpayloads;
+        if (skipped){
+            printf("Skipped recompression of %zu incompressible entr%s\n", skipped, skipped > 1 ? "ies":"y");
+        }
+        if (savings < 0){
+            printf("Result is bigger\n");
+            return;
+        }
+
+        int bk = 0;
+        int k = 0;
+        double smul = savings;
+        double bmul = bytes;
+        while (smul > 1024) {smul /= 1024; k++;}
+        while (bmul > 1024) {bmul /= 1024; bk++;}
+        char *counter;
+        if (k == 1) {counter = (char *)"K";}
+        else if (k == 2) {counter = (char *)"M";}
+        else if (k == 3) {counter = (char *)"G";}
+        else {counter = (char *)"";}
+        char *counter2;
+        if (bk == 1){counter2 = (char *)"K";}
+        else if (bk == 2){counter2 = (char *)"M";}
+        else if (bk == 3){counter2 = (char *)"G";}
+        else {counter2 = (char *)"";}
+        printf("Saved ");
+        if (k == 0){printf("%0.0f", smul);}
+        else{printf("%0.2f", smul);}
+        printf("%sB out of ", counter);
+        if (bk == 0){printf("%0.0f", bmul);}
+        else{printf("%0.2f", bmul);}
+        printf("%sB (%0.4f%%)\n", counter2, (100.0 * savings)/bytes);}
+    else {printf("No compatible files found\n");}
+}
+
+static int ECTGzip(const char * Infile, const unsigned Mode, unsigned char multithreading, long long fs, unsigned ZIP, int strict){
+    if (!fs){
+        printf("%s: Compression of empty files is currently not supported\n", Infile);
+        return 2;
+    }
+    int isGZ = IsGzip(Infile);
+    if(isGZ == 2){
+        return 2;
+    }
+    if(isGZ == 3 && strict){
+        printf("%s: File includes extra field, file name or comment, can't be optimized in strict mode\n", Infile);
+        return 2;
+    }
+    if (ZIP || !isGZ){
+        if (exists(((std::string)Infile).append(ZIP ? ".zip" : ".gz").c_str())){
+            printf("%s: Compressed file already exists\n", Infile);
+            return 2;
+        }
+        ZopfliGzip(Infile, 0, Mode, multithreading, ZIP);
+        return 1;
+    }
+    if (exists(((std::string)Infile).append(".ungz").c_str())){
+        return 2;
+    }
+    if (exists(((std::string)Infile).append(".ungz.gz").c_str())){
+        return 2;
+    }
+    if(ungz(Infile, ((std::string)Infile).append(".ungz").c_str())){
+        return 2;
+    }
+    //Leave streams of already compressed data alone when zopfli can't beat them
+    FILE* stream = fopen(((std::string)Infile).append(".ungz").c_str(), "rb");
+    if(stream){
+        std::vector<unsigned char> data(filesize(((std::string)Infile).append(".ungz").c_str()) + 8);
+        size_t size = fread(data.data(), 1, data.size() - 8, stream);
+        fclose(stream);
+        if(SkipIncompressible(data.data(), size, fs)){
+            unlink(((std::string)Infile).append(".ungz").c_str());
+            return 0;
+        }
+    }
+    ZopfliGzip(((std::string)Infile).append(".ungz").c_str(), 0, Mode, multithreading, ZIP);
+    if (filesize(((std::string)Infile).append(".ungz.gz").c_str()) < filesize(Infile)){
+        unlink(Infile);
+        rename(((std::string)Infile).append(".ungz.gz").c_str(), Infile);
+    }
+    else {
+        unlink(((std::string)Infile).append(".ungz.gz").c_str());
+    }
+    unlink(((std::string)Infile).append(".ungz").c_str());
+    return 0;
+}
+
+//strategy is set to the filter strategy of the PNG that was written, it stays -1 if the file is unchanged
+static unsigned char OptimizePNG(const char * Infile, const ECTOptions& Options, int* strategy){
+    unsigned _mode = Options.Mode;
+    unsigned mode = (Options.Mode % 10000) > 9 ? 9 : (Options.Mode % 10000);
+    if (mode == 1 && Options.Reuse){
+        mode++;
+    }
+    int x = 1;
+    long long size = filesize(Infile);
+    if(size < 0){
+        printf("Can't read from %s\n", Infile);
+        return 1;
+    }
+    if(mode == 9 && !Options.Reuse && !Options.Allfilters){
+        x = Zopflipng(Options.strip, Infile, Options.Strict, 3, 0, Options.DeflateMultithreading, Options.Threads, 0);
+        if(x < 0){
+            return 1;
+        }
+        if(!x){
+            *strategy = 0;
+        }
+    }
+    //Disabled as using this causes libpng warnings
+    //int filter = Optipng(Options.Mode, Infile, true, Options.Strict || Options.Mode > 1);
+    int filter = 0;
+    //Also run for tiny images: guessing the filter from the header loses up to 2% on them, and always
+    //filtering is slower as the filtered strategies cost Zopflipng more than this trial does
+    if (!Options.Allfilters){
+        filter = Options.Reuse ? 6 : Optipng(mode, Infile, false, Options.Strict || mode > 1);
+    }
+
+    if (filter == -1){
+        return 1;
+    }
+    if(filter && !Options.Allfilters && Options.Allfilterscheap && !Options.Reuse){
+        filter = 15;
+    }
+    if (mode != 1){
+        if (Options.Allfilters){
+            //Strategies that pick the same filters are only compressed once
+            static const int filters[] = {6, 0, 5, 1, 2, 3, 4, 7, 8, 11, 12, 13, 9, 10, 14};
+            PNGTrialCache* cache = ZopflipngCreateCache();
+            x = Zopflipng(Options.strip, Infile, Options.Strict, _mode, filters[0] + Options.palette_sort, Options.DeflateMultithreading, Options.Threads, cache);
+            if(x < 0){
+                ZopflipngFreeCache(cache);
+                return 1;
+            }
+            if(!x){
+                *strategy = filters[0];
+            }
+            for (unsigned i = 1; i < (Options.Allfiltersbrute ? 15 : 12); i++){
+                if(!Zopflipng(Options.strip, Infile, Options.Strict, _mode, filters[i] + Options.palette_sort, Options.DeflateMultithreading, Options.Threads, cache)){
+                    *strategy = filters[i];
+                }
+            }
+            ZopflipngFreeCache(cache);
+        }
+        else if (mode == 9){
+            if(!Zopflipng(Options.strip, Infile, Options.Strict, _mode, filter + Options.palette_sort, Options.DeflateMultithreading, Options.Threads, 0)){
+                *strategy = filter;
+            }
+        }
+        else {
+            x = Zopflipng(Options.strip, Infile, Options.Strict, _mode, filter + Options.palette_sort, Options.DeflateMultithreading, Options.Threads, 0);
+            if(x < 0){
+                return 1;
+            }
+            if(!x){
+                *strategy = filter;
+            }
+        }
+    }
+    else {
+        if (filesize(Infile) <= size){
+            unlink(((std::string)Infile).append(".bak").c_str());
+            //Optipng filters with libpng's heuristic, which is minsum
+            *strategy = filter ? LFS_MINSUM : LFS_ZERO;
+        }
+        else {
+            unlink(Infile);
+            rename(((std::string)Infile).append(".bak").c_str(), Infile);
+        }
+    }
+
+    if(Options.strip && x){
+        Optipng(0, Infile, false, 0);
+    }
+    return 0;
+}
+
+static unsigned char OptimizeJPEG(const char * Infile, const ECTOptions& Options){
+    size_t stsize = 0;
+
+    int res = mozjpegtran(Options.Arithmetic, Options.Progressive && (Options.Mode > 1 || filesize(Infile) > 5000), Options.strip, Infile, Infile, &stsize);
+    if (Options.Progressive && Options.Mode > 1 && res != 2){
+        if(res == 1 || (Options.Mode == 2 && stsize < 6500) || (Options.Mode == 3 && stsize < 10000) || (Options.Mode == 4 && stsize < 15000) || (Options.Mode > 4 && stsize < 20000)){
+            res = mozjpegtran(Options.Arithmetic, false, Options.strip, Infile, Infile, &stsize);
+        }
+    }
+    return res == 2;
+}
+
+#ifdef MP3_SUPPORTED
+static void OptimizeMP3(const char * Infile, const ECTOptions& Options){
+    ID3_Tag orig (Infile);
+    size_t start = orig.Size();
+    ID3_Frame* picFrame = orig.Find(ID3FID_PICTURE);
+    if (picFrame)
+    {
+        ID3_Field* mime = picFrame->GetField(ID3FN_MIMETYPE);
+        if (mime){
+            char mimetxt[20];
+            mime->Get(mimetxt, 19);
+            ID3_Field* pic = picFrame->GetField(ID3FN_DATA);
+            bool ispng = memcmp(mimetxt, "image/png", 9) == 0 || memcmp(mimetxt, "PNG", 3) == 0;
+            if (pic && (memcmp(mimetxt, "image/jpeg", 10) == 0 || ispng)){
+                pic->ToFile("out.jpg");
+                if (ispng){
+                    int strategy = -1;
+                    OptimizePNG("out.jpg", Options, &strategy);
+                }
+                else{
+                    OptimizeJPEG("out.jpg", Options);
+                }
+                pic->FromFile("out.jpg");
+                unlink("out.jpg");
+                orig.SetPadding(false);
+                //orig.SetCompression(true);
+                if (orig.Size() < start){
+                    orig.Update();
+                }
+            }
+        }
+    }
+}
+#endif
+
+//Reads color type and bit depth from the header of a PNG file
+static void ReadPNGColor(const char * Infile, int* colortype, int* bitdepth){
+    FILE* stream = fopen(Infile, "rb");
+    if(!stream){
+        return;
+    }
+    unsigned char header[26];
+    if(fread(header, 1, sizeof(header), stream) == sizeof(header) && memcmp(header + 12, "IHDR", 4) == 0){
+        *bitdepth = header[24];
+        *colortype = header[25];
+    }
+    fclose(stream);
+}
+
+//Returns whether a JPEG file is progressive, -1 if it has no frame header
+static int IsProgressiveJPEG(const char * Infile){
+    FILE* stream = fopen(Infile, "rb");
+    if(!stream){
+        return -1;
+    }
+    int progressive = -1;
+    unsigned char marker[4];
+    if(fread(marker, 1, 2, stream) == 2 && marker[0] == 0xFF && marker[1] == 0xD8){
+        while(fread(marker, 1, 4, stream) == 4 && marker[0] == 0xFF){
+            //SOF markers, C4, C8 and CC are other segments
+            if(marker[1] >= 0xC0 && marker[1] <= 0xCF && marker[1] != 0xC4 && marker[1] != 0xC8 && marker[1] != 0xCC){
+                progressive = (marker[1] & 3) == 2;
+                break;
+            }
+            if(fseek(stream, (marker[2] << 8 | marker[3]) - 2, SEEK_CUR)){
+                break;
+            }
+        }
+    }
+    fclose(stream);
+    return progressive;
+}
+
+unsigned fileHandler(const char * Infile, const ECTOptions& Options, int internal){
+    std::string Ext = Infile;
+    std::string x = Ext.substr(Ext.find_last_of(".") + 1);
+    time_t t;
+    unsigned error = 0;
+
+    if ((Options.PNG_ACTIVE && (x == "PNG" || x == "png")) || (Options.JPEG_ACTIVE && (x == "jpg" || x == "JPG" || x == "JPEG" || x == "jpeg")) || (Options.Gzip && !internal)){
+        if(Options.keep){
+            t = get_file_time(Infile);
+        }
+        long long size = filesize(Infile);
+        if (size < 0){
+            printf("%s: bad file\n", Infile);
+            return 1;
+        }
+        int statcompressedfile = 0;
+        if (size < 1200000000) {//completely random value
+            ECTStatsTimer timer;
+            ECT_StatsFileStart(&timer);
+            ECTFileRecord record = {Infile, 0, ECT_FILE_PNG, size, -1, -1, -1, -1, -1, Options.Mode, 0};
+            if (x == "PNG" || x == "png"){
+                error = OptimizePNG(Infile, Options, &record.filter);
+            }
+            else if (x == "jpg" || x == "JPG" || x == "JPEG" || x == "jpeg"){
+                error = OptimizeJPEG(Infile, Options);
+                record.type = ECT_FILE_JPEG;
+            }
+            else {
+                statcompressedfile = ECTGzip(Infile, Options.Mode, Options.DeflateMultithreading, size, Options.Zip, Options.Strict);
+                record.type = statcompressedfile && Options.Zip ? ECT_FILE_ZIP : ECT_FILE_GZIP;
+                if (statcompressedfile == 2){
+                    record.error = 1;
+                    ECT_LogFile(&timer, &record);
+                    return 1;
+                }
+            }
+            long long outsize = statcompressedfile ? filesize(((std::string)Infile).append(Options.Zip ? ".zip" : ".gz").c_str()) : filesize(Infile);
+            ECT_StatsFileStop(&timer, record.type, size, outsize < 0 ? 0 : outsize);
+            if(!internal){
+                record.out = outsize;
+                record.error = error;
+                if(record.type == ECT_FILE_PNG && ECT_JSONLogActive()){
+                    ReadPNGColor(Infile, &record.colortype, &record.bitdepth);
+                }
+                else if(record.type == ECT_FILE_JPEG && ECT_JSONLogActive()){
+                    record.progressive = IsProgressiveJPEG(Infile);
+                }
+                ECT_LogFile(&timer, &record);
+            }
+            else{
+                ECT_StatsFileEnd(&timer);
+            }
+            if(Options.SavingsCounter && !internal){
+                processedfiles++;
+                bytes += size;
+                savings += size - outsize;
+            }
+        }
+        else{printf("File too big\n");}
+        if(Options.keep && !statcompressedfile){
+            set_file_time(Infile, t);
+        }
+    }
+#ifdef MP3_SUPPORTED
+    else if(x == "mp3"){
+        OptimizeMP3(Infile, Options);
+    }
+#endif
+    return error;
+}
+
+struct ZipEntry{
+    std::string name;
+    std::string path;
+    unsigned char* data;
+    size_t size;
+    size_t uncompressed_size;
+    unsigned crc;
+    unsigned method;
+    bool failed;
+};
+
+//Reads, optimizes and compresses a file for a new archive entry.
+static void CompressZipEntry(ZipEntry& entry, const ECTOptions& Options, const char* archive){
+    if(entry.name.back() == '/'){
+        return;
+    }
+    ECTStatsTimer timer;
+    ECT_StatsFileStart(&timer);
+    ECTFileRecord record = {entry.path.c_str(), archive, ECT_FILE_ZIP, (long long)entry.uncompressed_size, -1, -1, -1, -1, -1, Options.Mode, 1};
+    FILE* stream = fopen(entry.path.c_str(), "rb");
+    if(!stream){
+        entry.failed = true;
+        ECT_LogFile(&timer, &record);
+        return;
+    }
+    std::vector<unsigned char> file(entry.uncompressed_size);
+    bool ok = fread(file.data(), 1, file.size(), stream) == file.size();
+    fclose(stream);
+    if(!ok){
+        entry.failed = true;
+        ECT_LogFile(&timer, &record);
+        return;
+    }
+
+    //Same optimization ReZipFile applies to archive entries, including nested archives
+    size_t size = file.size();
+    if(size){
+        size = Zip(0, 0).RecompressFile(file.data(), size, 0, entry.name, Options);
+    }
+    entry.uncompressed_size = size;
+    //zlib's crc32 takes a 32-bit length
+    uLong crc = crc32(0, 0, 0);
+    for(size_t done = 0; done < size; done += 1u << 30){
+        crc = crc32(crc, file.data() + done, (uInt)std::min<size_t>(size - done, 1u << 30));
+    }
+    entry.crc = crc;
+
+    //Zopfli reads up to 8 bytes past the end of its input
+    file.resize(size + 8);
+    size_t compsize = 0;
+    if(size && !SkipIncompressible(file.data(), size, size)){
+        ZopfliBuffer(Options.Mode, Options.DeflateMultithreading, file.data(), size, &entry.data, &compsize);
+    }
+    if(compsize && compsize < size){
+        entry.size = compsize;
+        entry.method = 8;
+    }
+    else{
+        free(entry.data);
+        entry.data = (unsigned char*)malloc(size + 1);
+        if(!entry.data){
+            throw std::bad_alloc();
+        }
+        memcpy(entry.data, file.data(), size);
+        entry.size = size;
+        entry.method = 0;
+    }
+    record.out = entry.size;
+    record.error = 0;
+    ECT_LogFile(&timer, &record);
+}
+
+//Archive names are compared case insensitively like miniz does
+static std::string ZipNameKey(std::string name){
+    for(size_t i = 0; i < name.size(); i++){
+        name[i] = tolower((unsigned char)name[i]);
+    }
+    return name;
+}
+
+static void AddZipEntry(std::vector<ZipEntry>& entries, std::unordered_set<std::string>& names, const std::string& name, const std::string& path, int* error){
+    if(!names.insert(ZipNameKey(name)).second){
+        printf("%s: File already present in archive\n", name.c_str());
+        *error = 1;
+        return;
+    }
+    long long f = 0;
+    if(name.back() != '/'){
+        f = filesize(path.c_str());
+        if(f < 0){
+            printf("%s: can't read file\n", path.c_str());
+            return;
+        }
+        //miniz can't write ZIP64 entries, reject them before the file is read and compressed
+        if(f > 0xFFFFFFFFLL){
+            printf("%s: Files over 4 GB can't be added to ZIP archives\n", path.c_str());
+            *error = 1;
+            return;
+        }
+    }
+    ZipEntry entry;
+    entry.name = name;
+    entry.path = path;
+    entry.data = 0;
+    entry.size = 0;
+    entry.uncompressed_size = f;
+    entry.crc = 0;
+    entry.method = 0;
+    entry.failed = false;
+    entries.push_back(entry);
+}
+
+unsigned zipHandler(std::vector<int> args, const char * argv[], int files, const ECTOptions& Options){
+#ifdef _WIN32
+#define EXTSEP "\\"
+#else
+#define EXTSEP "/"
+#endif
+    std::string extension = ((std::string)argv[args[0]]).substr(((std::string)argv[args[0]]).find_last_of(".") + 1);
+    std::string zipfilename = argv[args[0]];
+    size_t local_bytes = 0;
+    size_t local_files = 0;
+    int i = 0;
+    time_t t = -1;
+    bool append = false;
+    ECTStatsTimer timer;
+    ECT_StatsFileStart(&timer);
+    if((extension=="zip" || extension=="ZIP" || IsZIP(argv[args[0]])) && !isDirectory(argv[args[0]])){
+        i++;
+        if(exists(argv[args[0]])){
+            local_bytes += filesize(zipfilename.c_str());
+            if(Options.keep){
+                t = get_file_time(argv[args[0]]);
+            }
+            append = true;
+        }
+    }
+    else{
+        //Construct name
+        if(!isDirectory(argv[args[0]])
+#ifdef BOOST_SUPPORTED
+           && boost::filesystem::is_regular_file(argv[args[0]])
+#endif
+           ){
+            if(zipfilename.find_last_of(".") > zipfilename.find_last_of("/\\")) {
+                zipfilename = zipfilename.substr(0, zipfilename.find_last_of("."));
+            }
+        }
+        else if(zipfilename.back() == '/' || zipfilename.back() == '\\'){
+            zipfilename.pop_back();
+        }
+
+        zipfilename += ".zip";
+        if(exists(zipfilename.c_str())){
+            printf("Error: ZIP file for chosen file/folder already exists, but you didn't list it.\n");
+            return 1;
+        }
+    }
+
+    //Entries already in the archive are optimized in place, new ones are compressed once while the archive is written
+    mz_zip_archive zip;
+    memset(&zip, 0, sizeof(zip));
+    std::unordered_set<std::string> names;
+    //miniz can't read ZIP64 archives, only open the archive if something is added to it
+    bool reading = append && i < files;
+    //Check that first, so an archive that can't be appended to is left untouched
+    if(reading){
+        if(!mz_zip_reader_init_file(&zip, zipfilename.c_str(), MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY)){
+            printf("%s: can't read archive\n", zipfilename.c_str());
+            return 1;
+        }
+        mz_zip_reader_end(&zip);
+    }
+    if(append){
+        ReZipFile(zipfilename.c_str(), Options, &local_files);
+    }
+    if(reading){
+        if(!mz_zip_reader_init_file(&zip, zipfilename.c_str(), MZ_ZIP_FLAG_DO_NOT_SORT_CENTRAL_DIRECTORY)){
+            printf("%s: can't read archive\n", zipfilename.c_str());
+            return 1;
+        }
+        std::vector<char> name;
+        for(unsigned j = 0; j < mz_zip_reader_get_num_files(&zip); j++){
+            name.resize(mz_zip_reader_get_filename(&zip, j, 0, 0));
+            mz_zip_reader_get_filename(&zip, j, name.data(), name.size());
+            names.insert(ZipNameKey(name.data()));
+        }
+    }
+
+    int error = 0;
+    std::vector<ZipEntry> entries;
+    for(; i < files; i++){
+        if(isDirectory(argv[args[i]])){
+#ifdef BOOST_SUPPORTED
+            std::string fold = boost::filesystem::canonical(argv[args[i]]).string();
+            int substr = boost::filesystem::path(fold).has_parent_path() ? boost::filesystem::path(fold).parent_path().string().length() + 1 : 0;
+
+            boost::filesystem::recursive_directory_iterator a(fold), b;
+            std::vector<boost::filesystem::path> paths(a, b);
+            for(unsigned j = 0; j < paths.size(); j++){
+                std::string path = paths[j].string();
+                std::string name = path.substr(substr);
+
+                if(isDirectory(path.c_str())){
+                    //Only add dir if it is empty to minimize filesize
+                    if(j + 1 == paths.size() || paths[j + 1].string().compare(0, path.size() + 1, path + EXTSEP) != 0){
+                        AddZipEntry(entries, names, name + EXTSEP, path, &error);
+                    }
+                }
+                else{
+                    AddZipEntry(entries, names, name, path, &error);
+                }
+            }
+            if(!paths.size()){
+                AddZipEntry(entries, names, fold.substr(substr) + EXTSEP, argv[args[i]], &error);
+            }
+#else
+            printf("%s: Zipping folders is not supported\n", argv[args[i]]);
+#endif
+        }
+        else{
+            std::string path = argv[args[i]];
+            AddZipEntry(entries, names, path.substr(path.find_last_of("/\\") + 1), path, &error);
+        }
+    }
+    for(unsigned j = 0; j < entries.size(); j++){
+        local_bytes += entries[j].uncompressed_size;
+    }
+
+    //ReZipFile already finished an archive nothing is added to
+    if(append && !entries.size()){
+        if(reading){
+            mz_zip_reader_end(&zip);
+        }
+    }
+    else if(append ? !mz_zip_writer_init_from_reader(&zip, zipfilename.c_str()) : entries.size() && !mz_zip_writer_init_file(&zip, zipfilename.c_str(), 0)){
+        printf("%s: can't write archive\n", zipfilename.c_str());
+        return 1;
+    }
+
+    //Entries are compressed in parallel and written in order as soon as they are done
+    std::exception_ptr exception;
+#ifndef NOMULTI
+    unsigned budget = Options.Threads ? Options.Threads : std::thread::hardware_concurrency();
+    unsigned threads = budget;
+    //Each entry already uses that many threads with --mt-deflate
+    if(Options.DeflateMultithreading > 1){
+        threads /= Options.DeflateMultithreading;
+    }
+    if(threads > entries.size()){
+        threads = entries.size();
+    }
+    if(threads < 1){
+        threads = 1;
+    }
+    //Parallel entries share the budget instead of each running its PNG trials on every core
+    ECTOptions EntryOptions = Options;
+    EntryOptions.Threads = budget / threads > 1 ? budget / threads : 1;
+    //Sequential entries carry the cost model over like separate files do, parallel ones all start from the current one so the output doesn't depend on scheduling
+    SymbolStats costmodel;
+    ZopfliGetCostModel(&costmodel);
+    std::vector<char> done(entries.size());
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for(unsigned j = 0; threads > 1 && j < threads; j++){
+        workers.push_back(std::thread([&]{
+            size_t k;
+            while((k = next++) < entries.size()){
+                std::exception_ptr e;
+                try {
+                    ZopfliSetCostModel(&costmodel);
+                    CompressZipEntry(entries[k], EntryOptions, zipfilename.c_str());
+                }
+                catch (...) {
+                    e = std::current_exception();
+                    next = entries.size();
+                }
+                std::lock_guard<std::mutex> lock(done_mutex);
+                if(e && !exception){
+                    exception = e;
+                }
+                done[k] = 1;
+                done_cv.notify_all();
+            }
+        }));
+    }
+#endif
+    for(unsigned j = 0; j < entries.size(); j++){
+#ifndef NOMULTI
+        if(threads > 1){
+            std::unique_lock<std::mutex> lock(done_mutex);
+            done_cv.wait(lock, [&]{return done[j] || exception;});
+            if(exception){
+                break;
+            }
+        }
+        else
+#endif
+        {
+            try {
+                CompressZipEntry(entries[j], Options, zipfilename.c_str());
+            }
+            catch (...) {
+                exception = std::current_exception();
+                break;
+            }
+        }
+        ZipEntry& entry = entries[j];
+        if(entry.failed || !mz_zip_writer_add_compressed_mem(&zip, entry.name.c_str(), entry.data, entry.size, entry.uncompressed_size, entry.crc, entry.method, 0, 0, entry.path.c_str())){
+            printf("can't add file '%s'\n", entry.path.c_str());
+            error = 1;
+        }
+        else{
+            local_files++;
+        }
+        free(entry.data);
+        entry.data = 0;
+    }
+#ifndef NOMULTI
+    for(unsigned j = 0; j < workers.size(); j++){
+        workers[j].join();
+    }
+#endif
+    for(unsigned j = 0; j < entries.size(); j++){
+        free(entries[j].data);
+    }
+    //A new archive is removed again. The writer already replaced the central directory of an existing one, so it
+    //is finalized with the entries added so far.
+    if(exception){
+        if(entries.size()){
+            if(append){
+                mz_zip_writer_finalize_archive(&zip);
+            }
+            mz_zip_writer_end(&zip);
+            if(!append){
+                remove(zipfilename.c_str());
+            }
+        }
+        std::rethrow_exception(exception);
+    }
+    if(entries.size()){
+        if(!mz_zip_writer_finalize_archive(&zip)){
+            error = 1;
+        }
+        mz_zip_writer_end(&zip);
+    }
+    //All entries are optimized now, so later runs can skip them
+    if(entries.size() && Options.ZipManifest){
+        MarkZipFile(zipfilename.c_str(), Options);
+    }
+
+    if(t >= 0){
+        set_file_time(zipfilename.c_str(), t);
+    }
+
+    long long outsize = filesize(zipfilename.c_str());
+    ECT_StatsFileStop(&timer, ECT_FILE_ZIP, local_bytes, outsize < 0 ? 0 : outsize);
+    ECTFileRecord record = {zipfilename.c_str(), 0, ECT_FILE_ZIP, (long long)local_bytes, outsize, -1, -1, -1, -1, Options.Mode, (unsigned)error};
+    ECT_LogFile(&timer, &record);
+    //Nested archives run without the counter, possibly on several threads, and are counted by their outer archive
+    if(Options.SavingsCounter){
+        processedfiles += local_files;
+        bytes += local_bytes;
+        savings += local_bytes - outsize;
+    }
+    return error;
+}
@@ -19,8 +19,13 @@
 
 #include "mozjpeg/jinclude.h"
 #include "mozjpeg/jpeglib.h"
+#include "mozjpeg/jerror.h"
+#include "mozjpeg/jpegint.h"
+#include "mozjpeg/jcmaster.h"
 #include "main.h"
 #include "support.h"
+#include "stats.h"
+#include <setjmp.h>
 
 static size_t jcopy_markers_execute (j_decompress_ptr srcinfo, j_compress_ptr dstinfo)
 {
@@ -52,10 +57,15 @@ static size_t jcopy_markers_execute (j_decompress_ptr srcinfo, j_compress_ptr ds
   return size;
 }
 
+/* Messages are prefixed with the file name, without one they come from libect
+   and aren't printed. */
 METHODDEF(void)
 output_message (j_common_ptr cinfo)
 {
   char buffer[JMSG_LENGTH_MAX];
+  if (!cinfo->err->addon_message_table[0]) {
+    return;
+  }
 
   /* Create the message */
   (*cinfo->err->format_message) (cinfo, buffer);
@@ -64,58 +74,151 @@ output_message (j_common_ptr cinfo)
   fprintf(stderr, "%s: %s\n", cinfo->err->addon_message_table[0], buffer);
 }
 
-int mozjpegtran (bool arithmetic, bool progressive, bool strip, const char * Infile, const char * Outfile, size_t* stripped_outsize)
+/* Errors in the codec jump back to the function that started the current image
+   instead of exiting. */
+METHODDEF(void)
+error_exit (j_common_ptr cinfo)
 {
+  (*cinfo->err->output_message) (cinfo);
+  longjmp(*(jmp_buf*)cinfo->client_data, 1);
+}
+
+/* Memory destination that grows the output buffer of the context in place.
+   jpeg_mem_dest keeps a grown buffer to itself until the image is finished,
+   so it was lost when the codec jumped out on an error. */
+struct ContextDestination {
+  struct jpeg_destination_mgr pub;
+  unsigned char** buffer;
+  unsigned long* capacity;
+};
+
+METHODDEF(void)
+init_context_destination (j_compress_ptr cinfo)
+{
+  ContextDestination* dest = (ContextDestination*)cinfo->dest;
+  if (!*dest->capacity) {
+    *dest->buffer = (unsigned char*)malloc(65536);
+    if (!*dest->buffer)
+      ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+    *dest->capacity = 65536;
+  }
+  dest->pub.next_output_byte = (JOCTET*)*dest->buffer;
+  dest->pub.free_in_buffer = *dest->capacity;
+}
+
+METHODDEF(boolean)
+empty_context_destination (j_compress_ptr cinfo)
+{
+  ContextDestination* dest = (ContextDestination*)cinfo->dest;
+  unsigned long size = *dest->capacity;
+  unsigned char* grown = (unsigned char*)realloc(*dest->buffer, size * 2);
+  if (!grown)
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+  *dest->buffer = grown;
+  *dest->capacity = size * 2;
+  dest->pub.next_output_byte = (JOCTET*)grown + size;
+  dest->pub.free_in_buffer = size;
+  return TRUE;
+}
+
+METHODDEF(void)
+term_context_destination (j_compress_ptr)
+{
+  /* transcode takes the size from free_in_buffer. */
+}
+
+/* Codec objects and scratch buffers are kept alive across files and only reset
+   between images, as setting them up again dominates the runtime on batches of
+   small JPEGs. There is one context per thread. */
+struct JPEGContext {
   struct jpeg_decompress_struct srcinfo;
   struct jpeg_compress_struct dstinfo;
   struct jpeg_error_mgr jsrcerr, jdsterr;
-  FILE * fp;
-  unsigned char *outbuffer = 0;
-  unsigned long outsize = 0;
-  size_t extrasize = 0;
-  /* Initialize the JPEG decompression object with default error handling. */
-  srcinfo.err = jpeg_std_error(&jsrcerr);
-  srcinfo.err->output_message = output_message;
-  const char* addon = Infile;
-  srcinfo.err->addon_message_table = &addon;
-  jpeg_create_decompress(&srcinfo);
-  /* Initialize the JPEG compression object with default error handling. */
-  dstinfo.err = jpeg_std_error(&jdsterr);
-  jpeg_create_compress(&dstinfo);
-  if (!progressive){
-    jpeg_c_set_int_param(&dstinfo, JINT_COMPRESS_PROFILE, JCP_FASTEST);
+  jmp_buf setjmp_buffer;
+  const char* addon;
+  unsigned char* inbuffer;
+  size_t incapacity;
+  unsigned char* outbuffer;
+  unsigned long outcapacity;
+  ContextDestination dest;
+
+  JPEGContext() : addon(0), inbuffer(0), incapacity(0), outbuffer(0), outcapacity(0) {
+    /* Initialize the JPEG decompression object with default error handling. */
+    srcinfo.err = jpeg_std_error(&jsrcerr);
+    srcinfo.err->output_message = output_message;
+    srcinfo.err->error_exit = error_exit;
+    srcinfo.err->addon_message_table = &addon;
+    srcinfo.client_data = &setjmp_buffer;
+    jpeg_create_decompress(&srcinfo);
+    /* Initialize the JPEG compression object with default error handling. */
+    dstinfo.err = jpeg_std_error(&jdsterr);
+    dstinfo.err->output_message = output_message;
+    dstinfo.err->error_exit = error_exit;
+    dstinfo.err->addon_message_table = &addon;
+    dstinfo.client_data = &setjmp_buffer;
+    jpeg_create_compress(&dstinfo);
+    /* The output buffer is reused and stays owned by the context. */
+    dest.pub.init_destination = init_context_destination;
+    dest.pub.empty_output_buffer = empty_context_destination;
+    dest.pub.term_destination = term_context_destination;
+    dest.buffer = &outbuffer;
+    dest.capacity = &outcapacity;
+    dstinfo.dest = &dest.pub;
   }
 
-  /* Open the input file. */
-  if (!(fp = fopen(Infile, "rb"))) {
-    fprintf(stderr, "ECT: can't open %s for reading\n", Infile);
-    return 2;
+  ~JPEGContext() {
+    jpeg_destroy_compress(&dstinfo);
+    jpeg_destroy_decompress(&srcinfo);
+    free(inbuffer);
+    free(outbuffer);
   }
+};
 
-  long long insize = filesize(Infile);
-  if(insize < 0){
-    fprintf(stderr, "ECT: can't read from %s\n", Infile);
+static JPEGContext& GetJPEGContext(){
+#ifndef NOMULTI
+  static thread_local JPEGContext context;
+#else
+  static JPEGContext context;
+#endif
+  return context;
+}
+
+/* Transcodes in into ctx.outbuffer. Returns 0 on success and 2 if the input
+   can't be decoded; the codec objects are reset for the next image either way. */
+static int transcode (JPEGContext& ctx, bool arithmetic, bool progressive, bool strip, const unsigned char* in, size_t insize, unsigned long* outsize, size_t* extrasize)
+{
+  struct jpeg_decompress_struct& srcinfo = ctx.srcinfo;
+  struct jpeg_compress_struct& dstinfo = ctx.dstinfo;
+
+  if (setjmp(ctx.setjmp_buffer)) {
+    /* The output buffer stays with the context, but the scan search of
+       optimize_scans writes to buffers of its own through a destination in
+       the image pool, which jpeg_abort_compress frees. The context's
+       destination is put back in its place. */
+    my_master_ptr master = (my_master_ptr)dstinfo.master;
+    for (unsigned i = 0; i < sizeof(master->scan_buffer) / sizeof(master->scan_buffer[0]); i++) {
+      free(master->scan_buffer[i]);
+      master->scan_buffer[i] = NULL;
+    }
+    dstinfo.dest = &ctx.dest.pub;
+    jpeg_abort_compress(&dstinfo);
+    jpeg_abort_decompress(&srcinfo);
     return 2;
   }
-  unsigned char* inbuffer = (unsigned char*)malloc(insize);
-  if (!inbuffer) {
-    fprintf(stderr, "ECT: memory allocation failure\n");
-    exit(1);
-  }
+  ECTStatsTimer timer;
+  ECT_StatsStart(&timer);
 
-  if (fread(inbuffer, 1, insize, fp) < insize) {
-    fprintf(stderr, "ECT: can't read from %s\n", Infile);
-  }
-  fclose(fp);
+  /* The profile is sticky, so it has to be set for every image. */
+  jpeg_c_set_int_param(&dstinfo, JINT_COMPRESS_PROFILE, progressive ? JCP_MAX_COMPRESSION : JCP_FASTEST);
 
-  jpeg_mem_src(&srcinfo, inbuffer, insize);
+  jpeg_mem_src(&srcinfo, (unsigned char*)in, insize);
 
-  /* Enable saving of extra markers that we want to copy */
-  if (!strip) {
-    jpeg_save_markers(&srcinfo, JPEG_COM, 0xFFFF);
-    for (unsigned m = 0; m < 16; m++)
-      jpeg_save_markers(&srcinfo, JPEG_APP0 + m, 0xFFFF);
-  }
+  /* Enable saving of extra markers that we want to copy. A length of 0 turns
+     saving off again if the previous image wasn't stripped. */
+  unsigned marker_length = strip ? 0 : 0xFFFF;
+  jpeg_save_markers(&srcinfo, JPEG_COM, marker_length);
+  for (unsigned m = 0; m < 16; m++)
+    jpeg_save_markers(&srcinfo, JPEG_APP0 + m, marker_length);
 
   /* Read file header */
   jpeg_read_header(&srcinfo, 1);
@@ -134,18 +237,64 @@ int mozjpegtran (bool arithmetic, bool progressive, bool strip, const char * Inf
     dstinfo.scan_info = 0;
   }
 
-  /* Specify data destination for compression */
-  jpeg_mem_dest(&dstinfo, &outbuffer, &outsize);
-
   /* Start compressor (note no image data is actually written here) */
   jpeg_write_coefficients(&dstinfo, coef_arrays);
 
   /* Copy to the output file any extra markers that we want to preserve */
-  extrasize = jcopy_markers_execute(&srcinfo, &dstinfo);
+  *extrasize = jcopy_markers_execute(&srcinfo, &dstinfo);
 
   /* Finish compression and release memory */
   jpeg_finish_compress(&dstinfo);
-  free(inbuffer);
+  *outsize = ctx.outcapacity - ctx.dest.pub.free_in_buffer;
+
+  /* Reset the decompressor for the next image, the compressor already was by
+     jpeg_finish_compress. */
+  jpeg_finish_decompress(&srcinfo);
+  ECT_StatsStop(&timer, ECT_STAGE_JPEG, insize, *outsize, progressive);
+  return 0;
+}
+
+int mozjpegtran (bool arithmetic, bool progressive, bool strip, const char * Infile, const char * Outfile, size_t* stripped_outsize)
+{
+  JPEGContext& ctx = GetJPEGContext();
+  FILE * fp;
+  size_t extrasize = 0;
+  ctx.addon = Infile;
+
+  /* Open the input file. */
+  if (!(fp = fopen(Infile, "rb"))) {
+    fprintf(stderr, "ECT: can't open %s for reading\n", Infile);
+    return 2;
+  }
+
+  long long insize = filesize(Infile);
+  if(insize < 0){
+    fprintf(stderr, "ECT: can't read from %s\n", Infile);
+    fclose(fp);
+    return 2;
+  }
+  if ((size_t)insize > ctx.incapacity) {
+    free(ctx.inbuffer);
+    ctx.incapacity = 0;
+    ctx.inbuffer = (unsigned char*)malloc(insize);
+    if (!ctx.inbuffer) {
+      fprintf(stderr, "ECT: memory allocation failure\n");
+      fclose(fp);
+      return 2;
+    }
+    ctx.incapacity = insize;
+  }
+  unsigned char* inbuffer = ctx.inbuffer;
+
+  if (fread(inbuffer, 1, insize, fp) < insize) {
+    fprintf(stderr, "ECT: can't read from %s\n", Infile);
+  }
+  fclose(fp);
+
+  unsigned long outsize;
+  if (transcode(ctx, arithmetic, progressive, strip, inbuffer, insize, &outsize, &extrasize)) {
+    return 2;
+  }
 
   bool x = insize < outsize;
 
@@ -153,21 +302,35 @@ int mozjpegtran (bool arithmetic, bool progressive, bool strip, const char * Inf
     /* Open the output file. */
     if (!(fp = fopen(Outfile, "wb"))) {
       fprintf(stderr, "ECT: can't open %s for writing\n", Outfile);
-      free(outbuffer);
       return 2;
     }
 
     /* Write new file. */
-    if (JFWRITE(fp, outbuffer, outsize) < outsize) {
+    if (JFWRITE(fp, ctx.outbuffer, outsize) < outsize) {
       fprintf(stderr, "ECT: can't write to %s\n", Outfile);
     }
     fclose(fp);
   }
 
-  jpeg_destroy_compress(&dstinfo);
-  jpeg_finish_decompress(&srcinfo);
-  jpeg_destroy_decompress(&srcinfo);
-  free(outbuffer);
   (*stripped_outsize) = /*x ? insize : */outsize - extrasize;
   return x;
 }
+
+int mozjpegtranBuffer (bool arithmetic, bool progressive, bool strip, const unsigned char* in, size_t insize, std::vector<unsigned char>* out, size_t* stripped_outsize)
+{
+  JPEGContext& ctx = GetJPEGContext();
+  size_t extrasize = 0;
+  ctx.addon = 0;
+
+  unsigned long outsize;
+  if (transcode(ctx, arithmetic, progressive, strip, in, insize, &outsize, &extrasize)) {
+    return 2;
+  }
+  /* Like mozjpegtran, the output is only stored if it's smaller. */
+  out->clear();
+  if (outsize < insize){
+    out->assign(ctx.outbuffer, ctx.outbuffer + outsize);
+  }
+  (*stripped_outsize) = outsize - extrasize;
+  return insize < outsize;
+}
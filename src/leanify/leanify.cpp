@@ -21,7 +21,12 @@ File::File(const char* filepath) {
     size_ = 0;
     return;
   }
-  size_ = GetFileSize(hFile_, nullptr);
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(hFile_, &size)) {
+    size_ = 0;
+    return;
+  }
+  size_ = size.QuadPart;
   hMap_ = CreateFileMapping(hFile_, nullptr, PAGE_READWRITE, 0, 0, nullptr);
   if (hMap_ == INVALID_HANDLE_VALUE) {
     return;
@@ -37,7 +42,9 @@ void File::UnMapFile(size_t new_size) {
 
   CloseHandle(hMap_);
   if (new_size) {
-    SetFilePointer(hFile_, new_size, nullptr, FILE_BEGIN);
+    LARGE_INTEGER position;
+    position.QuadPart = new_size;
+    SetFilePointerEx(hFile_, position, nullptr, FILE_BEGIN);
     SetEndOfFile(hFile_);
   }
   CloseHandle(hFile_);
@@ -85,14 +92,14 @@ void File::UnMapFile(size_t new_size) {
 // the new location of the file will be file_pointer - size_leanified
 // it's designed this way to avoid extra memmove or memcpy
 // return new size
-static size_t LeanifyFile(void* file_pointer, size_t file_size, const ECTOptions& Options, size_t* files) {
+static size_t LeanifyFile(void* file_pointer, size_t file_size, const ECTOptions& Options, size_t* files, bool in_memory) {
 
   if (memcmp(file_pointer, Zip::header_magic, sizeof(Zip::header_magic)) != 0) {
     return file_size;
   }
 
 
-  Zip* f = new Zip(file_pointer, file_size);
+  Zip* f = new Zip(file_pointer, file_size, in_memory);
   size_t r = f->Leanify(Options, files);
   delete f;
   return r;
@@ -105,7 +112,39 @@ void ReZipFile(const char* file_path, const ECTOptions& Options, size_t* files)
   if (input_file.IsOK()) {
     size_t original_size = input_file.GetSize();
 
-    size_t new_size = LeanifyFile(input_file.GetFilePionter(), original_size, Options, files);
+    size_t new_size = LeanifyFile(input_file.GetFilePionter(), original_size, Options, files, false);
     input_file.UnMapFile(new_size);
   }
 }
+
+void MarkZipFile(const char* file_path, const ECTOptions& Options) {
+  File input_file(file_path);
+  if (!input_file.IsOK()) {
+    return;
+  }
+  size_t size = input_file.GetSize();
+  string comment;
+  size_t comment_offset = Zip(input_file.GetFilePionter(), size).Manifest(Options, &comment);
+  input_file.UnMapFile(0);
+
+  // Only archives that end with the EOCD and have no comment yet, like those written by miniz
+  if (!comment_offset || comment_offset != size) {
+    return;
+  }
+  FILE* stream = fopen(file_path, "r+b");
+  if (!stream) {
+    return;
+  }
+  unsigned char comment_len[2] = { (unsigned char)comment.size(), (unsigned char)(comment.size() >> 8) };
+  fseek(stream, comment_offset - 2, SEEK_SET);
+  fwrite(comment_len, 1, 2, stream);
+  fwrite(comment.data(), 1, comment.size(), stream);
+  fclose(stream);
+}
+
+size_t ReZipBuffer(unsigned char* data, size_t size, const ECTOptions& Options, size_t* files) {
+  if (size < sizeof(Zip::header_magic)) {
+    return size;
+  }
+  return LeanifyFile(data, size, Options, files, true);
+}
@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <algorithm>
+#include <unordered_map>
 #ifdef _WIN32
 #include <Windows.h>
 #ifdef _MSC_VER
@@ -94,15 +95,87 @@ PACK(struct EOCD {
   uint16_t comment_len;
 });
 
-bool GetCDHeaders(const uint8_t* fp, size_t size, const EOCD& eocd, size_t zip_offset, vector<CDHeader>* out_cd_headers,
-                  size_t* out_base_offset) {
-  vector<CDHeader> cd_headers;
+PACK(struct EOCD64 {
+  uint8_t magic[4] = { 0x50, 0x4B, 0x06, 0x06 };
+  uint64_t record_size = sizeof(EOCD64) - 12;
+  uint16_t version_made_by;
+  uint16_t version_needed;
+  uint32_t disk_num;
+  uint32_t disk_cd_start;
+  uint64_t num_records;
+  uint64_t num_records_total;
+  uint64_t cd_size;
+  uint64_t cd_offset;
+});
+
+PACK(struct EOCD64Locator {
+  uint8_t magic[4] = { 0x50, 0x4B, 0x06, 0x07 };
+  uint32_t disk_eocd64;
+  uint64_t eocd64_offset;
+  uint32_t num_disks;
+});
+
+// Fields that don't fit in 32 bits are 0xFFFFFFFF and stored in the ZIP64 extra field instead.
+const uint32_t zip64_marker = 0xFFFFFFFF;
+const uint16_t zip64_extra_id = 0x0001;
+const uint16_t zip64_version = 45;
+
+// A CD header with the values of its ZIP64 extra field applied.
+struct Entry {
+  CDHeader header;
+  uint64_t compressed_size;
+  uint64_t uncompressed_size;
+  uint64_t local_header_offset;
+  // The local header keeps a ZIP64 extra field with both sizes
+  bool zip64_local;
+};
+
+// Reads the sizes and offset of a CD header that are stored in its ZIP64 extra field.
+bool ReadZip64Extra(const uint8_t* extra, size_t len, Entry* entry) {
+  uint64_t* fields[3] = { &entry->uncompressed_size, &entry->compressed_size, &entry->local_header_offset };
+  bool marked[3] = { entry->header.uncompressed_size == zip64_marker, entry->header.compressed_size == zip64_marker,
+                     entry->header.local_header_offset == zip64_marker };
+  while (len >= 4) {
+    uint16_t id, size;
+    memcpy(&id, extra, 2);
+    memcpy(&size, extra + 2, 2);
+    if (size + 4u > len) {
+      return false;
+    }
+    if (id == zip64_extra_id) {
+      const uint8_t* p = extra + 4;
+      for (int i = 0; i < 3; i++) {
+        if (!marked[i]) {
+          continue;
+        }
+        if (p + 8 > extra + 4 + size) {
+          return false;
+        }
+        memcpy(fields[i], p, 8);
+        p += 8;
+      }
+      return true;
+    }
+    extra += size + 4;
+    len -= size + 4;
+  }
+  // Without a ZIP64 field a marker is just the value
+  return true;
+}
+
+bool GetCDHeaders(const uint8_t* fp, size_t size, uint64_t num_records, uint64_t cd_offset, uint64_t cd_size,
+                  size_t zip_offset, vector<Entry>* out_entries, size_t* out_base_offset) {
+  vector<Entry> entries;
   size_t base_offset = 0;
+  if (cd_offset > size || cd_size > size - cd_offset) {
+    return false;
+  }
   // Copy cd headers to vector
-  const uint8_t* p_cdheader = fp + eocd.cd_offset;
-  const uint8_t* cd_end = p_cdheader + eocd.cd_size;
-  for (int i = 0; i < eocd.num_records; i++) {
-    CDHeader cd_header;
+  const uint8_t* p_cdheader = fp + cd_offset;
+  const uint8_t* cd_end = p_cdheader + cd_size;
+  for (uint64_t i = 0; i < num_records; i++) {
+    Entry entry;
+    CDHeader& cd_header = entry.header;
     if (p_cdheader + sizeof(CDHeader) > cd_end){
       return false;
     }
@@ -118,11 +191,22 @@ bool GetCDHeaders(const uint8_t* fp, size_t size, const EOCD& eocd, size_t zip_o
       cd_end += base_offset;
     }
     memcpy(&cd_header, p_cdheader, sizeof(CDHeader));
-    const uint8_t* p_local_header = fp + base_offset + cd_header.local_header_offset;
+    entry.compressed_size = cd_header.compressed_size;
+    entry.uncompressed_size = cd_header.uncompressed_size;
+    entry.local_header_offset = cd_header.local_header_offset;
+    const uint8_t* p_extra = p_cdheader + sizeof(CDHeader) + cd_header.filename_len;
+    if (p_extra + cd_header.extra_field_len > cd_end || !ReadZip64Extra(p_extra, cd_header.extra_field_len, &entry)) {
+      return false;
+    }
 
     // Check if local header magic matches.
-    if (p_local_header + sizeof(LocalHeader) + cd_header.filename_len + cd_header.compressed_size > fp + size ||
-        memcmp(p_local_header, Zip::header_magic, sizeof(Zip::header_magic)) != 0) {
+    if (entry.local_header_offset > size - base_offset ||
+        size - base_offset - entry.local_header_offset < sizeof(LocalHeader) + cd_header.filename_len ||
+        size - base_offset - entry.local_header_offset - sizeof(LocalHeader) - cd_header.filename_len < entry.compressed_size) {
+      return false;
+    }
+    const uint8_t* p_local_header = fp + base_offset + entry.local_header_offset;
+    if (memcmp(p_local_header, Zip::header_magic, sizeof(Zip::header_magic)) != 0) {
       return false;
     }
     const LocalHeader* local_header = reinterpret_cast<const LocalHeader*>(p_local_header);
@@ -131,31 +215,191 @@ bool GetCDHeaders(const uint8_t* fp, size_t size, const EOCD& eocd, size_t zip_o
         memcmp(p_local_header + sizeof(LocalHeader), p_cdheader + sizeof(CDHeader), cd_header.filename_len) != 0){
 		return false;
 	}
+    entry.zip64_local = entry.compressed_size >= zip64_marker || entry.uncompressed_size >= zip64_marker;
 
     p_cdheader += sizeof(CDHeader) + cd_header.filename_len + cd_header.extra_field_len + cd_header.comment_len;
     if (p_cdheader > cd_end){
 		return false;
 	}
-    cd_headers.push_back(cd_header);
+    entries.push_back(entry);
   }
-  std::sort(cd_headers.begin(), cd_headers.end(), [](const CDHeader& a, const CDHeader& b) { return a.local_header_offset < b.local_header_offset; });
+  std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.local_header_offset < b.local_header_offset; });
   // Check if there's any overlaps.
-  for (size_t i = 1; i < cd_headers.size(); i++) {
-    if (cd_headers[i - 1].local_header_offset + sizeof(LocalHeader) + cd_headers[i - 1].filename_len +
-            cd_headers[i - 1].compressed_size >
-        cd_headers[i].local_header_offset) {
+  for (size_t i = 1; i < entries.size(); i++) {
+    if (entries[i - 1].local_header_offset + sizeof(LocalHeader) + entries[i - 1].header.filename_len +
+            entries[i - 1].compressed_size >
+        entries[i].local_header_offset) {
       return false;
     }
   }
 
-  *out_cd_headers = std::move(cd_headers);
+  *out_entries = std::move(entries);
   *out_base_offset = base_offset;
   return true;
 }
 
+// Finds the EOCD and reads all CD headers, returns the position of the EOCD or nullptr.
+uint8_t* ReadCentralDirectory(uint8_t* fp, size_t size, size_t zip_offset, EOCD* eocd, vector<Entry>* entries,
+                              size_t* base_offset) {
+  uint8_t* p_end = fp + size;
+  // smallest possible location of EOCD if there's a 64K comment
+  uint8_t* p_searchstart = std::max(fp, p_end - 65535 - sizeof(eocd->magic));
+  uint8_t* p_eocd = nullptr;
+  while (true) {
+    if (p_eocd != nullptr) {
+      cerr << "Warning: Found EOCD at 0x" << std::hex << p_eocd - fp << std::dec << ", but it's invalid." << endl;
+      p_end = p_eocd;
+    }
+    p_eocd = std::find_end(p_searchstart, p_end, eocd->magic, std::end(eocd->magic));
+    if (p_eocd == p_end) {
+      cerr << "EOCD not found!" << endl;
+      return nullptr;
+    }
+
+    if (p_eocd + sizeof(EOCD) > p_end){
+      continue;
+    }
+  
+    memcpy(eocd, p_eocd, sizeof(EOCD));
+    uint64_t num_records = eocd->num_records;
+    uint64_t cd_size = eocd->cd_size;
+    uint64_t cd_offset = eocd->cd_offset;
+    uint8_t* p_cd_limit = p_eocd;
+
+    // ZIP64 archives have a locator pointing to a 64-bit EOCD right before the EOCD
+    EOCD64Locator locator;
+    if (size >= sizeof(EOCD64) && p_eocd - fp >= (ptrdiff_t)sizeof(EOCD64Locator) &&
+        memcmp(p_eocd - sizeof(EOCD64Locator), locator.magic, sizeof(locator.magic)) == 0) {
+      memcpy(&locator, p_eocd - sizeof(EOCD64Locator), sizeof(EOCD64Locator));
+      EOCD64 eocd64;
+      uint64_t record = locator.eocd64_offset;
+      if (record <= size - sizeof(EOCD64) && memcmp(fp + record, eocd64.magic, sizeof(eocd64.magic)) != 0 &&
+          record + zip_offset <= size - sizeof(EOCD64)) {
+        record += zip_offset;
+      }
+      if (record > size - sizeof(EOCD64) || memcmp(fp + record, eocd64.magic, sizeof(eocd64.magic)) != 0) {
+        continue;
+      }
+      memcpy(&eocd64, fp + record, sizeof(EOCD64));
+      num_records = eocd64.num_records;
+      cd_size = eocd64.cd_size;
+      cd_offset = eocd64.cd_offset;
+      p_cd_limit = fp + record;
+    }
+    if (cd_offset > size || cd_size > size - cd_offset || fp + cd_offset + cd_size > p_cd_limit){
+      continue;
+    }
+	
+    // Try to get all CD headers using this EOCD, if everything checks out then proceed.
+    if (GetCDHeaders(fp, size, num_records, cd_offset, cd_size, zip_offset, entries, base_offset)) {
+      return p_eocd;
+    }
+  }
+}
+
+// ECT stores the settings and a digest of the entries it optimized in the archive comment,
+// so later runs, e.g. after appending files with -zip, can skip them.
+// The flags take bits 0-7 and the --pal_sort count bits 8-15.
+unsigned SettingsKey(const ECTOptions& Options) {
+  unsigned flags = Options.strip | Options.Progressive << 1 | Options.Arithmetic << 2 | Options.Strict << 3 |
+                   Options.Reuse << 4 | Options.Allfilters << 5 | Options.Allfiltersbrute << 6 | Options.Allfilterscheap << 7;
+  unsigned palette_sort = Options.palette_sort >> 8 & 0xFF;
+  return flags | palette_sort << 8;
+}
+
+// Entry names are read from the local headers, which follow base.
+string ManifestComment(unsigned mode, unsigned key, const vector<Entry>& entries, size_t count, const uint8_t* base) {
+  uint64_t digest = 14695981039346656037ULL;
+  for (size_t i = 0; i < count; i++) {
+    const CDHeader& cd_header = entries[i].header;
+    uint64_t fields[4] = { cd_header.crc32, entries[i].compressed_size, entries[i].uncompressed_size, cd_header.compression_method };
+    for (uint64_t field : fields) {
+      for (int j = 0; j < 8; j++) {
+        digest = (digest ^ (uint8_t)(field >> (j * 8))) * 1099511628211ULL;
+      }
+    }
+    const uint8_t* name = base + entries[i].local_header_offset + sizeof(LocalHeader);
+    for (size_t j = 0; j < cd_header.filename_len; j++) {
+      digest = (digest ^ name[j]) * 1099511628211ULL;
+    }
+  }
+  char comment[64];
+  snprintf(comment, sizeof(comment), "ECT1 %u %x %zu %016llx", mode, key, count, (unsigned long long)digest);
+  return comment;
+}
+
+// Returns how many leading entries were optimized with the same mode and settings. Modes aren't ordered, above 9
+// they encode iteration counts and the twice mode, so only the same mode counts.
+size_t OptimizedEntries(const char* comment, size_t len, const ECTOptions& Options, const vector<Entry>& entries,
+                        const uint8_t* base) {
+  string stored(comment, len);
+  unsigned mode, key;
+  size_t count;
+  if (sscanf(stored.c_str(), "ECT1 %u %x %zu", &mode, &key, &count) != 3 || mode != Options.Mode ||
+      key != SettingsKey(Options) || count > entries.size() ||
+      stored != ManifestComment(mode, key, entries, count, base)) {
+    return 0;
+  }
+  return count;
+}
+
+// Result of an entry that later entries with the same content can reuse.
+struct EntryResult {
+  bool stored;
+  string extension;
+  uint64_t hash;
+  size_t offset;
+  uint16_t compression_method;
+  uint32_t crc32;
+  uint64_t compressed_size;
+  uint64_t uncompressed_size;
+};
+
+// zlib's crc32 takes a 32-bit length
+uint32_t Crc32(const uint8_t* data, size_t size) {
+  uLong crc = crc32(0, nullptr, 0);
+  while (size) {
+    uInt len = (uInt)std::min<size_t>(size, 1u << 30);
+    crc = crc32(crc, data, len);
+    data += len;
+    size -= len;
+  }
+  return crc;
+}
+
+// FNV-1a, confirms a match of CRC32 and size.
+uint64_t ContentHash(const uint8_t* data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Embedded files are optimized by extension, so identical content only gives the same result with the same extension.
+string EntryExtension(const string& filename) {
+  size_t dotpos = filename.find_last_of('.');
+  return dotpos == string::npos ? string() : filename.substr(dotpos);
+}
+
+uint64_t ResultKey(uint32_t crc32, uint64_t size) {
+  return (uint64_t)crc32 << 32 ^ size;
+}
+
+const EntryResult* FindDuplicate(const std::unordered_multimap<uint64_t, EntryResult>& results, uint32_t crc32,
+                                 uint64_t size, bool stored, const string& extension, uint64_t hash) {
+  auto range = results.equal_range(ResultKey(crc32, size));
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.stored == stored && it->second.hash == hash && it->second.extension == extension) {
+      return &it->second;
+    }
+  }
+  return nullptr;
+}
+
 }  // namespace
 
-uint32_t Zip::RecompressFile(unsigned char* data, uint32_t size, uint32_t size_leanified, string filename, const ECTOptions& Options){
+size_t Zip::RecompressFile(unsigned char* data, size_t size, size_t size_leanified, string filename, const ECTOptions& Options){
   bool isZIP = size > sizeof(Zip::header_magic) && memcmp(data, Zip::header_magic, sizeof(Zip::header_magic)) == 0;
 
   int dotpos = filename.find_last_of('.');
@@ -167,6 +411,24 @@ uint32_t Zip::RecompressFile(unsigned char* data, uint32_t size, uint32_t size_l
     return size;
   }
 
+  if(in_memory_){
+    std::vector<unsigned char> buf(data, data + size);
+    if(isZIP){
+      size_t nested = 0;
+      buf.resize(ReZipBuffer(buf.data(), buf.size(), Options, &nested));
+    } else {
+      bufferHandler(buf, extension.c_str() + 1, Options);
+    }
+    if(buf.size() < size){
+      memcpy(data - size_leanified, buf.data(), buf.size());
+      size = buf.size();
+    }
+    else if (size_leanified){
+      memmove(data - size_leanified, data, size);
+    }
+    return size;
+  }
+
 #ifdef _WIN32
   char tempname[13];
   memcpy(tempname, "fXXXXXX", 8);
@@ -208,15 +470,20 @@ uint32_t Zip::RecompressFile(unsigned char* data, uint32_t size, uint32_t size_l
     args.push_back(0);
     const char * v[1];
     v[0] = temp;
-    zipHandler(args, v, 1, Options);
+    //The manifest only helps the archive ECT was run on, a nested one would just grow by it. The outer archive
+    //counts the savings.
+    ECTOptions NestedOptions = Options;
+    NestedOptions.ZipManifest = false;
+    NestedOptions.SavingsCounter = false;
+    zipHandler(args, v, 1, NestedOptions);
   } else {
     fileHandler(temp, Options, 1);
   }
   long long new_size = filesize(temp);
 
-  if(new_size < size && new_size >= 0){
+  if(new_size >= 0 && (size_t)new_size < size){
     stream = fopen(temp, "rb");
-    if(fread(data - size_leanified, 1, new_size, stream) < new_size){
+    if(fread(data - size_leanified, 1, new_size, stream) < (size_t)new_size){
       printf("Error: Read error\n");
       if (size_leanified){
         memcpy(data - size_leanified, data, size);
@@ -251,175 +518,307 @@ size_t Zip::Leanify(const ECTOptions& Options, size_t* files) {
   size_t base_offset = 0;
 
   EOCD eocd;
-  vector<CDHeader> cd_headers;
-  uint8_t* p_end = fp_ + size_;
-  // smallest possible location of EOCD if there's a 64K comment
-  uint8_t* p_searchstart = std::max(fp_, p_end - 65535 - sizeof(eocd.magic));
-  uint8_t* p_eocd = nullptr;
-  while (true) {
-    if (p_eocd != nullptr) {
-      cerr << "Warning: Found EOCD at 0x" << std::hex << p_eocd - fp_ << std::dec << ", but it's invalid." << endl;
-      p_end = p_eocd;
-    }
-    p_eocd = std::find_end(p_searchstart, p_end, eocd.magic, std::end(eocd.magic));
-    if (p_eocd == p_end) {
-      cerr << "EOCD not found!" << endl;
-      return size_;
-    }
+  vector<Entry> entries;
+  uint8_t* p_eocd = ReadCentralDirectory(fp_, size_, zip_offset, &eocd, &entries, &base_offset);
+  if (!p_eocd) {
+    return size_;
+  }
 
-    if (p_eocd + sizeof(EOCD) > p_end){
-      continue;
-    }
-  
-    memcpy(&eocd, p_eocd, sizeof(EOCD));
-    uint8_t* cd_end = fp_ + eocd.cd_offset + eocd.cd_size;
-    if (cd_end > p_eocd){
-      continue;
-    }
-	
-    // Try to get all CD headers using this EOCD, if everything checks out then proceed.
-    if (GetCDHeaders(fp_, size_, eocd, zip_offset, &cd_headers, &base_offset)) {
-      break;
+  // Entries a previous run already optimized with these settings are copied unchanged
+  size_t optimized = 0;
+  if (Options.ZipManifest && !in_memory_ && p_eocd + sizeof(EOCD) + eocd.comment_len <= fp_ + size_) {
+    optimized = OptimizedEntries(reinterpret_cast<char*>(p_eocd + sizeof(EOCD)), eocd.comment_len, Options, entries, fp_ + base_offset);
+  }
+
+  // Extra fields are dropped except for the ZIP64 field of large entries, make sure it never overwrites unread data
+  size_t end = zip_offset;
+  // Upper bound of the new central directory, sizes and offsets only shrink so large ones are large in the input too
+  uint64_t cd_max = 0;
+  for (const Entry& entry : entries) {
+    unsigned large = (entry.uncompressed_size >= zip64_marker) + (entry.compressed_size >= zip64_marker) +
+                     (entry.local_header_offset >= zip64_marker);
+    cd_max += sizeof(CDHeader) + entry.header.filename_len + (large ? 4 + 8 * large : 0);
+    const LocalHeader* local_header = reinterpret_cast<const LocalHeader*>(fp_ + base_offset + entry.local_header_offset);
+    size_t data_start = base_offset + entry.local_header_offset + sizeof(LocalHeader) + local_header->filename_len + local_header->extra_field_len;
+    end += sizeof(LocalHeader) + local_header->filename_len + (entry.zip64_local ? 20 : 0);
+    if (end > data_start) {
+      cerr << "No room for ZIP64 extra fields!" << endl;
+      return size_;
     }
+    end += entry.compressed_size;
+  }
+  // The archive is rewritten in place, so the end records have to fit before anything is changed
+  bool eocd64 = entries.size() >= 0xFFFF || end - base_offset >= zip64_marker || cd_max >= zip64_marker;
+  if (end + cd_max + (eocd64 ? sizeof(EOCD64) + sizeof(EOCD64Locator) : 0) + sizeof(EOCD) > size_) {
+    cerr << "No room for the end of central directory!" << endl;
+    return size_;
   }
 
   uint8_t* fp_w = fp_;
   uint8_t* fp_w_base = fp_w + base_offset;
   memmove(fp_w, fp_, zip_offset);
   uint8_t* p_write = fp_w + zip_offset;
-  // Local file header
-  for (CDHeader& cd_header : cd_headers) {
+  // Entries already written, keyed by the CRC32 and size of their original content
+  std::unordered_multimap<uint64_t, EntryResult> results;
+  // Local file header, its sizes are filled in when the central directory is written
+  for (Entry& entry : entries) {
     (*files)++;
-    uint8_t* p_read = fp_ + base_offset + cd_header.local_header_offset;
+    CDHeader& cd_header = entry.header;
+    uint8_t* p_read = fp_ + base_offset + entry.local_header_offset;
 
-    cd_header.local_header_offset = p_write - fp_w_base;
+    entry.local_header_offset = p_write - fp_w_base;
 
     size_t header_size = sizeof(LocalHeader) + cd_header.filename_len;
     // move header
     memmove(p_write, p_read, header_size);
     LocalHeader* local_header = reinterpret_cast<LocalHeader*>(p_write);
 
-    // if Extra field length is not 0, then skip it and set it to 0
-    if (local_header->extra_field_len) {
-      p_read += local_header->extra_field_len;
-      local_header->extra_field_len = 0;
-    }
+    // skip the Extra field, only large entries get a ZIP64 one back
+    p_read += local_header->extra_field_len;
+    local_header->extra_field_len = entry.zip64_local ? 20 : 0;
 
-    if (local_header->flag & 8) {
-      // set this bit to 0, we don't use data descriptor to save 16 byte
-      local_header->flag &= ~8;
-      cd_header.flag &= ~8;
-
-      // Use the correct value from central directory
-      local_header->crc32 = cd_header.crc32;
-      local_header->compressed_size = cd_header.compressed_size;
-      local_header->uncompressed_size = cd_header.uncompressed_size;
-    }
+    // set this bit to 0, we don't use data descriptor to save 16 byte
+    // the central directory has the correct values
+    local_header->flag &= ~8;
+    cd_header.flag &= ~8;
 
     string filename(reinterpret_cast<char*>(local_header) + sizeof(LocalHeader), local_header->filename_len);
 
     p_read += header_size;
-    p_write += header_size;
+    p_write += header_size + local_header->extra_field_len;
 
-    if (p_read + local_header->compressed_size > p_end) {
-      cerr << "Compressed size too large: " << local_header->compressed_size << endl;
+    if (entry.compressed_size > (size_t)(fp_ + size_ - p_read)) {
+      cerr << "Compressed size too large: " << entry.compressed_size << endl;
       break;
     }
 
+    if ((size_t)(&entry - entries.data()) < optimized) {
+      memmove(p_write, p_read, entry.compressed_size);
+      p_write += entry.compressed_size;
+      continue;
+    }
+
     // If the method is store, just Leanify the embedded file
     // don't try to change it to deflate, it might break some file.
-    if (local_header->compression_method == 0) {
+    if (cd_header.compression_method == 0) {
       // method is store
-      if (local_header->compressed_size) {
-        uint32_t new_size = RecompressFile(p_read, local_header->compressed_size, p_read - p_write, filename, Options);
-        if(new_size == local_header->compressed_size){
-          memmove(p_write, p_read, local_header->compressed_size);
+      if (entry.compressed_size) {
+        string extension = EntryExtension(filename);
+        uint64_t hash = ContentHash(p_read, entry.compressed_size);
+        const EntryResult* duplicate = FindDuplicate(results, cd_header.crc32, entry.compressed_size, true, extension, hash);
+        if (duplicate) {
+          memcpy(p_write, fp_w + duplicate->offset, duplicate->compressed_size);
+          cd_header.crc32 = duplicate->crc32;
+          entry.compressed_size = duplicate->compressed_size;
+          entry.uncompressed_size = duplicate->uncompressed_size;
+          p_write += entry.compressed_size;
+          continue;
         }
-        cd_header.crc32 = local_header->crc32 = crc32(0, p_write, new_size);
-        cd_header.compressed_size = local_header->compressed_size = new_size;
-        cd_header.uncompressed_size = local_header->uncompressed_size = new_size;
-        p_write += local_header->compressed_size;
+        EntryResult result{true, extension, hash, (size_t)(p_write - fp_w), 0, 0, 0, 0};
+        uint32_t original_crc32 = cd_header.crc32;
+        uint64_t original_size = entry.compressed_size;
+
+        size_t new_size = RecompressFile(p_read, entry.compressed_size, p_read - p_write, filename, Options);
+        if(new_size == entry.compressed_size){
+          memmove(p_write, p_read, entry.compressed_size);
+        }
+        cd_header.crc32 = Crc32(p_write, new_size);
+        entry.compressed_size = entry.uncompressed_size = new_size;
+        p_write += entry.compressed_size;
+
+        result.crc32 = cd_header.crc32;
+        result.compressed_size = result.uncompressed_size = new_size;
+        results.emplace(ResultKey(original_crc32, original_size), result);
       }
       continue;
     }
 
     // If unsupported compression method or encrypted, just move it.
-    if (local_header->compression_method != 8 || local_header->flag & 1) {
-      memmove(p_write, p_read, local_header->compressed_size);
-      p_write += local_header->compressed_size;
+    if (cd_header.compression_method != 8 || cd_header.flag & 1) {
+      memmove(p_write, p_read, entry.compressed_size);
+      p_write += entry.compressed_size;
       continue;
     }
 
     // Switch from deflate to store for empty file.
-    if (local_header->uncompressed_size == 0) {
-      cd_header.compression_method = local_header->compression_method = 0;
-      cd_header.compressed_size = local_header->compressed_size = 0;
+    if (entry.uncompressed_size == 0) {
+      cd_header.compression_method = 0;
+      entry.compressed_size = 0;
       continue;
     }
 
     // decompress
     size_t decompressed_size = 0;
     uint8_t* decompress_buf = static_cast<uint8_t*>(
-    decompress_mem_to_heap(p_read, local_header->compressed_size, &decompressed_size));
+    decompress_mem_to_heap(p_read, entry.compressed_size, &decompressed_size));
 
-    if (!decompress_buf || decompressed_size != local_header->uncompressed_size ||
-        local_header->crc32 != crc32(0, decompress_buf, local_header->uncompressed_size)) {
+    if (!decompress_buf || decompressed_size != entry.uncompressed_size ||
+        cd_header.crc32 != Crc32(decompress_buf, decompressed_size)) {
       cerr << "Decompression failed or CRC32 mismatch, skipping this file." << endl;
       free(decompress_buf);
-      memmove(p_write, p_read, local_header->compressed_size);
-      p_write += local_header->compressed_size;
+      memmove(p_write, p_read, entry.compressed_size);
+      p_write += entry.compressed_size;
+      continue;
+    }
+
+    // Reuse the result of an identical entry
+    string extension = EntryExtension(filename);
+    uint64_t hash = ContentHash(decompress_buf, decompressed_size);
+    uint32_t original_crc32 = cd_header.crc32;
+    uint64_t original_size = entry.uncompressed_size;
+    const EntryResult* duplicate = FindDuplicate(results, original_crc32, original_size, false, extension, hash);
+    if (duplicate) {
+      if (duplicate->compressed_size <= entry.compressed_size) {
+        memcpy(p_write, fp_w + duplicate->offset, duplicate->compressed_size);
+        cd_header.compression_method = duplicate->compression_method;
+        cd_header.crc32 = duplicate->crc32;
+        entry.compressed_size = duplicate->compressed_size;
+        entry.uncompressed_size = duplicate->uncompressed_size;
+      } else {
+        memmove(p_write, p_read, entry.compressed_size);
+      }
+      p_write += entry.compressed_size;
+      free(decompress_buf);
       continue;
     }
 
     // Leanify uncompressed file
-    uint32_t new_uncomp_size = RecompressFile(decompress_buf, decompressed_size, 0, filename, Options);
+    size_t new_uncomp_size = RecompressFile(decompress_buf, decompressed_size, 0, filename, Options);
 
     // recompress
     uint8_t* compress_buf = nullptr;
     size_t new_comp_size = 0;
-    ZopfliBuffer(Options.Mode, Options.DeflateMultithreading, decompress_buf, new_uncomp_size, &compress_buf, &new_comp_size);
+    if (SkipIncompressible(decompress_buf, new_uncomp_size, std::min<uint64_t>(new_uncomp_size, entry.compressed_size))) {
+      new_comp_size = SIZE_MAX;
+    } else {
+      ZopfliBuffer(Options.Mode, Options.DeflateMultithreading, decompress_buf, new_uncomp_size, &compress_buf, &new_comp_size);
+    }
 
     // switch to store if deflate makes file larger
-    if (new_uncomp_size <= new_comp_size && new_uncomp_size <= local_header->compressed_size) {
-      cd_header.compression_method = local_header->compression_method = 0;
-      cd_header.crc32 = local_header->crc32 = crc32(0, decompress_buf, new_uncomp_size);
-      cd_header.compressed_size = local_header->compressed_size = new_uncomp_size;
-      cd_header.uncompressed_size = local_header->uncompressed_size = new_uncomp_size;
+    if (new_uncomp_size <= new_comp_size && new_uncomp_size <= entry.compressed_size) {
+      cd_header.compression_method = 0;
+      cd_header.crc32 = Crc32(decompress_buf, new_uncomp_size);
+      entry.compressed_size = new_uncomp_size;
+      entry.uncompressed_size = new_uncomp_size;
       memcpy(p_write, decompress_buf, new_uncomp_size);
-    } else if (new_comp_size < local_header->compressed_size) {
-      cd_header.crc32 = local_header->crc32 = crc32(0, decompress_buf, new_uncomp_size);
-      cd_header.compressed_size = local_header->compressed_size = new_comp_size;
-      cd_header.uncompressed_size = local_header->uncompressed_size = new_uncomp_size;
+    } else if (new_comp_size < entry.compressed_size) {
+      cd_header.crc32 = Crc32(decompress_buf, new_uncomp_size);
+      entry.compressed_size = new_comp_size;
+      entry.uncompressed_size = new_uncomp_size;
       memcpy(p_write, compress_buf, new_comp_size);
     } else {
-      memmove(p_write, p_read, local_header->compressed_size);
+      memmove(p_write, p_read, entry.compressed_size);
     }
-    p_write += local_header->compressed_size;
+    results.emplace(ResultKey(original_crc32, original_size),
+                    EntryResult{false, extension, hash, (size_t)(p_write - fp_w), cd_header.compression_method,
+                                cd_header.crc32, entry.compressed_size, entry.uncompressed_size});
+    p_write += entry.compressed_size;
 
     free(decompress_buf);
     delete[] compress_buf;
   }
 
   // central directory offset
-  eocd.cd_offset = p_write - fp_w_base;
-  for (CDHeader& cd_header : cd_headers) {
-    cd_header.extra_field_len = cd_header.comment_len = 0;
+  uint64_t cd_offset = p_write - fp_w_base;
+  for (Entry& entry : entries) {
+    CDHeader& cd_header = entry.header;
+    LocalHeader* local_header = reinterpret_cast<LocalHeader*>(fp_w_base + entry.local_header_offset);
+    local_header->compression_method = cd_header.compression_method;
+    local_header->crc32 = cd_header.crc32;
+    if (entry.zip64_local) {
+      uint8_t* p_extra = reinterpret_cast<uint8_t*>(local_header) + sizeof(LocalHeader) + local_header->filename_len;
+      uint16_t extra_header[2] = { zip64_extra_id, 16 };
+      memcpy(p_extra, extra_header, 4);
+      memcpy(p_extra + 4, &entry.uncompressed_size, 8);
+      memcpy(p_extra + 12, &entry.compressed_size, 8);
+      local_header->compressed_size = local_header->uncompressed_size = zip64_marker;
+      local_header->version_needed = std::max(local_header->version_needed, zip64_version);
+    } else {
+      local_header->compressed_size = entry.compressed_size;
+      local_header->uncompressed_size = entry.uncompressed_size;
+    }
+
+    // Values that don't fit go to a ZIP64 extra field
+    uint64_t values[3] = { entry.uncompressed_size, entry.compressed_size, entry.local_header_offset };
+    uint64_t zip64_fields[3];
+    uint16_t zip64_count = 0;
+    for (uint64_t value : values) {
+      if (value >= zip64_marker) {
+        zip64_fields[zip64_count++] = value;
+      }
+    }
+    cd_header.uncompressed_size = std::min<uint64_t>(entry.uncompressed_size, zip64_marker);
+    cd_header.compressed_size = std::min<uint64_t>(entry.compressed_size, zip64_marker);
+    cd_header.local_header_offset = std::min<uint64_t>(entry.local_header_offset, zip64_marker);
+    cd_header.extra_field_len = zip64_count ? 4 + 8 * zip64_count : 0;
+    cd_header.comment_len = 0;
+    if (zip64_count) {
+      cd_header.version_needed = std::max(cd_header.version_needed, zip64_version);
+    }
 
     memcpy(p_write, &cd_header, sizeof(CDHeader));
     p_write += sizeof(CDHeader);
     // Copy the filename from local file header to central directory,
     // the old central directory might have been overwritten already because we sort them.
-    memcpy(p_write, fp_w_base + cd_header.local_header_offset + 30, cd_header.filename_len);
+    memcpy(p_write, fp_w_base + entry.local_header_offset + 30, cd_header.filename_len);
     p_write += cd_header.filename_len;
+    if (zip64_count) {
+      uint16_t extra_header[2] = { zip64_extra_id, (uint16_t)(8 * zip64_count) };
+      memcpy(p_write, extra_header, 4);
+      memcpy(p_write + 4, zip64_fields, 8 * zip64_count);
+      p_write += cd_header.extra_field_len;
+    }
+  }
+  uint64_t cd_size = p_write - fp_w_base - cd_offset;
+
+  // Archives with too many entries or a central directory beyond 4 GB need a ZIP64 EOCD
+  if (entries.size() >= 0xFFFF || cd_offset >= zip64_marker || cd_size >= zip64_marker) {
+    EOCD64 eocd64;
+    eocd64.version_made_by = eocd64.version_needed = zip64_version;
+    eocd64.disk_num = eocd64.disk_cd_start = 0;
+    eocd64.num_records = eocd64.num_records_total = entries.size();
+    eocd64.cd_size = cd_size;
+    eocd64.cd_offset = cd_offset;
+    EOCD64Locator locator;
+    locator.disk_eocd64 = 0;
+    locator.eocd64_offset = p_write - fp_w_base;
+    locator.num_disks = 1;
+    memcpy(p_write, &eocd64, sizeof(EOCD64));
+    p_write += sizeof(EOCD64);
+    memcpy(p_write, &locator, sizeof(EOCD64Locator));
+    p_write += sizeof(EOCD64Locator);
   }
 
   // Update end of central directory record
-  eocd.num_records = eocd.num_records_total = cd_headers.size();
-  eocd.cd_size = p_write - fp_w_base - eocd.cd_offset;
+  eocd.num_records = eocd.num_records_total = std::min<uint64_t>(entries.size(), 0xFFFF);
+  eocd.cd_size = std::min<uint64_t>(cd_size, zip64_marker);
+  eocd.cd_offset = std::min<uint64_t>(cd_offset, zip64_marker);
   eocd.comment_len = 0;
+  string comment;
+  if (Options.ZipManifest && !in_memory_) {
+    comment = ManifestComment(Options.Mode, SettingsKey(Options), entries, entries.size(), fp_w_base);
+    if (p_write + sizeof(EOCD) + comment.size() > fp_ + size_) {
+      comment.clear();
+    }
+    eocd.comment_len = comment.size();
+  }
 
   memcpy(p_write, &eocd, sizeof(EOCD));
+  memcpy(p_write + sizeof(EOCD), comment.data(), comment.size());
 
-  size_ = p_write + sizeof(EOCD) - fp_;
+  size_ = p_write + sizeof(EOCD) + comment.size() - fp_;
   return size_;
 }
+
+size_t Zip::Manifest(const ECTOptions& Options, string* comment) {
+  uint8_t* first_local_header = std::search(fp_, fp_ + size_, header_magic, std::end(header_magic));
+  size_t base_offset = 0;
+  EOCD eocd;
+  vector<Entry> entries;
+  uint8_t* p_eocd = ReadCentralDirectory(fp_, size_, first_local_header - fp_, &eocd, &entries, &base_offset);
+  if (first_local_header == fp_ + size_ || !p_eocd) {
+    return 0;
+  }
+  *comment = ManifestComment(Options.Mode, SettingsKey(Options), entries, entries.size(), fp_ + base_offset);
+  return p_eocd + sizeof(EOCD) - fp_;
+}
@@ -5,10 +5,13 @@
 
 class Zip {
  public:
-  explicit Zip(void* p, size_t s) : fp_(static_cast<uint8_t*>(p)), size_(s) {}
+  explicit Zip(void* p, size_t s, bool in_memory = false) : fp_(static_cast<uint8_t*>(p)), size_(s), in_memory_(in_memory) {}
 
   size_t Leanify(const ECTOptions& Options, size_t* files);
-  uint32_t RecompressFile(unsigned char* data, uint32_t size, uint32_t size_leanified, std::string filename, const ECTOptions& Options);
+  // Computes the comment marking all entries as optimized with Options, returns the offset of the archive comment
+  // or 0 on error.
+  size_t Manifest(const ECTOptions& Options, std::string* comment);
+  size_t RecompressFile(unsigned char* data, size_t size, size_t size_leanified, std::string filename, const ECTOptions& Options);
 
   static const uint8_t header_magic[4];
 
@@ -17,6 +20,8 @@ protected:
   uint8_t* fp_;
   // size of the file
   size_t size_;
+  // recompress embedded files through bufferHandler instead of temp files
+  bool in_memory_;
 };
 
 #endif  // FORMATS_ZIP_H_
@@ -0,0 +1,406 @@
+//
+//  libect.cpp
+//  Efficient Compression Tool
+//
+//  In-memory counterparts of the file handlers in handlers.cpp, see libect.h.
+//
+
+#include "libect.h"
+#include "main.h"
+#include "lodepng/lodepng.h"
+#include "lodepng/lodepng_util.h"
+#include "leanify/zip.h"
+#include "zlib/zlib.h"
+#include "zopfli/squeeze.h"
+#include <new>
+
+static ECTOptions ToECTOptions(const ECTLibOptions* options){
+    ECTOptions Options;
+    Options.Mode = options->Mode;
+    Options.palette_sort = (options->palette_sort > 120 ? 120 : options->palette_sort) << 8;
+    Options.strip = options->strip;
+    Options.Progressive = options->Progressive;
+    Options.JPEG_ACTIVE = true;
+    Options.PNG_ACTIVE = true;
+    Options.SavingsCounter = false;
+    Options.Strict = options->Strict;
+    Options.Arithmetic = options->Arithmetic;
+    Options.Gzip = false;
+    Options.Zip = false;
+    Options.Reuse = options->Reuse;
+    Options.Allfilters = options->Allfilters && !options->Reuse;
+    Options.Allfiltersbrute = options->Allfiltersbrute && Options.Allfilters;
+    Options.Allfilterscheap = options->Allfilterscheap;
+#ifdef BOOST_SUPPORTED
+    Options.Recurse = false;
+#endif
+    Options.DeflateMultithreading = options->DeflateMultithreading;
+    Options.Threads = options->Threads;
+    Options.keep = false;
+    Options.ZipManifest = false;
+    return Options;
+}
+
+struct TrialDeflate {
+    int level;
+    int strategy;
+};
+
+// Deflate backend for the filter trials, using the zlib settings of the optipng pass.
+static unsigned TrialPNGDeflate(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize, const LodePNGCompressSettings* settings) {
+    const TrialDeflate* trial = static_cast<const TrialDeflate*>(settings->custom_context);
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, trial->level, Z_DEFLATED, -15, 8, trial->strategy) != Z_OK){
+        return 83;
+    }
+    uLong bound = deflateBound(&stream, insize);
+    *out = (unsigned char*)malloc(bound);
+    if (!*out){
+        deflateEnd(&stream);
+        return 83;
+    }
+    stream.next_in = (Bytef*)in;
+    stream.avail_in = insize;
+    stream.next_out = *out;
+    stream.avail_out = bound;
+    int err = deflate(&stream, Z_FINISH);
+    *outsize = stream.total_out;
+    deflateEnd(&stream);
+    return err == Z_STREAM_END ? 0 : 83;
+}
+
+static unsigned TrialEncode(std::vector<unsigned char>& image, unsigned w, unsigned h, bool bit16, bool filtered, const TrialDeflate& settings, bool strict, std::vector<unsigned char>* out){
+    lodepng::State state;
+    state.encoder.zlibsettings.custom_deflate = TrialPNGDeflate;
+    state.encoder.zlibsettings.custom_context = &settings;
+    state.encoder.clean_alpha = !strict;
+    state.encoder.text_compression = 0;
+    state.encoder.filter_strategy = filtered ? LFS_MINSUM : LFS_ZERO;
+    state.div = 3;
+    if (bit16){
+        state.info_raw.bitdepth = 16;
+    }
+    LodePNGPaletteSettings p;
+    memset(&p, 0, sizeof(p));
+    p.order = LPOS_NONE;
+    return lodepng::encode(*out, image, w, h, state, p);
+}
+
+// Replaces the optipng pass of OptimizePNG: Compares zlib encodings without and with filtering and
+// returns the filter to use for Zopflipng, or -1 on error. In mode 1 the result of the pass is
+// stored in png if it's smaller. Like the rest of libect it doesn't print anything.
+static int ChooseFilter(std::vector<unsigned char>& png, unsigned mode, bool strict, bool strip){
+    std::vector<unsigned char> image;
+    unsigned w, h;
+    lodepng::State inputstate;
+    unsigned error = lodepng::decode(image, w, h, inputstate, png);
+    bool bit16 = !error && inputstate.info_png.color.bitdepth == 16;
+    if (bit16){
+        image.clear();
+        error = lodepng::decode(image, w, h, png, LCT_RGBA, 16);
+    }
+    if (error){
+        return -1;
+    }
+
+    TrialDeflate settings;
+    settings.level = mode == 2 ? 3 : mode < 4 ? 5 : mode > 8 ? 9 : mode > 6 ? 7 : 6;
+    settings.strategy = Z_DEFAULT_STRATEGY;
+    std::vector<unsigned char> unfiltered, filtered;
+    if (TrialEncode(image, w, h, bit16, false, settings, strict, &unfiltered)){
+        return -1;
+    }
+    if (mode == 1){
+        settings.strategy = Z_FILTERED;
+    }
+    if (TrialEncode(image, w, h, bit16, true, settings, strict, &filtered)){
+        return -1;
+    }
+
+    int filter = 0;
+    if (unfiltered.size() * (mode > 4 ? 1.015 : 1) > filtered.size()){
+        filter = mode == 2 ? 8 : mode > 3 ? 11 : 5;
+    }
+
+    if (mode == 1){
+        settings.level = 1;
+        settings.strategy = filter ? Z_FILTERED : Z_DEFAULT_STRATEGY;
+        std::vector<unsigned char> result;
+        if (TrialEncode(image, w, h, bit16, filter, settings, strict, &result)){
+            return -1;
+        }
+        if (!strip){
+            std::vector<std::string> names[3];
+            std::vector<std::vector<unsigned char> > chunks[3];
+            lodepng::getChunks(names, chunks, png);
+            lodepng::insertChunks(result, chunks);
+        }
+        if (result.size() <= png.size()){
+            png.swap(result);
+        }
+    }
+    return filter;
+}
+
+// Removes ancillary chunks except tRNS and the APNG chunks, like Optipng(0).
+static void StripPNG(std::vector<unsigned char>& png){
+    if (png.size() < 8){
+        return;
+    }
+    std::vector<unsigned char> out(png.begin(), png.begin() + 8);
+    size_t pos = 8;
+    while (pos + 12 <= png.size()){
+        const unsigned char* chunk = &png[pos];
+        size_t chunksize = (size_t)lodepng_chunk_length(chunk) + 12;
+        if (chunksize > png.size() - pos){
+            return;
+        }
+        if (!lodepng_chunk_ancillary(chunk) || lodepng_chunk_type_equals(chunk, "tRNS") || lodepng_chunk_type_equals(chunk, "acTL")
+            || lodepng_chunk_type_equals(chunk, "fcTL") || lodepng_chunk_type_equals(chunk, "fdAT")){
+            out.insert(out.end(), chunk, chunk + chunksize);
+        }
+        pos += chunksize;
+    }
+    if (pos == png.size()){
+        png.swap(out);
+    }
+}
+
+static unsigned OptimizePNGBuffer(std::vector<unsigned char>& png, const ECTOptions& Options){
+    unsigned _mode = Options.Mode;
+    unsigned mode = (Options.Mode % 10000) > 9 ? 9 : (Options.Mode % 10000);
+    if (mode == 1 && Options.Reuse){
+        mode++;
+    }
+    int x = 1;
+    if(mode == 9 && !Options.Reuse && !Options.Allfilters){
+        x = ZopflipngBuffer(Options.strip, png, Options.Strict, 3, 0, Options.DeflateMultithreading, Options.Threads, 0, false);
+        if(x < 0){
+            return 1;
+        }
+    }
+    int filter = 0;
+    if (!Options.Allfilters){
+        filter = Options.Reuse ? 6 : ChooseFilter(png, mode, Options.Strict, Options.strip);
+    }
+
+    if (filter == -1){
+        return 1;
+    }
+    if(filter && !Options.Allfilters && Options.Allfilterscheap && !Options.Reuse){
+        filter = 15;
+    }
+    if (mode != 1){
+        if (Options.Allfilters){
+            //Same order as OptimizePNG
+            static const int filters[] = {6, 0, 5, 1, 2, 3, 4, 7, 8, 11, 12, 13, 9, 10, 14};
+            PNGTrialCache* cache = ZopflipngCreateCache();
+            x = ZopflipngBuffer(Options.strip, png, Options.Strict, _mode, filters[0] + Options.palette_sort, Options.DeflateMultithreading, Options.Threads, cache, false);
+            if(x < 0){
+                ZopflipngFreeCache(cache);
+                return 1;
+            }
+            for (unsigned i = 1; i < (Options.Allfiltersbrute ? 15 : 12); i++){
+                ZopflipngBuffer(Options.strip, png, Options.Strict, _mode, filters[i] + Options.palette_sort, Options.DeflateMultithreading, Options.Threads, cache, false);
+            }
+            ZopflipngFreeCache(cache);
+        }
+        else if (mode == 9){
+            ZopflipngBuffer(Options.strip, png, Options.Strict, _mode, filter + Options.palette_sort, Options.DeflateMultithreading, Options.Threads, 0, false);
+        }
+        else {
+            x = ZopflipngBuffer(Options.strip, png, Options.Strict, _mode, filter + Options.palette_sort, Options.DeflateMultithreading, Options.Threads, 0, false);
+            if(x < 0){
+                return 1;
+            }
+        }
+    }
+
+    if(Options.strip && x){
+        StripPNG(png);
+    }
+    return 0;
+}
+
+static unsigned OptimizeJPEGBuffer(std::vector<unsigned char>& jpeg, const ECTOptions& Options){
+    size_t stsize = 0;
+    std::vector<unsigned char> out;
+
+    int res = mozjpegtranBuffer(Options.Arithmetic, Options.Progressive && (Options.Mode > 1 || jpeg.size() > 5000), Options.strip, jpeg.data(), jpeg.size(), &out, &stsize);
+    if (!out.empty()){
+        jpeg.swap(out);
+    }
+    if (Options.Progressive && Options.Mode > 1 && res != 2){
+        if(res == 1 || (Options.Mode == 2 && stsize < 6500) || (Options.Mode == 3 && stsize < 10000) || (Options.Mode == 4 && stsize < 15000) || (Options.Mode > 4 && stsize < 20000)){
+            res = mozjpegtranBuffer(Options.Arithmetic, false, Options.strip, jpeg.data(), jpeg.size(), &out, &stsize);
+            if (!out.empty()){
+                jpeg.swap(out);
+            }
+        }
+    }
+    return res == 2;
+}
+
+unsigned bufferHandler(std::vector<unsigned char>& data, const char* extension, const ECTOptions& Options){
+    std::string x = extension;
+    if (Options.PNG_ACTIVE && (x == "PNG" || x == "png")){
+        return OptimizePNGBuffer(data, Options);
+    }
+    if (Options.JPEG_ACTIVE && (x == "jpg" || x == "JPG" || x == "JPEG" || x == "jpeg")){
+        return OptimizeJPEGBuffer(data, Options);
+    }
+    return 0;
+}
+
+// Inflates all members of a gzip stream, returns false if in isn't a valid one.
+static bool ungzBuffer(const unsigned char* in, size_t insize, std::vector<unsigned char>* out){
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK){
+        throw std::bad_alloc();
+    }
+    stream.next_in = (Bytef*)in;
+    stream.avail_in = insize;
+    unsigned char buf[32768];
+    int err;
+    do {
+        stream.next_out = buf;
+        stream.avail_out = sizeof(buf);
+        err = inflate(&stream, Z_NO_FLUSH);
+        out->insert(out->end(), buf, buf + sizeof(buf) - stream.avail_out);
+        if (err == Z_STREAM_END && stream.avail_in){
+            inflateReset(&stream);
+            err = Z_OK;
+        }
+    } while (err == Z_OK);
+    inflateEnd(&stream);
+    if (err == Z_MEM_ERROR){
+        throw std::bad_alloc();
+    }
+    return err == Z_STREAM_END;
+}
+
+static void CopyOutput(const unsigned char* data, size_t size, unsigned char** out, size_t* outsize){
+    *out = (unsigned char*)malloc(size ? size : 1);
+    if (!*out){
+        throw std::bad_alloc();
+    }
+    memcpy(*out, data, size);
+    *outsize = size;
+}
+
+template <typename F>
+static int RunGuarded(F f, unsigned char** out, size_t* outsize){
+    *out = 0;
+    *outsize = 0;
+    ZopfliResetCostModel();
+    try {
+        return f();
+    }
+    catch (std::bad_alloc&) {
+        free(*out);
+        *out = 0;
+        *outsize = 0;
+        return ECT_OUT_OF_MEMORY;
+    }
+    //No exception may reach the C caller
+    catch (...) {
+        free(*out);
+        *out = 0;
+        *outsize = 0;
+        return ECT_ERROR;
+    }
+}
+
+void ECT_DefaultOptions(ECTLibOptions* options){
+    memset(options, 0, sizeof(*options));
+    options->Mode = 3;
+}
+
+int ECT_OptimizePNG(const unsigned char* in, size_t insize, const ECTLibOptions* options, unsigned char** out, size_t* outsize){
+    return RunGuarded([&]{
+        ECTOptions Options = ToECTOptions(options);
+        std::vector<unsigned char> png(in, in + insize);
+        if (OptimizePNGBuffer(png, Options)){
+            return ECT_ERROR;
+        }
+        CopyOutput(png.data(), png.size(), out, outsize);
+        return ECT_OK;
+    }, out, outsize);
+}
+
+int ECT_OptimizeJPEG(const unsigned char* in, size_t insize, const ECTLibOptions* options, unsigned char** out, size_t* outsize){
+    return RunGuarded([&]{
+        ECTOptions Options = ToECTOptions(options);
+        std::vector<unsigned char> jpeg(in, in + insize);
+        if (OptimizeJPEGBuffer(jpeg, Options)){
+            return ECT_ERROR;
+        }
+        CopyOutput(jpeg.data(), jpeg.size(), out, outsize);
+        return ECT_OK;
+    }, out, outsize);
+}
+
+int ECT_Gzip(const unsigned char* in, size_t insize, const ECTLibOptions* options, unsigned char** out, size_t* outsize){
+    return RunGuarded([&]{
+        //Zopfli reads up to 8 bytes past the end of its input
+        std::vector<unsigned char> data;
+        time_t mtime = 0;
+        bool isGZ = insize >= 18 && in[0] == 31 && in[1] == 139;
+        if (isGZ){
+            if (in[3] & 0x20){ //Encrypted
+                return ECT_ERROR;
+            }
+            if ((in[3] & 0x1c) && options->Strict){ //extra field, file name or comment
+                return ECT_ERROR;
+            }
+            if (!ungzBuffer(in, insize, &data)){
+                return ECT_ERROR;
+            }
+            mtime = in[4] | in[5] << 8 | in[6] << 16 | (time_t)in[7] << 24;
+        }
+        else {
+            data.assign(in, in + insize);
+        }
+        size_t size = data.size();
+        if (isGZ && ZopfliIncompressible(data.data(), size, insize)){
+            CopyOutput(in, insize, out, outsize);
+            return ECT_OK;
+        }
+        data.resize(size + 8);
+        ZopfliGzipBuffer(options->Mode, options->DeflateMultithreading, data.data(), size, mtime, out, outsize);
+        if (isGZ && *outsize >= insize){
+            free(*out);
+            *out = 0;
+            CopyOutput(in, insize, out, outsize);
+        }
+        return ECT_OK;
+    }, out, outsize);
+}
+
+int ECT_Zlib(const unsigned char* in, size_t insize, const ECTLibOptions* options, unsigned char** out, size_t* outsize){
+    return RunGuarded([&]{
+        std::vector<unsigned char> data(insize + 8);
+        memcpy(data.data(), in, insize);
+        ZopfliZlibBuffer(options->Mode, options->DeflateMultithreading, data.data(), insize, out, outsize);
+        return ECT_OK;
+    }, out, outsize);
+}
+
+int ECT_OptimizeZIP(const unsigned char* in, size_t insize, const ECTLibOptions* options, unsigned char** out, size_t* outsize){
+    return RunGuarded([&]{
+        if (insize < sizeof(Zip::header_magic) || memcmp(in, Zip::header_magic, sizeof(Zip::header_magic))){
+            return ECT_ERROR;
+        }
+        ECTOptions Options = ToECTOptions(options);
+        CopyOutput(in, insize, out, outsize);
+        size_t files = 0;
+        *outsize = ReZipBuffer(*out, insize, Options, &files);
+        return ECT_OK;
+    }, out, outsize);
+}
+
+void ECT_Free(unsigned char* buf){
+    free(buf);
+}
@@ -0,0 +1,72 @@
+//
+//  libect.h
+//  Efficient Compression Tool
+//
+//  In-memory optimization API, built as libect by "make lib" or "make shared".
+//  All functions are thread-safe and report allocation failures through their
+//  return value instead of exiting.
+//
+
+#ifndef __Efficient_Compression_Tool__libect__
+#define __Efficient_Compression_Tool__libect__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Mirrors ECTOptions. Initialize with ECT_DefaultOptions, which matches the
+   command line defaults. */
+typedef struct ECTLibOptions {
+  unsigned Mode;                  /* Compression level 1-9, or the -xxyy form accepted by the command line */
+  unsigned palette_sort;          /* Number of palette sorting strategies to try for PNGs, up to 120 */
+  int strip;                      /* Strip metadata */
+  int Progressive;                /* Use progressive encoding for JPEGs */
+  int Strict;                     /* Enable strict losslessness */
+  int Arithmetic;                 /* Use arithmetic encoding for JPEGs */
+  int Reuse;                      /* Keep PNG filter and colortype */
+  int Allfilters;                 /* Try all PNG filter modes */
+  int Allfiltersbrute;            /* Also try the brute force PNG filter modes */
+  int Allfilterscheap;            /* Try the cheap PNG filter modes */
+  unsigned DeflateMultithreading; /* Threads used per Deflate stream, 0 to disable */
+  unsigned Threads;               /* Threads the PNG trials of one call may use, 0 for one per core */
+} ECTLibOptions;
+
+/* Return values */
+#define ECT_OK 0
+#define ECT_ERROR 1          /* Input could not be processed */
+#define ECT_OUT_OF_MEMORY 2
+
+void ECT_DefaultOptions(ECTLibOptions* options);
+
+/*
+All functions below read insize bytes from in and on success store a buffer
+allocated with malloc in *out and its size in *outsize, which the caller
+releases with ECT_Free. The optimizers return the input unchanged if it can't
+be made smaller. On error *out is 0.
+*/
+
+/* Losslessly optimizes a PNG image. */
+int ECT_OptimizePNG(const unsigned char* in, size_t insize, const ECTLibOptions* options, unsigned char** out, size_t* outsize);
+
+/* Losslessly optimizes a JPEG image. */
+int ECT_OptimizeJPEG(const unsigned char* in, size_t insize, const ECTLibOptions* options, unsigned char** out, size_t* outsize);
+
+/* Compresses in to a gzip stream. If in already is a gzip stream, it is
+   recompressed instead and the smaller of both is returned. */
+int ECT_Gzip(const unsigned char* in, size_t insize, const ECTLibOptions* options, unsigned char** out, size_t* outsize);
+
+/* Compresses in to a zlib stream. */
+int ECT_Zlib(const unsigned char* in, size_t insize, const ECTLibOptions* options, unsigned char** out, size_t* outsize);
+
+/* Recompresses a ZIP archive, including the PNG, JPEG and ZIP files inside it. */
+int ECT_OptimizeZIP(const unsigned char* in, size_t insize, const ECTLibOptions* options, unsigned char** out, size_t* outsize);
+
+void ECT_Free(unsigned char* buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* defined(__Efficient_Compression_Tool__libect__) */
@@ -33,6 +33,7 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 
 #include "lodepng.h"
 #include "../zlib/zlib.h"
+#include "../stats.h"
 
 #include <math.h>
 #include <stdio.h>
@@ -42,6 +43,20 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <fstream>
 #include <algorithm>
 #endif /*LODEPNG_COMPILE_CPP*/
+#include <chrono>
+#ifndef NOMULTI
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && !defined(LODEPNG_NO_SIMD)
+/*SSE2 filter kernels, AVX2 ones are selected at runtime when the CPU has it*/
+#define LODEPNG_X86_SIMD
+#include <immintrin.h>
+#include <string.h>
+#endif
 
 /*
 This source file is built up in the following large parts. The code sections
@@ -260,65 +275,49 @@ static void lodepng_add32bitInt(ucvector* buffer, unsigned value)
 unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
                                 const unsigned char* in, size_t insize)
 {
-
-	z_stream inf;
+  z_stream inf;
   inf.zalloc = 0;
   inf.zfree = 0;
   inf.opaque = 0;
   inf.next_in = (z_const Byte *)in;
   inf.avail_in = (uInt)insize;
 
-//The reallocation speed on windows(or at least mingw) is pretty bad which makes this a lot faster. A bigger buffer would be even better on large images.
-#if defined(_WIN32) || defined(WIN32)
-#define BUFSIZE 1024 * 128
- unsigned char* buf = (unsigned char*)malloc(BUFSIZE);
- if(!buf) {exit(1);}
-#else
-	#define BUFSIZE 1024 * 32
-  unsigned char buf[BUFSIZE];
-#endif
- 
-  inf.next_out = buf;
-  inf.avail_out = BUFSIZE;
-
   if(inflateInit2(&inf, -15) != Z_OK){return 83;}
 
+  /*Inflate straight into the output and double it when full. Growing in small steps through a bounce buffer
+  meant a copy of everything and a realloc every 32 KB, which is slow on big images (especially on windows).*/
+  size_t capacity = *outsize;
+  size_t step = insize < 8192 ? 32768 : insize * 4;
   while(1){
+    if(*outsize == capacity){
+      capacity += step;
+      step = capacity;
+      unsigned char* grown = (unsigned char*)realloc(*out, capacity);
+      if(!grown){
+        inflateEnd(&inf);
+        return 83;
+      }
+      *out = grown;
+    }
+    size_t room = capacity - *outsize;
+    inf.next_out = *out + *outsize;
+    inf.avail_out = room > (1u << 30) ? (1u << 30) : (uInt)room;
     int err = inflate(&inf, Z_SYNC_FLUSH);
-    if (err == Z_OK){
-      (*out) = (unsigned char*)realloc((*out), (*outsize) + BUFSIZE);
-      memcpy(&((*out)[(*outsize)]), buf, BUFSIZE);
-      (*outsize) += BUFSIZE;
-      inf.next_out = buf;
-      inf.avail_out = BUFSIZE;
-    }
-    else if(err == Z_STREAM_END){
-      unsigned consumed = BUFSIZE - inf.avail_out;
-      (*out) = (unsigned char*)realloc((*out), (*outsize) + consumed);
-      memcpy(&((*out)[(*outsize)]), buf, consumed);
-      (*outsize) += consumed;
+    *outsize = inf.next_out - *out;
+    if(err == Z_STREAM_END){
       break;
     }
-    else{
-#if defined(_WIN32) || defined(WIN32)
-      free(buf);
-#endif
-      unsigned ret = 95;
-      if(err == Z_MEM_ERROR){ret = 83;}
+    if(err != Z_OK){
       inflateEnd(&inf);
-      return ret;
+      return err == Z_MEM_ERROR ? 83 : 95;
     }
   }
   if(inflateEnd(&inf) != Z_OK){
-#if defined(_WIN32) || defined(WIN32)
-    free(buf);
-#endif
     return 83;
   }
-  
-#if defined(_WIN32) || defined(WIN32)
-	free(buf);
-#endif
+  /*give back what the last doubling didn't use*/
+  unsigned char* shrunk = (unsigned char*)realloc(*out, *outsize ? *outsize : 1);
+  if(shrunk) *out = shrunk;
   return 0;
 }
 
@@ -452,6 +451,8 @@ void lodepng_compress_settings_init(LodePNGCompressSettings* settings)
   settings->lazymatching = 1;
 
   settings->custom_deflate = 0;
+  settings->custom_deflate_chunk = 0;
+  settings->chunk_size = 0;
   settings->custom_context = 0;
 }
 
@@ -1126,35 +1127,60 @@ static int color_tree_inc(ColorTree* tree,
   return ++(tree->index);
 }
 
-#ifdef LODEPNG_COMPILE_ENCODER
-static int color_tree_has(ColorTree* tree, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+/*
+Hash table from color to palette index, for palettes and the color count of lodepng_get_color_profile,
+which never hold more than 257 colors. Unlike ColorTree it needs no allocations: building the tree took
+longer than encoding a small image.
+*/
+#define COLOR_TABLE_SIZE 512 /*power of two, at least twice the number of colors stored*/
+
+typedef struct ColorTable
 {
-  return color_tree_get(tree, r, g, b, a) >= 0;
+  unsigned colors[COLOR_TABLE_SIZE];
+  int index[COLOR_TABLE_SIZE]; /*-1 for an empty slot, the payload as in ColorTree otherwise*/
+} ColorTable;
+
+static void color_table_init(ColorTable* table)
+{
+  memset(table->index, 255, sizeof(table->index));
 }
-#endif /*LODEPNG_COMPILE_ENCODER*/
 
-/*color is not allowed to already exist.
-Index should be >= 0 (it's signed to be compatible with using -1 for "doesn't exist")*/
-static void color_tree_add(ColorTree* tree,
-                           unsigned char r, unsigned char g, unsigned char b, unsigned char a, unsigned index)
+/*returns the slot of the color, or the empty slot it would be stored in*/
+static unsigned color_table_slot(const ColorTable* table,
+                                 unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
-  int bit;
-  for(bit = 0; bit < 8; ++bit)
-  {
-    int i = 8 * ((r >> bit) & 1) + 4 * ((g >> bit) & 1) + 2 * ((b >> bit) & 1) + 1 * ((a >> bit) & 1);
-    if(!tree->children[i])
-    {
-      tree->children[i] = (ColorTree*)lodepng_malloc(sizeof(ColorTree));
-      color_tree_init(tree->children[i]);
-    }
-    tree = tree->children[i];
-  }
-  tree->index = (int)index;
+  unsigned color = r | (unsigned)g << 8 | (unsigned)b << 16 | (unsigned)a << 24;
+  unsigned slot = (color * 2654435761u) >> 23;
+  while(table->index[slot] >= 0 && table->colors[slot] != color) slot = (slot + 1) & (COLOR_TABLE_SIZE - 1);
+  return slot;
+}
+
+/*returns -1 if color not present, its index otherwise*/
+static int color_table_get(const ColorTable* table, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+{
+  return table->index[color_table_slot(table, r, g, b, a)];
+}
+
+/*like color_tree_inc, returns the number of times the color was already seen*/
+static int color_table_inc(ColorTable* table, unsigned char r, unsigned char g, unsigned char b, unsigned char a)
+{
+  unsigned slot = color_table_slot(table, r, g, b, a);
+  table->colors[slot] = r | (unsigned)g << 8 | (unsigned)b << 16 | (unsigned)a << 24;
+  return ++table->index[slot];
+}
+
+/*color is not allowed to already exist*/
+static void color_table_add(ColorTable* table,
+                            unsigned char r, unsigned char g, unsigned char b, unsigned char a, unsigned index)
+{
+  unsigned slot = color_table_slot(table, r, g, b, a);
+  table->colors[slot] = r | (unsigned)g << 8 | (unsigned)b << 16 | (unsigned)a << 24;
+  table->index[slot] = (int)index;
 }
 
 /*put a pixel, given its RGBA color, into image of any color type*/
 static unsigned rgba8ToPixel(unsigned char* out, size_t i,
-                             const LodePNGColorMode* mode, ColorTree* tree /*for palette*/,
+                             const LodePNGColorMode* mode, const ColorTable* table /*for palette*/,
                              unsigned char r, unsigned char g, unsigned char b, unsigned char a)
 {
   if(mode->colortype == LCT_GREY)
@@ -1186,7 +1212,7 @@ static unsigned rgba8ToPixel(unsigned char* out, size_t i,
   }
   else if(mode->colortype == LCT_PALETTE)
   {
-    int index = color_tree_get(tree, r, g, b, a);
+    int index = color_table_get(table, r, g, b, a);
     if(index < 0) return 82; /*color not in palette*/
     if(mode->bitdepth == 8) out[i] = index;
     else addColorBits(out, i, mode->bitdepth, (unsigned)index);
@@ -1561,7 +1587,7 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
                          unsigned w, unsigned h)
 {
   size_t i;
-  ColorTree tree;
+  ColorTable table;
   size_t numpixels = (unsigned long long)w * h;
 
   if(lodepng_color_mode_equal(mode_out, mode_in))
@@ -1575,11 +1601,11 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
   {
     size_t palsize = 1u << mode_out->bitdepth;
     if(mode_out->palettesize < palsize) palsize = mode_out->palettesize;
-    color_tree_init(&tree);
+    color_table_init(&table);
     for(i = 0; i != palsize; ++i)
     {
       unsigned char* p = &mode_out->palette[i * 4];
-      color_tree_add(&tree, p[0], p[1], p[2], p[3], i);
+      color_table_add(&table, p[0], p[1], p[2], p[3], i);
     }
   }
 
@@ -1611,7 +1637,7 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
         out[i] = prevbyte;
       }
       else{
-        int index = color_tree_get(&tree, in[i * 4], in[i * 4 + 1], in[i * 4 + 2], in[i * 4 + 3]);
+        int index = color_table_get(&table, in[i * 4], in[i * 4 + 1], in[i * 4 + 2], in[i * 4 + 3]);
         out[i] = index;
         match = m;
         prevbyte = index;
@@ -1623,15 +1649,10 @@ unsigned lodepng_convert(unsigned char* out, const unsigned char* in,
     for(i = 0; i != numpixels; ++i)
     {
       getPixelColorRGBA8(&r, &g, &b, &a, in, i, mode_in);
-      rgba8ToPixel(out, i, mode_out, &tree, r, g, b, a);
+      rgba8ToPixel(out, i, mode_out, &table, r, g, b, a);
     }
   }
 
-  if(mode_out->colortype == LCT_PALETTE)
-  {
-    color_tree_cleanup(&tree);
-  }
-
   return 0; /*no error (this function currently never has one, but maybe OOM detection added later.)*/
 }
 
@@ -1736,8 +1757,8 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
   }
   else /* < 16-bit */
   {
-    ColorTree tree;
-    color_tree_init(&tree);
+    ColorTable table;
+    color_table_init(&table);
 
     if (mode->colortype == LCT_RGBA && mode->bitdepth == 8){
 
@@ -1796,9 +1817,9 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
           unsigned m = *(unsigned*)(image + 4 * i);
           if (m != match){
             match = m;
-            if(!color_tree_has(&tree, r, g, b, a))
+            if(color_table_get(&table, r, g, b, a) < 0)
             {
-              color_tree_add(&tree, r, g, b, a, profile->numcolors);
+              color_table_add(&table, r, g, b, a, profile->numcolors);
               if(profile->numcolors < 256)
               {
                 unsigned char* p = profile->palette;
@@ -1867,9 +1888,9 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
 
       if(!numcolors_done)
       {
-        if(!color_tree_has(&tree, r, g, b, a))
+        if(color_table_get(&table, r, g, b, a) < 0)
         {
-          color_tree_add(&tree, r, g, b, a, profile->numcolors);
+          color_table_add(&table, r, g, b, a, profile->numcolors);
           if(profile->numcolors < 256)
           {
             unsigned char* p = profile->palette;
@@ -1892,7 +1913,6 @@ unsigned lodepng_get_color_profile(LodePNGColorProfile* profile,
     profile->key_r += (profile->key_r << 8);
     profile->key_g += (profile->key_g << 8);
     profile->key_b += (profile->key_b << 8);
-    color_tree_cleanup(&tree);
   }
 
   unsigned char r = 0, g = 0, b = 0, a = 0;
@@ -1910,11 +1930,11 @@ static void optimize_palette(LodePNGColorMode* mode_out, const uint32_t* image,
                       LodePNGPaletteOrderStrategy order) {
   if (order == LPOS_NONE) return;
   size_t count = 0;
-  ColorTree tree;
-  color_tree_init(&tree);
+  ColorTable table;
+  color_table_init(&table);
   for (size_t i = 0; i < w * h; ++i) {
     const unsigned char* c = (unsigned char*)&image[i];
-    if (color_tree_inc(&tree, c[0], c[1], c[2], c[3]) == 0) ++count;
+    if (color_table_inc(&table, c[0], c[1], c[2], c[3]) == 0) ++count;
   }
   // sortfield format:
   // bit 0-7: original palette index
@@ -1929,7 +1949,7 @@ static void optimize_palette(LodePNGColorMode* mode_out, const uint32_t* image,
     case LPPS_POPULARITY:
       for (size_t i = 0; i < count; ++i) {
         const unsigned char* p = (unsigned char*)&palette_in[i];
-        sortfield[i] |= (color_tree_get(&tree, p[0], p[1], p[2], p[3]) + 1) << 8;
+        sortfield[i] |= (color_table_get(&table, p[0], p[1], p[2], p[3]) + 1) << 8;
       }
       break;
     case LPPS_RGB:
@@ -2103,7 +2123,7 @@ static void optimize_palette(LodePNGColorMode* mode_out, const uint32_t* image,
             const int a2 = c2[3];
             dist += (a - a2) * (a - a2);
           }
-          dist /= (color_tree_get(&tree, c2[0], c2[1], c2[2], c2[3]) + 1);
+          dist /= (color_table_get(&table, c2[0], c2[1], c2[2], c2[3]) + 1);
           if (dist < bestdist) {
             bestdist = dist;
             best = j;
@@ -2115,33 +2135,33 @@ static void optimize_palette(LodePNGColorMode* mode_out, const uint32_t* image,
       break;
     case LPOS_NEAREST_NEIGHBOR:
     {
-      ColorTree paltree;
-      color_tree_init(&paltree);
+      ColorTable paltable;
+      color_table_init(&paltable);
       for (size_t i = 0; i < count; ++i) {
         const unsigned char* p = (unsigned char*)&palette_in[i];
-        color_tree_add(&paltree, p[0], p[1], p[2], p[3], i);
+        color_table_add(&paltable, p[0], p[1], p[2], p[3], i);
       }
       ColorTree neighbors;
       color_tree_init(&neighbors);
       for (size_t k = 0; k < h; ++k) {
         for (size_t l = 0; l < w; ++l) {
           const unsigned char* c = (unsigned char*)&image[k * w + l];
-          int index = color_tree_get(&paltree, c[0], c[1], c[2], c[3]);
+          int index = color_table_get(&paltable, c[0], c[1], c[2], c[3]);
           if (k > 0) { // above
             const unsigned char* c2 = (unsigned char*)&image[(k - 1) * w + l];
-            color_tree_inc(&neighbors, index, color_tree_get(&paltree, c2[0], c2[1], c2[2], c2[3]), 0, 0);
+            color_tree_inc(&neighbors, index, color_table_get(&paltable, c2[0], c2[1], c2[2], c2[3]), 0, 0);
           }
           if (k < h - 1) { // below
             const unsigned char* c2 = (unsigned char*)&image[(k + 1) * w + l];
-            color_tree_inc(&neighbors, index, color_tree_get(&paltree, c2[0], c2[1], c2[2], c2[3]), 0, 0);
+            color_tree_inc(&neighbors, index, color_table_get(&paltable, c2[0], c2[1], c2[2], c2[3]), 0, 0);
           }
           if (l > 0) { // left
             const unsigned char* c2 = (unsigned char*)&image[k * w + l - 1];
-            color_tree_inc(&neighbors, index, color_tree_get(&paltree, c2[0], c2[1], c2[2], c2[3]), 0, 0);
+            color_tree_inc(&neighbors, index, color_table_get(&paltable, c2[0], c2[1], c2[2], c2[3]), 0, 0);
           }
           if (l < w - 1) { // right
             const unsigned char* c2 = (unsigned char*)&image[k * w + l + 1];
-            color_tree_inc(&neighbors, index, color_tree_get(&paltree, c2[0], c2[1], c2[2], c2[3]), 0, 0);
+            color_tree_inc(&neighbors, index, color_table_get(&paltable, c2[0], c2[1], c2[2], c2[3]), 0, 0);
           }
         }
       }
@@ -2169,8 +2189,8 @@ static void optimize_palette(LodePNGColorMode* mode_out, const uint32_t* image,
             const int a2 = c2[3];
             dist += (a - a2) * (a - a2);
           }
-          dist /= (color_tree_get(&neighbors, color_tree_get(&paltree, c[0], c[1], c[2], c[3]),
-                                  color_tree_get(&paltree, c2[0], c2[1], c2[2], c2[3]), 0, 0) + 1);
+          dist /= (color_tree_get(&neighbors, color_table_get(&paltable, c[0], c[1], c[2], c[3]),
+                                  color_table_get(&paltable, c2[0], c2[1], c2[2], c2[3]), 0, 0) + 1);
           if (dist != 0 && dist < bestdist) {
             bestdist = dist;
             best = j;
@@ -2178,7 +2198,6 @@ static void optimize_palette(LodePNGColorMode* mode_out, const uint32_t* image,
         }
       }
       sortfield[count - 1] |= uint64_t(count - 1) << 40;
-      color_tree_cleanup(&paltree);
       color_tree_cleanup(&neighbors);
     }
       break;
@@ -2191,7 +2210,6 @@ static void optimize_palette(LodePNGColorMode* mode_out, const uint32_t* image,
   std::copy(palette_out, palette_out + mode_out->palettesize, palette_in);
   free(palette_out);
   free(sortfield);
-  color_tree_cleanup(&tree);
 }
 
 /*Automatically chooses color type that gives smallest amount of bits in the
@@ -2273,6 +2291,34 @@ static unsigned char paethPredictor(short a, short b, short c)
   return (unsigned char)a;
 }
 
+#ifdef LODEPNG_X86_SIMD
+/*per lane b where mask is set, else a*/
+static inline __m128i selectSSE2(__m128i mask, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_andnot_si128(mask, a), _mm_and_si128(mask, b));
+}
+
+/*paethPredictor on 8 lanes of bytes widened to 16 bits, with the same tie breaking*/
+static inline __m128i paethSSE2(__m128i a, __m128i b, __m128i c)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i pa = _mm_sub_epi16(b, c);
+  __m128i pb = _mm_sub_epi16(a, c);
+  __m128i pc = _mm_add_epi16(pa, pb);
+  pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+  pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+  pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+  __m128i usec = _mm_and_si128(_mm_cmplt_epi16(pc, pa), _mm_cmplt_epi16(pc, pb));
+  return selectSSE2(usec, selectSSE2(_mm_cmplt_epi16(pb, pa), a, b), c);
+}
+
+/*(a + b) / 2 per byte, avg_epu8 rounds up so take off the carried bit*/
+static inline __m128i averageSSE2(__m128i a, __m128i b)
+{
+  return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+#endif /*LODEPNG_X86_SIMD*/
+
 /*shared values used by multiple Adam7 related functions*/
 
 static const unsigned ADAM7_IX[7] = { 0, 4, 0, 2, 0, 1, 0 }; /*x start values*/
@@ -2393,8 +2439,76 @@ unsigned lodepng_inspect(unsigned* w, unsigned* h, LodePNGState* state,
   return state->error;
 }
 
-static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
-                                 size_t bytewidth, unsigned char filterType, size_t length)
+#ifdef LODEPNG_X86_SIMD
+template<size_t BW> static inline __m128i loadPixel(const unsigned char* p)
+{
+  unsigned long long v = 0;
+  memcpy(&v, p, BW);
+  return _mm_loadl_epi64((const __m128i*)&v);
+}
+
+template<size_t BW> static inline void storePixel(unsigned char* p, __m128i x)
+{
+  unsigned long long v;
+  _mm_storel_epi64((__m128i*)&v, x);
+  memcpy(p, &v, BW);
+}
+
+/*
+Sub, Average and Paeth depend on the previous pixel, so these go one whole pixel at a time.
+Only faster than the scalar loop for 4 and 8 byte pixels, length must be a multiple of BW.
+*/
+template<size_t BW>
+static void unfilterScanlineSSE2(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 unsigned char filterType, size_t length)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero; /*left pixel, 0 for the first one*/
+  size_t i;
+  if(filterType == 3 && precon)
+  {
+    for(i = 0; i != length; i += BW)
+    {
+      a = _mm_add_epi8(loadPixel<BW>(&scanline[i]), averageSSE2(a, loadPixel<BW>(&precon[i])));
+      storePixel<BW>(&recon[i], a);
+    }
+  }
+  else if(filterType == 3)
+  {
+    __m128i low7 = _mm_set1_epi8(127);
+    for(i = 0; i != length; i += BW)
+    {
+      a = _mm_add_epi8(loadPixel<BW>(&scanline[i]), _mm_and_si128(_mm_srli_epi16(a, 1), low7));
+      storePixel<BW>(&recon[i], a);
+    }
+  }
+  else if(filterType == 4 && precon)
+  {
+    __m128i c = zero; /*upper left pixel, widened to 16 bits like a*/
+    for(i = 0; i != length; i += BW)
+    {
+      __m128i b = _mm_unpacklo_epi8(loadPixel<BW>(&precon[i]), zero);
+      __m128i pred = paethSSE2(a, b, c);
+      __m128i x = _mm_add_epi8(loadPixel<BW>(&scanline[i]), _mm_packus_epi16(pred, pred));
+      storePixel<BW>(&recon[i], x);
+      a = _mm_unpacklo_epi8(x, zero);
+      c = b;
+    }
+  }
+  else /*Sub, and Paeth without previous line which is the same*/
+  {
+    for(i = 0; i != length; i += BW)
+    {
+      a = _mm_add_epi8(loadPixel<BW>(&scanline[i]), a);
+      storePixel<BW>(&recon[i], a);
+    }
+  }
+}
+#endif /*LODEPNG_X86_SIMD*/
+
+static unsigned unfilterScanlineScalar(unsigned char* recon, const unsigned char* scanline,
+                                       const unsigned char* precon, size_t bytewidth,
+                                       unsigned char filterType, size_t length)
 {
   /*
   For PNG filter method 0
@@ -2467,6 +2581,23 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   return 0;
 }
 
+static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                 size_t bytewidth, unsigned char filterType, size_t length)
+{
+#ifdef LODEPNG_X86_SIMD
+  /*Up needs no help, the compiler vectorizes it*/
+  if((filterType == 1 || filterType == 3 || filterType == 4) && length % bytewidth == 0)
+  {
+    switch(bytewidth)
+    {
+      case 4: unfilterScanlineSSE2<4>(recon, scanline, precon, filterType, length); return 0;
+      case 8: unfilterScanlineSSE2<8>(recon, scanline, precon, filterType, length); return 0;
+    }
+  }
+#endif /*LODEPNG_X86_SIMD*/
+  return unfilterScanlineScalar(recon, scanline, precon, bytewidth, filterType, length);
+}
+
 static unsigned unfilter(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp)
 {
   /*
@@ -2586,6 +2717,100 @@ static void removePaddingBits(unsigned char* out, const unsigned char* in,
   }
 }
 
+/*Decompresses the zlib data of a non-interlaced image without padding bits and unfilters it a batch of scanlines
+at a time straight into out, instead of first inflating all of the scanlines. If mode_out isn't null, each batch
+is also converted to it, so that the image is never in memory in both color modes. Returns the same errors as
+lodepng_zlib_decompress followed by a size check.*/
+static unsigned inflateScanlines(unsigned char* out, const unsigned char* in, size_t insize, unsigned w, unsigned h,
+                                 const LodePNGColorMode* mode_in, LodePNGColorMode* mode_out)
+{
+  unsigned bpp = lodepng_get_bpp(mode_in);
+  size_t bytewidth = (bpp + 7) / 8;
+  size_t linebytes = ((size_t)w * bpp + 7) / 8;
+  size_t outlinebytes = mode_out ? (size_t)w * lodepng_get_bpp(mode_out) / 8 : linebytes;
+  /*scanlines are inflated about 1 MB at a time*/
+  size_t rows = (1 << 20) / (linebytes + 1) + 1;
+  if(rows > h) rows = h;
+  unsigned char* scanlines;
+  /*unfiltered batch before conversion, after the last scanline of the previous batch*/
+  unsigned char* lines = 0;
+  const unsigned char* prevline = 0;
+  unsigned adler = 1;
+  unsigned error = 0;
+  unsigned y;
+  z_stream inf;
+
+  if(insize < 2) return 53; /*error, size of zlib data too small*/
+  /*see lodepng_zlib_decompress*/
+  if((in[0] * 256 + in[1]) % 31 != 0) return 24;
+  if((in[0] & 15) != 8 || ((in[0] >> 4) & 15) > 7) return 25;
+  if((in[1] >> 5) & 1) return 26;
+
+  scanlines = (unsigned char*)lodepng_malloc(rows * (linebytes + 1));
+  if(mode_out) lines = (unsigned char*)lodepng_malloc((rows + 1) * linebytes);
+  if(!scanlines || (mode_out && !lines))
+  {
+    free(scanlines);
+    free(lines);
+    return 83; /*alloc fail*/
+  }
+  inf.zalloc = 0;
+  inf.zfree = 0;
+  inf.opaque = 0;
+  inf.next_in = (z_const Byte *)&in[2];
+  inf.avail_in = (uInt)(insize - 2);
+  if(inflateInit2(&inf, -15) != Z_OK)
+  {
+    free(scanlines);
+    free(lines);
+    return 83;
+  }
+
+  int err = Z_OK;
+  for(y = 0; y < h && !error; y += rows)
+  {
+    size_t n = h - y < rows ? h - y : rows;
+    inf.next_out = scanlines;
+    inf.avail_out = (uInt)(n * (linebytes + 1));
+    while(inf.avail_out && err == Z_OK) err = inflate(&inf, Z_SYNC_FLUSH);
+    if(inf.avail_out)
+    {
+      /*the stream ended before the last scanline*/
+      error = err == Z_STREAM_END ? 91 : err == Z_MEM_ERROR ? 83 : 95;
+      break;
+    }
+    adler = adler32(adler, scanlines, (unsigned)(n * (linebytes + 1)));
+    for(size_t i = 0; i != n && !error; ++i)
+    {
+      unsigned char* line = lines ? &lines[(i + 1) * linebytes] : &out[(y + i) * outlinebytes];
+      const unsigned char* scanline = &scanlines[i * (linebytes + 1)];
+      error = unfilterScanline(line, &scanline[1], prevline, bytewidth, scanline[0], linebytes);
+      prevline = line;
+    }
+    if(lines && !error)
+    {
+      error = lodepng_convert(&out[y * outlinebytes], &lines[linebytes], mode_out, mode_in, w, (unsigned)n);
+      memcpy(lines, &lines[n * linebytes], linebytes);
+      prevline = lines;
+    }
+  }
+  if(!error && err != Z_STREAM_END)
+  {
+    /*the stream must end right after the last scanline*/
+    unsigned char extra;
+    inf.next_out = &extra;
+    inf.avail_out = 1;
+    err = inflate(&inf, Z_SYNC_FLUSH);
+    if(inf.avail_out == 0) error = 91; /*decompressed size doesn't match prediction*/
+    else if(err != Z_STREAM_END) error = err == Z_MEM_ERROR ? 83 : 95;
+  }
+  inflateEnd(&inf);
+  free(scanlines);
+  free(lines);
+  if(!error && adler != lodepng_read32bitInt(&in[insize - 4])) error = 58; /*adler checksum not correct*/
+  return error;
+}
+
 /*out must be buffer big enough to contain full image, and in must contain the full decompressed data from
 the IDAT chunks (with filter index bytes and possible padding bits)
 return value is error*/
@@ -2919,7 +3144,7 @@ static unsigned readChunk_iTXt(LodePNGInfo* info, const unsigned char* data, siz
 /*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
 static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
                           LodePNGState* state,
-                          const unsigned char* in, size_t insize)
+                          const unsigned char* in, size_t insize, unsigned* converted)
 {
   unsigned char IEND = 0;
   const unsigned char* chunk;
@@ -3064,6 +3289,26 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   }
 
   ucvector_init(&scanlines);
+  unsigned bpp = lodepng_get_bpp(&state->info_png.color);
+  if(!state->error && state->info_png.interlace_method == 0 && bpp && (size_t)*w * bpp % 8 == 0)
+  {
+    /*convert while decoding if lodepng_decode would convert it afterwards*/
+    LodePNGColorMode* mode_out = &state->info_png.color;
+    if(state->decoder.color_convert && !lodepng_color_mode_equal(&state->info_raw, &state->info_png.color)
+       && (state->info_raw.colortype == LCT_RGB || state->info_raw.colortype == LCT_RGBA
+           || state->info_raw.bitdepth == 8))
+    {
+      mode_out = &state->info_raw;
+      *converted = 1;
+    }
+    size_t outsize = lodepng_get_raw_size(*w, *h, mode_out);
+    *out = (unsigned char*)lodepng_malloc(outsize ? outsize : 1);
+    if(!*out) state->error = 83; /*alloc fail*/
+    else state->error = inflateScanlines(*out, idat.data, idat.size, *w, *h, &state->info_png.color,
+                                         *converted ? mode_out : 0);
+    ucvector_cleanup(&idat);
+    return;
+  }
   /*predict output size, to allocate exact size for output buffer to avoid more dynamic allocation.
   If the decompressed size does not match the prediction, the image must be corrupt.*/
   if(state->info_png.interlace_method == 0)
@@ -3114,9 +3359,11 @@ unsigned lodepng_decode(unsigned char** out, unsigned* w, unsigned* h,
                         LodePNGState* state,
                         const unsigned char* in, size_t insize)
 {
+  unsigned converted = 0;
   *out = 0;
-  decodeGeneric(out, w, h, state, in, insize);
+  decodeGeneric(out, w, h, state, in, insize, &converted);
   if(state->error) return state->error;
+  if(converted) return 0;
   if(!state->decoder.color_convert || lodepng_color_mode_equal(&state->info_raw, &state->info_png.color))
   {
     /*same color type, no copying or converting of data needed*/
@@ -3452,8 +3699,8 @@ static unsigned addChunk_bKGD(ucvector* out, const LodePNGInfo* info)
 
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-static void filterScanline(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
-                           size_t length, size_t bytewidth, unsigned char filterType)
+static void filterScanlineScalar(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                 size_t length, size_t bytewidth, unsigned char filterType)
 {
   size_t i;
   switch(filterType)
@@ -3508,6 +3755,176 @@ static void filterScanline(unsigned char* out, const unsigned char* scanline, co
   }
 }
 
+#ifdef LODEPNG_X86_SIMD
+/*Average or Paeth filters bytes start to length of a scanline, start must be at least bytewidth.
+Used for the ends of the SIMD rows*/
+static void filterScanlineTail(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                               size_t start, size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i;
+  for(i = start; i < length; ++i)
+  {
+    unsigned char a = scanline[i - bytewidth];
+    unsigned char b = prevline ? prevline[i] : 0;
+    unsigned char c = prevline ? prevline[i - bytewidth] : 0;
+    if(filterType == 3) out[i] = scanline[i] - ((a + b) / 2);
+    else out[i] = scanline[i] - paethPredictor(a, b, c);
+  }
+}
+
+/*
+Only Average and Paeth have kernels, the compiler already vectorizes the None, Sub and Up loops
+and Paeth without previous line is Sub.
+*/
+static void filterScanlineSSE2(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                               size_t length, size_t bytewidth, unsigned char filterType)
+{
+  size_t i;
+  if(filterType < 3 || filterType > 4 || (filterType == 4 && !prevline) || length < bytewidth + 16)
+  {
+    filterScanlineScalar(out, scanline, prevline, length, bytewidth, filterType);
+    return;
+  }
+  /*the first pixel has no left neighbour*/
+  filterScanlineScalar(out, scanline, prevline, bytewidth, bytewidth, filterType);
+  __m128i zero = _mm_setzero_si128();
+  __m128i low7 = _mm_set1_epi8(127);
+  for(i = bytewidth; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i a = _mm_loadu_si128((const __m128i*)&scanline[i - bytewidth]);
+    __m128i pred;
+    if(!prevline) pred = _mm_and_si128(_mm_srli_epi16(a, 1), low7);
+    else if(filterType == 3) pred = averageSSE2(a, _mm_loadu_si128((const __m128i*)&prevline[i]));
+    else
+    {
+      __m128i b = _mm_loadu_si128((const __m128i*)&prevline[i]);
+      __m128i c = _mm_loadu_si128((const __m128i*)&prevline[i - bytewidth]);
+      pred = _mm_packus_epi16(
+          paethSSE2(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+          paethSSE2(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+    }
+    _mm_storeu_si128((__m128i*)&out[i], _mm_sub_epi8(x, pred));
+  }
+  filterScanlineTail(out, scanline, prevline, i, length, bytewidth, filterType);
+}
+
+#define LODEPNG_AVX2 __attribute__((target("avx2")))
+
+static inline LODEPNG_AVX2 __m256i selectAVX2(__m256i mask, __m256i a, __m256i b)
+{
+  return _mm256_or_si256(_mm256_andnot_si256(mask, a), _mm256_and_si256(mask, b));
+}
+
+static inline LODEPNG_AVX2 __m256i paethAVX2(__m256i a, __m256i b, __m256i c)
+{
+  __m256i pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+  __m256i pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+  __m256i pc = _mm256_abs_epi16(_mm256_add_epi16(_mm256_sub_epi16(b, c), _mm256_sub_epi16(a, c)));
+  __m256i usec = _mm256_and_si256(_mm256_cmpgt_epi16(pa, pc), _mm256_cmpgt_epi16(pb, pc));
+  return selectAVX2(usec, selectAVX2(_mm256_cmpgt_epi16(pa, pb), a, b), c);
+}
+
+/*same as filterScanlineSSE2 on 32 bytes. unpack and pack work per 128 bit lane, so the Paeth byte order is kept*/
+static LODEPNG_AVX2 void filterScanlineAVX2(unsigned char* out, const unsigned char* scanline,
+                                            const unsigned char* prevline, size_t length, size_t bytewidth,
+                                            unsigned char filterType)
+{
+  size_t i;
+  if(filterType < 3 || filterType > 4 || (filterType == 4 && !prevline) || length < bytewidth + 32)
+  {
+    filterScanlineSSE2(out, scanline, prevline, length, bytewidth, filterType);
+    return;
+  }
+  filterScanlineScalar(out, scanline, prevline, bytewidth, bytewidth, filterType);
+  __m256i zero = _mm256_setzero_si256();
+  __m256i low7 = _mm256_set1_epi8(127);
+  __m256i one = _mm256_set1_epi8(1);
+  for(i = bytewidth; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+    __m256i a = _mm256_loadu_si256((const __m256i*)&scanline[i - bytewidth]);
+    __m256i pred;
+    if(!prevline) pred = _mm256_and_si256(_mm256_srli_epi16(a, 1), low7);
+    else if(filterType == 3)
+    {
+      __m256i b = _mm256_loadu_si256((const __m256i*)&prevline[i]);
+      pred = _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), one));
+    }
+    else
+    {
+      __m256i b = _mm256_loadu_si256((const __m256i*)&prevline[i]);
+      __m256i c = _mm256_loadu_si256((const __m256i*)&prevline[i - bytewidth]);
+      pred = _mm256_packus_epi16(
+          paethAVX2(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(c, zero)),
+          paethAVX2(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(c, zero)));
+    }
+    _mm256_storeu_si256((__m256i*)&out[i], _mm256_sub_epi8(x, pred));
+  }
+  filterScanlineTail(out, scanline, prevline, i, length, bytewidth, filterType);
+}
+#endif /*LODEPNG_X86_SIMD*/
+
+typedef void (*FilterScanlineFunc)(unsigned char* out, const unsigned char* scanline, const unsigned char* prevline,
+                                   size_t length, size_t bytewidth, unsigned char filterType);
+
+static FilterScanlineFunc chooseFilterScanline()
+{
+#ifdef LODEPNG_X86_SIMD
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) return filterScanlineAVX2;
+  return filterScanlineSSE2;
+#else
+  return filterScanlineScalar;
+#endif
+}
+
+/*picked once at startup, all variants give the same output*/
+static const FilterScanlineFunc filterScanline = chooseFilterScanline();
+
+/*LFS_MINSUM score of a filtered row: filter type 0 sums the bytes, the others sum them as signed magnitudes*/
+static size_t minsumScore(const unsigned char* data, size_t length, unsigned char filterType)
+{
+  size_t sum = 0, x = 0;
+#ifdef LODEPNG_X86_SIMD
+  __m128i zero = _mm_setzero_si128();
+  __m128i ones = _mm_set1_epi8(-1);
+  __m128i acc = zero;
+  for(; x + 16 <= length; x += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)&data[x]);
+    /*min(s, 255 - s) is s < 128 ? s : 255 - s*/
+    if(filterType) v = _mm_min_epu8(v, _mm_xor_si128(v, ones));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+  }
+  unsigned long long halves[2];
+  _mm_storeu_si128((__m128i*)halves, acc);
+  sum = (size_t)(halves[0] + halves[1]);
+#endif
+  for(; x != length; ++x)
+  {
+    unsigned char s = data[x];
+    sum += filterType == 0 || s < 128 ? s : (255U - s);
+  }
+  return sum;
+}
+
+/*byte histogram of a row, spread over 4 tables so runs of the same byte don't wait on one counter*/
+static void byteHistogram(const unsigned char* data, size_t length, unsigned count[256])
+{
+  unsigned part[4][256] = {{0}};
+  size_t x = 0;
+  for(; x + 4 <= length; x += 4)
+  {
+    ++part[0][data[x]];
+    ++part[1][data[x + 1]];
+    ++part[2][data[x + 2]];
+    ++part[3][data[x + 3]];
+  }
+  for(; x != length; ++x) ++part[0][data[x]];
+  for(x = 0; x != 256; ++x) count[x] = part[0][x] + part[1][x] + part[2][x] + part[3][x];
+}
+
 static void filterScanline2(unsigned char* scanline, const unsigned char* prevline,
                            size_t length, unsigned char filterType, unsigned char forReal)
 {
@@ -3632,7 +4049,7 @@ static double randomDecimal(uint64_t* s) {
 }
 
 #include <signal.h>
-static int signaled = 0;
+static volatile sig_atomic_t signaled = 0;
 static void sig_handler(int signo)
 {
   if (signo == SIGINT){
@@ -3641,6 +4058,158 @@ static void sig_handler(int signo)
   }
 }
 
+/*A stream for LFS_INCREMENTAL. Scanlines are tested on it directly and rolled back
+with the checkpoint, teststream is only used when a test could slide the window.*/
+struct IncrementalStream
+{
+  z_stream stream;
+  z_stream teststream;
+  deflate_checkpoint* checkpoint;
+};
+
+/*Returns the size the stream would have if it ended with the given data.*/
+static size_t incrementalSize(IncrementalStream* s, const unsigned char* data, size_t len)
+{
+  z_stream* test = &s->stream;
+  if(deflateCheckpoint(&s->stream, s->checkpoint, len) != Z_OK)
+  {
+    deflateCopy(&s->teststream, &s->stream, 0);
+    test = &s->teststream;
+  }
+  test->next_in = (z_const unsigned char *)data;
+  test->avail_in = len;
+  test->avail_out = UINT_MAX;
+  test->next_out = (unsigned char*)1; //Not used, but must not be NULL
+  deflate_nooutput(test, Z_FINISH);
+  size_t size = test->total_out;
+  if(test == &s->stream)
+  {
+    deflateRollback(&s->stream, s->checkpoint);
+  }
+  return size;
+}
+
+#ifndef NOMULTI
+/*Threads of the filter strategy, at most max*/
+static unsigned filterThreads(const LodePNGEncoderSettings* settings, unsigned max)
+{
+  unsigned threads = settings->threads ? settings->threads : std::thread::hardware_concurrency();
+  return std::min(std::max(threads, 1u), max);
+}
+
+/*Threads that run a job together with the calling thread, job(0) runs on the caller.*/
+class WorkerGroup
+{
+public:
+  explicit WorkerGroup(unsigned count) : generation(0), pending(0), stop(false)
+  {
+    unsigned long long file = ECT_StatsCurrentFile();
+    for(unsigned i = 1; i < count; ++i)
+    {
+      threads.push_back(std::thread([this, i, file]
+      {
+        ECT_StatsInheritFile(file);
+        unsigned seen = 0;
+        while(true)
+        {
+          {
+            std::unique_lock<std::mutex> lock(mutex);
+            start.wait(lock, [&]{return stop || generation != seen;});
+            if(stop) return;
+            seen = generation;
+          }
+          job(i);
+          std::lock_guard<std::mutex> lock(mutex);
+          if(--pending == 0) done.notify_one();
+        }
+      }));
+    }
+  }
+  ~WorkerGroup()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    start.notify_all();
+    for(size_t i = 0; i < threads.size(); ++i) threads[i].join();
+  }
+  void run(const std::function<void(unsigned)>& f)
+  {
+    if(threads.empty())
+    {
+      f(0);
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = f;
+      pending = threads.size();
+      ++generation;
+    }
+    start.notify_all();
+    f(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]{return pending == 0;});
+  }
+
+private:
+  std::vector<std::thread> threads;
+  std::function<void(unsigned)> job;
+  std::mutex mutex;
+  std::condition_variable start, done;
+  unsigned generation;
+  size_t pending;
+  bool stop;
+};
+#endif
+
+static unsigned genetic_generations = 0;
+static unsigned genetic_seconds = 0;
+
+void lodepng_set_genetic_limits(unsigned generations, unsigned seconds)
+{
+  genetic_generations = generations;
+  genetic_seconds = seconds;
+}
+
+/*Filters in with one filter type per row into out and returns the size it deflates to.
+linebuf and prevlinebuf are scratch space for cleaning alpha, only used if clean is set.*/
+static size_t geneticSize(z_stream* stream, unsigned char* out, const unsigned char* in, const unsigned char* types,
+                          unsigned h, size_t linebytes, size_t bytewidth, unsigned clean,
+                          unsigned char* linebuf, unsigned char* prevlinebuf)
+{
+  const unsigned char* prevline = 0;
+  unsigned y;
+  for(y = 0; y < h; ++y)
+  {
+    unsigned char type = types[y];
+    out[y * (linebytes + 1)] = type;
+    if(clean){
+      memcpy(linebuf, &in[y * linebytes], linebytes);
+      filterScanline2(linebuf, prevline, linebytes, type, 0);
+      filterScanline(&out[y * (linebytes + 1) + 1], linebuf, prevline, linebytes, bytewidth, type);
+      memcpy(prevlinebuf, linebuf, linebytes);
+      prevline = prevlinebuf;
+    }
+    else{
+      filterScanline(&out[y * (linebytes + 1) + 1], &in[y * linebytes], prevline, linebytes, bytewidth, type);
+      prevline = &in[y * linebytes];
+    }
+  }
+  deflateTune(stream, 16, 258, 258, 200);
+  stream->next_in = (z_const unsigned char *)out;
+  stream->avail_in = h * (linebytes + 1);
+  stream->avail_out = UINT_MAX;
+  stream->next_out = (unsigned char *)1;
+
+  deflate_nooutput(stream, Z_FINISH);
+
+  size_t size = stream->total_out;
+  deflateReset(stream);
+  return size;
+}
+
 static char windowbits(unsigned long len){
   int result = 0;
 #ifdef __GNUC__
@@ -3659,13 +4228,16 @@ static char windowbits(unsigned long len){
   return -result;
 }
 
-static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsigned h,
-                       const LodePNGColorMode* info, LodePNGEncoderSettings* settings)
+static unsigned filterScanlines(unsigned char* out, unsigned char* in, unsigned w, unsigned h,
+                                const LodePNGColorMode* info, LodePNGEncoderSettings* settings,
+                                const unsigned char* prevline, unsigned char* lastline)
 {
   /*
   For PNG filter method 0
   out must be a buffer with as size: h + (w * h * bpp + 7) / 8, because there are
   the scanlines with 1 extra byte per scanline
+  prevline is the scanline above the first one, if any. If lastline isn't null, the last scanline is
+  stored in it as the decoder will see it, so the next scanlines can be filtered with it as prevline.
   */
 
   unsigned bpp = lodepng_get_bpp(info);
@@ -3673,7 +4245,6 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
   size_t linebytes = (w * bpp + 7) / 8;
   /*bytewidth is used for filtering, is 1 when bpp < 8, number of bytes per pixel otherwise*/
   size_t bytewidth = (bpp + 7) / 8;
-  const unsigned char* prevline = 0;
   unsigned x, y;
   LodePNGFilterStrategy strategy = settings->filter_strategy;
 
@@ -3689,6 +4260,7 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
       filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, strategy);
       prevline = &in[inindex];
     }
+    if(lastline) memcpy(lastline, prevline, linebytes);
   }
   else if(strategy == LFS_PREDEFINED)
   {
@@ -3701,6 +4273,7 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
       filterScanline(&out[outindex + 1], &in[inindex], prevline, linebytes, bytewidth, type);
       prevline = &in[inindex];
     }
+    if(lastline) memcpy(lastline, prevline, linebytes);
   }
   else
   {
@@ -3710,7 +4283,7 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
     if(clean){
       in2 = (unsigned char*)malloc(linebytes * h);
       if (!in2){
-        exit(1);
+        return 83; /*alloc fail*/
       }
       memcpy(in2, in, linebytes * h);
       rem = (unsigned char*)malloc(linebytes);
@@ -3730,7 +4303,7 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
     stream.opaque = 0;
 
     int err = deflateInit2(&stream, 3, Z_DEFLATED, windowbits(linebytes), 3, Z_FILTERED);
-    if (err != Z_OK) exit(1);
+    if (err != Z_OK) {free(in2); free(rem); return 83;}
 
     for(type = 0; type != 5; ++type)
     {
@@ -3799,71 +4372,110 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
      Now implemented with streaming, which reduces complexity to O(n)
      This is slow.*/
     size_t size[5];
-    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type*/
+    unsigned char* attempt[5]; /*five filtering attempts, one for each filter type, starting with the type byte*/
+    unsigned char* linebuf[5] = {0, 0, 0, 0, 0};
     size_t smallest;
     unsigned type, bestType = 0;
 
-    z_stream dstream;
-    z_stream teststream;
-
-    dstream.zalloc = 0;
-    dstream.zfree = 0;
-    dstream.opaque = 0;
-
     size_t testsize = linebytes + 1;
-    int err = deflateInit2(&dstream, strategy == LFS_INCREMENTAL3 ? 1 : 2, Z_DEFLATED, windowbits(testsize * h), 8, Z_FILTERED);
-    if (err != Z_OK) exit(1);
-    if(strategy == LFS_INCREMENTAL){
-      deflateTune(&dstream, 16, 258, 258, 200);
+    /*Wide scanlines are tested on several threads, each keeping its own copy of the stream*/
+    unsigned replicas = 1;
+#ifndef NOMULTI
+    if(linebytes >= 4096)
+    {
+      replicas = filterThreads(settings, 5);
     }
-    else if (strategy == LFS_INCREMENTAL2){
-      deflateTune(&dstream, 50, 258, 258, 1100);
+#endif
+    IncrementalStream streams[5];
+    for(unsigned k = 0; k < replicas; ++k)
+    {
+      if(k == 0)
+      {
+        streams[0].stream.zalloc = 0;
+        streams[0].stream.zfree = 0;
+        streams[0].stream.opaque = 0;
+        int err = deflateInit2(&streams[0].stream, strategy == LFS_INCREMENTAL3 ? 1 : 2, Z_DEFLATED, windowbits(testsize * h), 8, Z_FILTERED);
+        if (err != Z_OK) {free(in2); free(rem); return 83;}
+        if(strategy == LFS_INCREMENTAL){
+          deflateTune(&streams[0].stream, 16, 258, 258, 200);
+        }
+        else if (strategy == LFS_INCREMENTAL2){
+          deflateTune(&streams[0].stream, 50, 258, 258, 1100);
+        }
+      }
+      else if(deflateCopy(&streams[k].stream, &streams[0].stream, 1) != Z_OK)
+      {
+        replicas = k;
+        break;
+      }
+      if(deflateCopy(&streams[k].teststream, &streams[0].stream, 1) != Z_OK
+         || !(streams[k].checkpoint = deflateCheckpointAlloc(&streams[k].stream, testsize)))
+      {
+        if(k == 0) {free(in2); free(rem); return 83;}
+        deflateEnd(&streams[k].stream);
+        replicas = k;
+        break;
+      }
     }
-    deflateCopy(&teststream, &dstream, 1);
-
-    unsigned char* dummy = (unsigned char*)1; //Not used, but must not be NULL
 
     unsigned char* prevline2 = 0;
     unsigned char* prevlinebuf = 0;
-    unsigned char* linebuf;
     if(clean){
       prevlinebuf = (unsigned char*)malloc(linebytes);
-      linebuf = (unsigned char*)malloc(linebytes);
+      if(!prevlinebuf) return 83; /*alloc fail*/
     }
 
     for(type = 0; type != 5; ++type)
     {
-      attempt[type] = (unsigned char*)lodepng_malloc(linebytes);
+      attempt[type] = (unsigned char*)lodepng_malloc(testsize);
       if(!attempt[type]) return 83; /*alloc fail*/
+      attempt[type][0] = type;
+      if(clean){
+        linebuf[type] = (unsigned char*)malloc(linebytes);
+        if(!linebuf[type]) return 83; /*alloc fail*/
+      }
     }
 
-    for(y = 0; y != h; ++y) /*try the 5 filter types*/
+    /*stream k tests the filter types t with t % replicas == k*/
+    auto test = [&](unsigned k)
     {
-      smallest = SIZE_MAX;
-      for(type = 4; type + 1 != 0; --type) /*type 0 is most likely, so end with that to reduce copying*/
+      for(unsigned t = k; t < 5; t += replicas)
       {
         if(clean){
-          memcpy(linebuf, &in[y * linebytes], linebytes);
-          filterScanline2(linebuf, prevline2, linebytes, type, 0);
-          filterScanline(attempt[type], linebuf, prevline2, linebytes, bytewidth, type);
+          memcpy(linebuf[t], &in[y * linebytes], linebytes);
+          filterScanline2(linebuf[t], prevline2, linebytes, t, 0);
+          filterScanline(attempt[t] + 1, linebuf[t], prevline2, linebytes, bytewidth, t);
         }
         else{
-          filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
+          filterScanline(attempt[t] + 1, &in[y * linebytes], prevline, linebytes, bytewidth, t);
         }
-        /*copy result to output buffer temporarily to include compression test*/
-        out[y * (linebytes + 1)] = type; /*the first byte of a scanline will be the filter type*/
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[type][x];
-        size[type] = 0;
-
-        deflateCopy(&teststream, &dstream, 0);
-        teststream.next_in = (z_const unsigned char *)(out + y * testsize);
-        teststream.avail_in = testsize;
-        teststream.avail_out = UINT_MAX;
-        teststream.next_out = dummy;
-        deflate_nooutput(&teststream, Z_FINISH);
-
-        size[type] = teststream.total_out;
+        size[t] = incrementalSize(&streams[k], attempt[t], testsize);
+      }
+    };
+    /*every stream compresses the chosen scanline*/
+    auto advance = [&](unsigned k)
+    {
+      z_stream* stream = &streams[k].stream;
+      stream->next_in = (z_const unsigned char *)attempt[bestType];
+      stream->avail_in = testsize;
+      stream->avail_out = UINT_MAX;
+      stream->next_out = (unsigned char*)1; //Not used, but must not be NULL
+      deflate_nooutput(stream, Z_NO_FLUSH);
+    };
+#ifndef NOMULTI
+    WorkerGroup workers(replicas);
+#endif
 
+    for(y = 0; y != h; ++y) /*try the 5 filter types*/
+    {
+#ifndef NOMULTI
+      workers.run(test);
+#else
+      test(0);
+#endif
+      smallest = SIZE_MAX;
+      for(type = 4; type + 1 != 0; --type) /*on ties, prefer the higher type as before*/
+      {
         /*check if this is smallest size (or if type == 4 it's the first case so always store the values)*/
         if(size[type] < smallest)
         {
@@ -3871,45 +4483,33 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
           smallest = size[type];
         }
       }
+#ifndef NOMULTI
+      workers.run(advance);
+#else
+      advance(0);
+#endif
 
-      if(clean){
-        memcpy(linebuf, &in[y * linebytes], linebytes);
-        filterScanline2(linebuf, prevline2, linebytes, bestType, 0);
-        filterScanline(attempt[bestType], linebuf, prevline2, linebytes, bytewidth, bestType);
-      }
-      else{
-        filterScanline(attempt[bestType], &in[y * linebytes], prevline, linebytes, bytewidth, bestType);
-      }
-      /*copy result to output buffer temporarily to include compression test*/
-      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
-
-      dstream.next_in = (z_const unsigned char *)(out + y * testsize);
-      dstream.avail_in = testsize;
-      dstream.avail_out = UINT_MAX;
-      dstream.next_out = dummy;
-      deflate_nooutput(&dstream, Z_NO_FLUSH);
-
+      memcpy(&out[y * testsize], attempt[bestType], testsize);
       prevline = &in[y * linebytes];
       if(clean){
-        memcpy(linebuf, &in[y * linebytes], linebytes);
-        filterScanline2(linebuf, prevline2, linebytes, bestType, 0);
-        memcpy(prevlinebuf, linebuf, linebytes);
+        memcpy(prevlinebuf, linebuf[bestType], linebytes);
         prevline2 = prevlinebuf;
       }
-      out[y * (linebytes + 1)] = bestType; /*the first byte of a scanline will be the filter type*/
-      if (type) /*last attempt is type 0, so no copying necessary*/
-      {
-        for(x = 0; x != linebytes; ++x) out[y * (linebytes + 1) + 1 + x] = attempt[bestType][x];
-      }
     }
     if(clean){
       free(prevlinebuf);
-      free(linebuf);
     }
-    deflateEnd(&dstream);
-    deflateEnd(&teststream);
-    for(type = 0; type != 5; ++type) free(attempt[type]);
+    for(unsigned k = 0; k < replicas; ++k)
+    {
+      deflateEnd(&streams[k].stream);
+      deflateEnd(&streams[k].teststream);
+      deflateCheckpointFree(streams[k].checkpoint);
+    }
+    for(type = 0; type != 5; ++type)
+    {
+      free(attempt[type]);
+      free(linebuf[type]);
+    }
   }
   else if(strategy == LFS_MINSUM)
   {
@@ -3938,23 +4538,11 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
           filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
         }
 
-        /*calculate the sum of the result*/
-        sum[type] = 0;
-        if(type == 0)
-        {
-          for(x = 0; x != linebytes; ++x) sum[type] += (unsigned char)(attempt[type][x]);
-        }
-        else
-        {
-          for(x = 0; x != linebytes; ++x)
-          {
-            /*For differences, each byte should be treated as signed, values above 127 are negative
-             (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
-             This means filtertype 0 is almost never chosen, but that is justified.*/
-            unsigned char s = attempt[type][x];
-            sum[type] += s < 128 ? s : (255U - s);
-          }
-        }
+        /*calculate the sum of the result.
+        For differences, each byte should be treated as signed, values above 127 are negative
+        (converted to signed char). Filtertype 0 isn't a difference though, so use unsigned there.
+        This means filtertype 0 is almost never chosen, but that is justified.*/
+        sum[type] = minsumScore(attempt[type], linebytes, type);
 
         /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
         if(type == 0 || sum[type] < smallest)
@@ -4049,6 +4637,9 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
     size_t smallest;
     unsigned type, bestType = 0;
     unsigned char count[65536];
+    /*only the entries set for a scanline are cleared again, clearing the whole table took most of the
+    time on small images*/
+    memset(count, 0, 65536);
 
     for(type = 0; type != 5; ++type)
     {
@@ -4070,14 +4661,16 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
         else{
           filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
         }
-        memset(count, 0, 65536);
-        for(x = 1; x != linebytes; ++x) count[(attempt[type][x - 1] << 8) + attempt[type][x]] = 1;
-        count[type] = 1; /*the filter type itself is part of the scanline*/
         sum[type] = 0;
-        for(x = 0; x != 65536; ++x)
+        for(x = 1; x != linebytes; ++x)
         {
-          if(count[x] != 0) ++sum[type];
+          unsigned char* c = &count[(attempt[type][x - 1] << 8) + attempt[type][x]];
+          sum[type] += !*c;
+          *c = 1;
         }
+        sum[type] += !count[type]; /*the filter type itself is part of the scanline*/
+        for(x = 1; x != linebytes; ++x) count[(attempt[type][x - 1] << 8) + attempt[type][x]] = 0;
+        count[type] = 0;
         /*check if this is smallest sum (or if type == 0 it's the first case so always store the values)*/
         if(sum[type] < smallest)
         {
@@ -4130,8 +4723,7 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
         else{
           filterScanline(attempt[type], &in[y * linebytes], prevline, linebytes, bytewidth, type);
         }
-        for(x = 0; x != 256; ++x) count[x] = 0;
-        for(x = 0; x != linebytes; ++x) ++count[attempt[type][x]];
+        byteHistogram(attempt[type], linebytes, count);
         ++count[type]; /*the filter type itself is part of the scanline*/
         sum[type] = 0;
         for(x = 0; x != 256; ++x)
@@ -4166,16 +4758,16 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
   }
   else if(strategy == LFS_GENETIC || strategy == LFS_ALL_CHEAP)
   {
-    if (strategy == LFS_GENETIC){
+    if (strategy == LFS_GENETIC && settings->verbose){
       printf("warning: You have decided to enable genetic filtering, which may take a very long time.\n"
              "the current generation and number of bytes is displayed.\n"
              "you can stop the genetic filtering anytime by pressing ctrl-c\n"
              "it will automatically stop after 500 generations without progress\n");
-      signaled = 0;
     }
+    signaled = 0;
 
     unsigned char* prevlinebuf = 0;
-    unsigned char* linebuf;
+    unsigned char* linebuf = 0;
     if(clean){
       prevlinebuf = (unsigned char*)malloc(linebytes);
       linebuf = (unsigned char*)malloc(linebytes);
@@ -4200,54 +4792,30 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
     stream.zalloc = 0;
     stream.zfree = 0;
     stream.opaque = 0;
-#define TUNE deflateTune(&stream, 16, 258, 258, 200);
     int err = deflateInit2(&stream, 3, Z_DEFLATED, windowbits(h * (linebytes + 1)), 8, Z_FILTERED);
-    if (err != Z_OK) exit(1);
-    unsigned char* dummy = (unsigned char *)1;
+    if (err != Z_OK) {
+      free(population); free(size); free(ranking);
+      free(in2); free(rem);
+      return 83;
+    }
     size_t popcnt;
     uint64_t r2[2];
     initRandomUInt64(r2);
-    signal(SIGINT, sig_handler);
+    if (settings->verbose) signal(SIGINT, sig_handler);
     for(popcnt = 0; popcnt < h * (population_size - Strategies); ++popcnt) population[popcnt] = randomUInt64(r2) % 5;
 
     for(g = 0; g <= last; ++g)
     {
       if (strategy == LFS_ALL_CHEAP){
         settings->filter_strategy = (LodePNGFilterStrategy)(g + 11);
-        filter(out, in, w, h, info, settings);
+        filterScanlines(out, in, w, h, info, settings, 0, 0);
         settings->filter_strategy = LFS_ALL_CHEAP;
         for(size_t k = 0; k < h * (linebytes + 1); k += (linebytes + 1))
         {
           population[popcnt++] = out[k];
         }
       }
-      prevline = 0;
-      for(y = 0; y < h; ++y)
-      {
-        type = population[g * h + y];
-        out[y * (linebytes + 1)] = type;
-        if(clean){
-          memcpy(linebuf, &in[y * linebytes], linebytes);
-          filterScanline2(linebuf, prevline, linebytes, type, 0);
-          filterScanline(&out[y * (linebytes + 1) + 1], linebuf, prevline, linebytes, bytewidth, type);
-          memcpy(prevlinebuf, linebuf, linebytes);
-          prevline = prevlinebuf;
-        }
-        else{
-          filterScanline(&out[y * (linebytes + 1) + 1], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-          prevline = &in[y * linebytes];
-        }
-      }
-      TUNE
-      stream.next_in = (z_const unsigned char *)out;
-      stream.avail_in = h * (linebytes + 1);
-      stream.avail_out = UINT_MAX;
-      stream.next_out = dummy;
-
-      deflate_nooutput(&stream, Z_FINISH);
-
-      size[g] = stream.total_out;
-      deflateReset(&stream);
+      size[g] = geneticSize(&stream, out, in, &population[g * h], h, linebytes, bytewidth, clean, linebuf, prevlinebuf);
       total_size += size[g];
       ranking[g] = g;
     }
@@ -4258,9 +4826,73 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
         best_size = size[i];
       }
     }
+    /*Offspring of a generation are bred from the previous generation only, so they can be evaluated
+    in parallel and the result doesn't depend on the number of threads.*/
+    const unsigned offspring = 3;
+    unsigned char* children = (unsigned char*)lodepng_malloc(h * offspring);
+    if(!children)
+    {
+      deflateEnd(&stream);
+      free(population); free(size); free(ranking);
+      free(linebuf); free(prevlinebuf);
+      free(in2); free(rem);
+      return 83;
+    }
+    size_t child_size[3];
+    unsigned workers = 1;
+#ifndef NOMULTI
+    /*the threads are handed work every generation, not worth it for small images*/
+    if(strategy == LFS_GENETIC && h * (linebytes + 1) >= 65536)
+    {
+      workers = filterThreads(settings, offspring);
+    }
+#endif
+    z_stream extra_stream[3];
+    z_stream* worker_stream[3] = {&stream, &extra_stream[1], &extra_stream[2]};
+    unsigned char* worker_out[3] = {out, 0, 0};
+    unsigned char* worker_linebuf[3] = {linebuf, 0, 0};
+    unsigned char* worker_prevlinebuf[3] = {prevlinebuf, 0, 0};
+    for(t = 1; t < workers; ++t)
+    {
+      worker_stream[t]->zalloc = 0;
+      worker_stream[t]->zfree = 0;
+      worker_stream[t]->opaque = 0;
+      worker_out[t] = (unsigned char*)lodepng_malloc(h * (linebytes + 1));
+      if(clean)
+      {
+        worker_linebuf[t] = (unsigned char*)lodepng_malloc(linebytes);
+        worker_prevlinebuf[t] = (unsigned char*)lodepng_malloc(linebytes);
+      }
+      if(!worker_out[t] || (clean && (!worker_linebuf[t] || !worker_prevlinebuf[t]))
+         || deflateInit2(worker_stream[t], 3, Z_DEFLATED, windowbits(h * (linebytes + 1)), 8, Z_FILTERED) != Z_OK)
+      {
+        free(worker_out[t]); free(worker_linebuf[t]); free(worker_prevlinebuf[t]);
+        break;
+      }
+    }
+    workers = t < workers ? t : workers;
+    /*evaluate new genomes, worker t takes every workers-th child*/
+    auto evaluate = [&](unsigned worker)
+    {
+      for(unsigned k = worker; k < offspring; k += workers)
+      {
+        child_size[k] = geneticSize(worker_stream[worker], worker_out[worker], in, &children[k * h], h, linebytes,
+                                    bytewidth, clean, worker_linebuf[worker], worker_prevlinebuf[worker]);
+      }
+    };
+#ifndef NOMULTI
+    WorkerGroup group(workers);
+#endif
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
     //ctrl-c signals last iteration
     for(e = 0; strategy == LFS_GENETIC && e_since_best < 500 && !signaled; ++e)
     {
+      if((genetic_generations && e >= genetic_generations) || (genetic_seconds
+         && std::chrono::steady_clock::now() - start >= std::chrono::seconds(genetic_seconds)))
+      {
+        break;
+      }
       /*resort rankings*/
       for(i = 1; i < population_size; ++i)
       {
@@ -4272,11 +4904,11 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
       {
         best_size = size[ranking[0]];
         e_since_best = 0;
-        printf("Generation %d: %d bytes\n", e, best_size);
+        if (settings->verbose) printf("Generation %d: %d bytes\n", e, best_size);
       }
       else ++e_since_best;
       /*generate offspring*/
-      for(c = 0; c < 3; ++c)
+      for(c = 0; c < offspring; ++c)
       {
         /*tournament selection*/
         /*parent 1*/
@@ -4292,7 +4924,7 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
         for(j = 0; size_sum <= selection_size; ++j) size_sum += size[ranking[j]];
         unsigned char* parent2 = &population[ranking[j - 1] * h];
         /*two-point crossover*/
-        unsigned char* child = &population[(ranking[last - c]) * h];
+        unsigned char* child = &children[c * h];
         if(randomDecimal(r) < 0.9)
         {
           crossover1 = randomUInt64(r) % h;
@@ -4303,12 +4935,9 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
             crossover2 ^= crossover1;
             crossover1 ^= crossover2;
           }
-          if(child != parent1)
-          {
-            memcpy(child, parent1, crossover1);
-            memcpy(&child[crossover2], &parent1[crossover2], h - crossover2);
-          }
-          if(child != parent2) memcpy(&child[crossover1], &parent2[crossover1], crossover2 - crossover1);
+          memcpy(child, parent1, crossover1);
+          memcpy(&child[crossover2], &parent1[crossover2], h - crossover2);
+          memcpy(&child[crossover1], &parent2[crossover1], crossover2 - crossover1);
         }
         else if(randomUInt64(r) & 1) memcpy(child, parent1, h);
         else memcpy(child, parent2, h);
@@ -4317,39 +4946,29 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
         {
           if(randomDecimal(r) < 0.01) child[y] = randomUInt64(r) % 5;
         }
-        /*evaluate new genome*/
+      }
+#ifndef NOMULTI
+      group.run(evaluate);
+#else
+      evaluate(0);
+#endif
+      /*replace the worst genomes*/
+      for(c = 0; c < offspring; ++c)
+      {
         total_size -= size[ranking[last - c]];
-        prevline = 0;
-        for(y = 0; y < h; ++y)
-        {
-          type = child[y];
-          out[y * (linebytes + 1)] = type;
-          if(clean){
-            memcpy(linebuf, &in[y * linebytes], linebytes);
-            filterScanline2(linebuf, prevline, linebytes, type, 0);
-            filterScanline(&out[y * (linebytes + 1) + 1], linebuf, prevline, linebytes, bytewidth, type);
-            memcpy(prevlinebuf, linebuf, linebytes);
-            prevline = prevlinebuf;
-          }
-          else{
-            filterScanline(&out[y * (linebytes + 1) + 1], &in[y * linebytes], prevline, linebytes, bytewidth, type);
-            prevline = &in[y * linebytes];
-          }
-        }
-        TUNE
-
-        stream.next_in = (z_const unsigned char *)out;
-        stream.avail_in = h * (linebytes + 1);
-        stream.avail_out = UINT_MAX;
-        stream.next_out = dummy;
-
-        deflate_nooutput(&stream, Z_FINISH);
-
-        size[ranking[last - c]] = stream.total_out;
-        deflateReset(&stream);
+        memcpy(&population[ranking[last - c] * h], &children[c * h], h);
+        size[ranking[last - c]] = child_size[c];
         total_size += size[ranking[last - c]];
       }
     }
+    for(t = 1; t < workers; ++t)
+    {
+      deflateEnd(worker_stream[t]);
+      free(worker_out[t]);
+      free(worker_linebuf[t]);
+      free(worker_prevlinebuf[t]);
+    }
+    free(children);
     /*final choice*/
     prevline = 0;
     for(y = 0; y < h; ++y)
@@ -4378,6 +4997,7 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
     }
   }
   else return 88; /* unknown filter strategy */
+    if(lastline) memcpy(lastline, prevline, linebytes);
     free(rem);
     free(in2);
   }
@@ -4385,6 +5005,18 @@ static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsign
   return 0;
 }
 
+static unsigned filter(unsigned char* out, unsigned char* in, unsigned w, unsigned h,
+                       const LodePNGColorMode* info, LodePNGEncoderSettings* settings,
+                       const unsigned char* prevline, unsigned char* lastline)
+{
+  ECTStatsTimer timer;
+  ECT_StatsStart(&timer);
+  unsigned error = filterScanlines(out, in, w, h, info, settings, prevline, lastline);
+  size_t linebytes = (w * lodepng_get_bpp(info) + 7) / 8;
+  ECT_StatsStop(&timer, ECT_STAGE_PNG_FILTER, h * linebytes, h * (linebytes + 1), h);
+  return error;
+}
+
 static void addPaddingBits(unsigned char* out, const unsigned char* in,
                            size_t olinebits, size_t ilinebits, unsigned h)
 {
@@ -4497,14 +5129,14 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, unsign
         if(!error)
         {
           addPaddingBits(padded, in, ((w * bpp + 7) / 8) * 8, w * bpp, h);
-          error = filter(*out, padded, w, h, &info_png->color, settings);
+          error = filter(*out, padded, w, h, &info_png->color, settings, 0, 0);
         }
         free(padded);
       }
       else
       {
         /*we can immediatly filter into the out buffer, no other steps needed*/
-        error = filter(*out, in, w, h, &info_png->color, settings);
+        error = filter(*out, in, w, h, &info_png->color, settings, 0, 0);
       }
     }
   }
@@ -4537,13 +5169,13 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, unsign
           addPaddingBits(padded, &adam7[passstart[i]],
                          ((passw[i] * bpp + 7) / 8) * 8, passw[i] * bpp, passh[i]);
           error = filter(&(*out)[filter_passstart[i]], padded,
-                         passw[i], passh[i], &info_png->color, settings);
+                         passw[i], passh[i], &info_png->color, settings, 0, 0);
           free(padded);
         }
         else
         {
           error = filter(&(*out)[filter_passstart[i]], &adam7[padded_passstart[i]],
-                         passw[i], passh[i], &info_png->color, settings);
+                         passw[i], passh[i], &info_png->color, settings, 0, 0);
         }
 
         if(error) break;
@@ -4556,6 +5188,107 @@ static unsigned preProcessScanlines(unsigned char** out, size_t* outsize, unsign
   return error;
 }
 
+/*whether the strategy picks the filter of a scanline from it and the one above alone, so that filter() can be
+given the image a few scanlines at a time*/
+static unsigned filterByRows(LodePNGFilterStrategy strategy)
+{
+  return strategy != LFS_INCREMENTAL && strategy != LFS_INCREMENTAL2 && strategy != LFS_INCREMENTAL3
+      && strategy != LFS_GENETIC && strategy != LFS_ALL_CHEAP;
+}
+
+/*Converts, filters and compresses a non-interlaced image a batch of scanlines at a time. Only the chunk being
+compressed and the 32768 bytes before it are kept, not the converted or the filtered image.
+Outputs the zlib data of the IDAT chunk. The rows of the raw image must start at a byte.*/
+static unsigned compressChunked(unsigned char** out, size_t* outsize, unsigned char* image, unsigned w, unsigned h,
+                                LodePNGColorMode* mode_out, const LodePNGColorMode* mode_in,
+                                LodePNGEncoderSettings* settings)
+{
+  unsigned bpp = lodepng_get_bpp(mode_out);
+  size_t linebytes = ((size_t)w * bpp + 7) / 8;
+  size_t rawlinebytes = (size_t)w * lodepng_get_bpp(mode_in) / 8;
+  unsigned convert = !lodepng_color_mode_equal(mode_out, mode_in);
+  const LodePNGCompressSettings* zlibsettings = &settings->zlibsettings;
+  size_t chunk = zlibsettings->chunk_size;
+  /*scanlines are converted and filtered about 1 MB at a time*/
+  unsigned rows = (unsigned)((1 << 20) / (linebytes + 1)) + 1;
+  if(rows > h) rows = h;
+  size_t capacity = 32768 + chunk + 8 + rows * (linebytes + 1);
+  unsigned char* window = (unsigned char*)lodepng_malloc(capacity);
+  unsigned char* converted = convert ? (unsigned char*)lodepng_malloc(rows * linebytes) : 0;
+  unsigned char* prevline = (unsigned char*)lodepng_malloc(linebytes);
+  unsigned char stream[2] = {0, 0};
+  unsigned adler = 1;
+  size_t start = 0, filled = 0;
+  unsigned y = 0;
+  unsigned error = 0;
+
+  /*zlib header, the same as lodepng_zlib_compress writes*/
+  unsigned CMFFLG = 256 * 120 + 3 * 64;
+  CMFFLG += 31 - CMFFLG % 31;
+  *outsize = 2;
+  *out = (unsigned char*)lodepng_malloc(2);
+  if(!window || (convert && !converted) || !prevline || !*out) error = 83; /*alloc fail*/
+  else
+  {
+    (*out)[0] = (unsigned char)(CMFFLG / 256);
+    (*out)[1] = (unsigned char)(CMFFLG % 256);
+  }
+
+  while(!error)
+  {
+    /*filter scanlines until the chunk and the 8 bytes after it are there*/
+    while(!error && y < h && filled < start + chunk + 8)
+    {
+      unsigned n = h - y < rows ? h - y : rows;
+      unsigned char* in = &image[y * rawlinebytes];
+      if(convert)
+      {
+        if(bpp >= 8) error = lodepng_convert(converted, in, mode_out, mode_in, w, n);
+        /*lodepng_convert doesn't pad scanlines to full bytes*/
+        else for(unsigned i = 0; i != n && !error; ++i)
+        {
+          error = lodepng_convert(&converted[i * linebytes], &in[i * rawlinebytes], mode_out, mode_in, w, 1);
+        }
+        in = converted;
+      }
+      LodePNGEncoderSettings batch = *settings;
+      if(batch.predefined_filters) batch.predefined_filters += y;
+      if(!error) error = filter(&window[filled], in, w, n, mode_out, &batch, y ? prevline : 0, prevline);
+      filled += n * (linebytes + 1);
+      y += n;
+    }
+    if(error) break;
+
+    size_t end = filled < start + chunk ? filled : start + chunk;
+    int final = y == h && end == filled;
+    adler = adler32(adler, &window[start], (unsigned)(end - start));
+    error = zlibsettings->custom_deflate_chunk(out, outsize, window, start, end, final, stream, zlibsettings);
+    if(error || final) break;
+
+    /*keep the last 32768 bytes as dictionary and the scanlines filtered past the chunk*/
+    size_t keep = end < 32768 ? end : 32768;
+    memmove(window, &window[end - keep], filled - end + keep);
+    filled -= end - keep;
+    start = keep;
+  }
+
+  if(!error)
+  {
+    unsigned char* grown = (unsigned char*)realloc(*out, *outsize + 4);
+    if(!grown) error = 83; /*alloc fail*/
+    else
+    {
+      *out = grown;
+      lodepng_set32bitInt(&(*out)[*outsize], adler);
+      *outsize += 4;
+    }
+  }
+  free(window);
+  free(converted);
+  free(prevline);
+  return error;
+}
+
 /*
 palette must have 4 * palettesize bytes allocated, and given in format RGBARGBARGBARGBA...
 returns 0 if the palette is opaque,
@@ -4596,7 +5329,7 @@ static unsigned addUnknownChunks(ucvector* out, unsigned char* data, size_t data
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
-static ColorTree ct;
+static thread_local ColorTree ct;
 static unsigned lodepng_encode(unsigned char** out, size_t* outsize,
                         unsigned char* image, unsigned w, unsigned h,
                         LodePNGState* state, LodePNGPaletteSettings palset)
@@ -4639,6 +5372,9 @@ static unsigned lodepng_encode(unsigned char** out, size_t* outsize,
         if (palset._first & 2) {
           color_tree_cleanup(&ct);
         }
+        /*still report the palette so callers can tell which trial it repeats*/
+        lodepng_color_mode_init(&state->out_mode);
+        lodepng_color_mode_copy(&state->out_mode, &info.color);
         lodepng_info_cleanup(&info);
         return 96;
       }
@@ -4666,7 +5402,16 @@ static unsigned lodepng_encode(unsigned char** out, size_t* outsize,
   state->error = checkColorValidity(state->info_raw.colortype, state->info_raw.bitdepth);
   if(state->error) return state->error; /*error: unexisting color type given*/
 
-  if(!lodepng_color_mode_equal(&state->info_raw, &info.color))
+  unsigned char* zlibdata = 0; /*compressed IDAT chunk data if the image was compressed in chunks*/
+  size_t zlibsize = 0;
+  size_t filteredsize = (size_t)h * (((size_t)w * lodepng_get_bpp(&info.color) + 7) / 8 + 1);
+  if(state->encoder.chunked_threshold && filteredsize >= state->encoder.chunked_threshold
+     && state->encoder.zlibsettings.custom_deflate_chunk && info.interlace_method == 0
+     && filterByRows(state->encoder.filter_strategy) && (size_t)w * lodepng_get_bpp(&state->info_raw) % 8 == 0)
+  {
+    state->error = compressChunked(&zlibdata, &zlibsize, image, w, h, &info.color, &state->info_raw, &state->encoder);
+  }
+  else if(!lodepng_color_mode_equal(&state->info_raw, &info.color))
   {
     unsigned char* converted;
     size_t size = ((unsigned long long)w * h * lodepng_get_bpp(&info.color) + 7) / 8;
@@ -4730,10 +5475,18 @@ static unsigned lodepng_encode(unsigned char** out, size_t* outsize,
     }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
     /*IDAT (multiple IDAT chunks must be consecutive)*/
-    //Work around problem w/ nonstandard malloc's. This can most likely be disabled.
-    data = (unsigned char*)realloc(data, datasize + 8);
-    state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
-    if(state->error) break;
+    if(zlibdata)
+    {
+      state->error = addChunk(&outv, "IDAT", zlibdata, zlibsize);
+      if(state->error) break;
+    }
+    else
+    {
+      //Work around problem w/ nonstandard malloc's. This can most likely be disabled.
+      data = (unsigned char*)realloc(data, datasize + 8);
+      state->error = addChunk_IDAT(&outv, data, datasize, &state->encoder.zlibsettings);
+      if(state->error) break;
+    }
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
     /*tEXt and/or zTXt*/
     for(i = 0; i != info.text_num; ++i)
@@ -4789,6 +5542,7 @@ static unsigned lodepng_encode(unsigned char** out, size_t* outsize,
 
   lodepng_info_cleanup(&info);
   free(data);
+  free(zlibdata);
   /*instead of cleaning the vector up, give it to the output*/
   *out = outv.data;
   *outsize = outv.size;
@@ -4807,6 +5561,9 @@ void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings)
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   settings->text_compression = 1;
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
+  settings->chunked_threshold = 0;
+  settings->threads = 0;
+  settings->verbose = 0;
 }
 
 #endif /*LODEPNG_COMPILE_ENCODER*/
@@ -5017,12 +5774,19 @@ unsigned encode(std::vector<unsigned char>& out,
                 std::vector<unsigned char>& in, unsigned w, unsigned h,
                 State& state, LodePNGPaletteSettings p)
 {
-  state.note = 0;
   if(lodepng_get_raw_size(w, h, &state.info_raw) > in.size()) return 84;
+  return encode(out, in.empty() ? 0 : &in[0], w, h, state, p);
+}
+
+unsigned encode(std::vector<unsigned char>& out,
+                unsigned char* in, unsigned w, unsigned h,
+                State& state, LodePNGPaletteSettings p)
+{
+  state.note = 0;
   unsigned char* buffer;
   size_t buffersize;
 
-  unsigned error = lodepng_encode(&buffer, &buffersize, in.empty() ? 0 : &in[0], w, h, &state, p);
+  unsigned error = lodepng_encode(&buffer, &buffersize, in, w, h, &state, p);
   if (error == 96) {
     error = 0;
     state.note = 1;
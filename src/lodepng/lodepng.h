@@ -144,6 +144,15 @@ struct LodePNGCompressSettings /*deflate = compress*/
                              const unsigned char*, size_t,
                              const LodePNGCompressSettings*);
 
+  /*use custom deflate encoder for images compressed in chunks, see chunked_threshold (default: null).
+  Compresses in[instart, inend) and appends it to out. The 32768 bytes before instart are there as
+  dictionary and 8 bytes past inend are allocated. stream points to 2 bytes that are 0 before the first
+  chunk and kept between the calls, final is set for the last chunk.*/
+  unsigned (*custom_deflate_chunk)(unsigned char**, size_t*,
+                                   const unsigned char*, size_t, size_t, int, unsigned char*,
+                                   const LodePNGCompressSettings*);
+  size_t chunk_size; /*bytes compressed per call of custom_deflate_chunk*/
+
   const void* custom_context; /*optional custom settings for custom functions*/
 };
 
@@ -454,9 +463,24 @@ typedef struct LodePNGEncoderSettings
 
     /* filter_style for LFS_BRUTE_FORCE*/
     unsigned short filter_style;
+
+  /*Filter and compress the image data a chunk at a time when it is at least this many bytes, instead of
+  keeping the converted and filtered image in memory. Needs zlibsettings.custom_deflate_chunk, no
+  interlacing and a filter strategy that picks the filter of each scanline on its own. 0 to disable.*/
+  size_t chunked_threshold;
+
+  /*Threads LFS_INCREMENTAL* and LFS_GENETIC may use, 0 for one per core*/
+  unsigned threads;
+
+  /*LFS_GENETIC prints its progress and stops early on SIGINT when set, for interactive use*/
+  unsigned verbose;
 } LodePNGEncoderSettings;
 
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
+
+/*Stops LFS_GENETIC after the given number of generations or seconds, 0 for no limit.
+Applies to all following encodes.*/
+void lodepng_set_genetic_limits(unsigned generations, unsigned seconds);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 
@@ -589,6 +613,10 @@ unsigned decode(std::vector<unsigned char>& out, unsigned& w, unsigned& h,
 unsigned encode(std::vector<unsigned char>& out,
                 std::vector<unsigned char>& in, unsigned w, unsigned h,
                 State& state, LodePNGPaletteSettings p);
+//Same as above, in must hold the full raw image.
+unsigned encode(std::vector<unsigned char>& out,
+                unsigned char* in, unsigned w, unsigned h,
+                State& state, LodePNGPaletteSettings p);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 #ifdef LODEPNG_COMPILE_DISK
@@ -4,23 +4,15 @@
 //  Copyright (c) 2014-2016 Felix Hanau.
 
 #include "main.h"
-#include "support.h"
-#include "miniz/miniz.h"
-#include <unistd.h>
-#include <limits.h>
+#include "lodepng/lodepng.h"
+#include "stats.h"
+#include <new>
+#include <deque>
 
 #ifndef NOMULTI
 #include <thread>
 #endif
 
-#ifdef MP3_SUPPORTED
-#include <id3/tag.h>
-#endif
-
-static size_t processedfiles;
-static size_t bytes;
-static long long savings;
-
 static void Usage() {
     printf (
             "Efficient Compression Tool\n"
@@ -42,6 +34,7 @@ static void Usage() {
             "/Folders"
 #endif
             "...\n"
+            "       ECT -gzip [Options] - < input > output.gz\n"
             "Options:\n"
             " -1 to -9       Set compression level (Default: 3)\n"
             " -strip         Strip metadata\n"
@@ -62,9 +55,20 @@ static void Usage() {
             " --allfilters   Try all PNG filter modes\n"
             " --allfilters-b Try all PNG filter modes, including brute force strategies\n"
             " --pal_sort=i   Try i different PNG palette filtering strategies (up to 120)\n"
+            " --zip-manifest Mark optimized ZIP archives, so later runs only optimize entries added since\n"
+            " --genetic=g[,s] Stop the genetic filter of --allfilters-b after g generations or s seconds, 0 for no limit\n"
+            " --files-from=f Also process the files listed in f, one per line or NUL separated, - for stdin\n"
+            " --shard=i/N    Only process the i-th of N deterministic parts of the file list\n"
+            " --zlib         Write a zlib instead of a gzip stream when compressing stdin\n"
+            " --serve        Process jobs read from stdin, see doc/Server.txt\n"
+            " --serve-max=i  Reject --serve jobs with a payload larger than i MB, default 1024\n"
+            " --stats        Print time and counters per file type and compression stage\n"
+            " --json-log=f   Append a JSON line with the results of every processed file to f\n"
+            " --trace=f      Write a timeline of files and compression stages to f, for chrome://tracing or Perfetto\n"
 #ifndef NOMULTI
             " --mt-deflate   Use per block multithreading in Deflate\n"
             " --mt-deflate=i Use per block multithreading in Deflate, use i threads\n"
+            " --serve=i      Process jobs read from stdin using i threads\n"
 #endif
             //" --arithmetic   Use arithmetic encoding for JPEGs, incompatible with most software\n"
 #ifdef __DATE__
@@ -73,410 +77,97 @@ static void Usage() {
             );
 }
 
-static void ECT_ReportSavings(){
-    if (processedfiles){
-        printf("Processed %zu file%s\n", processedfiles, processedfiles > 1 ? "s":"");
-        if (savings < 0){
-            printf("Result is bigger\n");
-            return;
+//Applies a single command line option to Options, returns 1 if it is unknown.
+int ParseOption(const char* arg, ECTOptions& Options){
+    int strlen = strnlen(arg, 64);  //File names may be longer and are unaffected by this check
+    if (strncmp(arg, "-strip", strlen) == 0){Options.strip = true;}
+    else if (strncmp(arg, "-progressive", strlen) == 0) {Options.Progressive = true;}
+    else if (arg[0] == '-' && isdigit(arg[1])) {
+        int l = atoi(arg + 1);
+        if (!l) {
+            l = 1;
         }
-
-        int bk = 0;
-        int k = 0;
-        double smul = savings;
-        double bmul = bytes;
-        while (smul > 1024) {smul /= 1024; k++;}
-        while (bmul > 1024) {bmul /= 1024; bk++;}
-        char *counter;
-        if (k == 1) {counter = (char *)"K";}
-        else if (k == 2) {counter = (char *)"M";}
-        else if (k == 3) {counter = (char *)"G";}
-        else {counter = (char *)"";}
-        char *counter2;
-        if (bk == 1){counter2 = (char *)"K";}
-        else if (bk == 2){counter2 = (char *)"M";}
-        else if (bk == 3){counter2 = (char *)"G";}
-        else {counter2 = (char *)"";}
-        printf("Saved ");
-        if (k == 0){printf("%0.0f", smul);}
-        else{printf("%0.2f", smul);}
-        printf("%sB out of ", counter);
-        if (bk == 0){printf("%0.0f", bmul);}
-        else{printf("%0.2f", bmul);}
-        printf("%sB (%0.4f%%)\n", counter2, (100.0 * savings)/bytes);}
-    else {printf("No compatible files found\n");}
-}
-
-static int ECTGzip(const char * Infile, const unsigned Mode, unsigned char multithreading, long long fs, unsigned ZIP, int strict){
-    if (!fs){
-        printf("%s: Compression of empty files is currently not supported\n", Infile);
-        return 2;
-    }
-    int isGZ = IsGzip(Infile);
-    if(isGZ == 2){
-        return 2;
-    }
-    if(isGZ == 3 && strict){
-        printf("%s: File includes extra field, file name or comment, can't be optimized in strict mode\n", Infile);
-        return 2;
-    }
-    if (ZIP || !isGZ){
-        if (exists(((std::string)Infile).append(ZIP ? ".zip" : ".gz").c_str())){
-            printf("%s: Compressed file already exists\n", Infile);
-            return 2;
-        }
-        ZopfliGzip(Infile, 0, Mode, multithreading, ZIP);
-        return 1;
+        Options.Mode = l;
     }
-    if (exists(((std::string)Infile).append(".ungz").c_str())){
-        return 2;
-    }
-    if (exists(((std::string)Infile).append(".ungz.gz").c_str())){
-        return 2;
-    }
-    if(ungz(Infile, ((std::string)Infile).append(".ungz").c_str())){
-        return 2;
-    }
-    ZopfliGzip(((std::string)Infile).append(".ungz").c_str(), 0, Mode, multithreading, ZIP);
-    if (filesize(((std::string)Infile).append(".ungz.gz").c_str()) < filesize(Infile)){
-        unlink(Infile);
-        rename(((std::string)Infile).append(".ungz.gz").c_str(), Infile);
-    }
-    else {
-        unlink(((std::string)Infile).append(".ungz.gz").c_str());
-    }
-    unlink(((std::string)Infile).append(".ungz").c_str());
-    return 0;
-}
-
-static unsigned char OptimizePNG(const char * Infile, const ECTOptions& Options){
-    unsigned _mode = Options.Mode;
-    unsigned mode = (Options.Mode % 10000) > 9 ? 9 : (Options.Mode % 10000);
-    if (mode == 1 && Options.Reuse){
-        mode++;
-    }
-    int x = 1;
-    long long size = filesize(Infile);
-    if(size < 0){
-        printf("Can't read from %s\n", Infile);
-        return 1;
-    }
-    if(mode == 9 && !Options.Reuse && !Options.Allfilters){
-        x = Zopflipng(Options.strip, Infile, Options.Strict, 3, 0, Options.DeflateMultithreading);
-        if(x < 0){
-            return 1;
-        }
-    }
-    //Disabled as using this causes libpng warnings
-    //int filter = Optipng(Options.Mode, Infile, true, Options.Strict || Options.Mode > 1);
-    int filter = 0;
-    if (!Options.Allfilters){
-        filter = Options.Reuse ? 6 : Optipng(mode, Infile, false, Options.Strict || mode > 1);
-    }
-
-    if (filter == -1){
-        return 1;
-    }
-    if(filter && !Options.Allfilters && Options.Allfilterscheap && !Options.Reuse){
-        filter = 15;
-    }
-    if (mode != 1){
-        if (Options.Allfilters){
-            x = Zopflipng(Options.strip, Infile, Options.Strict, _mode, 6 + Options.palette_sort, Options.DeflateMultithreading);
-            if(x < 0){
-                return 1;
-            }
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, Options.palette_sort, Options.DeflateMultithreading);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 5 + Options.palette_sort, Options.DeflateMultithreading);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 1 + Options.palette_sort, Options.DeflateMultithreading);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 2 + Options.palette_sort, Options.DeflateMultithreading);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 3 + Options.palette_sort, Options.DeflateMultithreading);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 4 + Options.palette_sort, Options.DeflateMultithreading);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 7 + Options.palette_sort, Options.DeflateMultithreading);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 8 + Options.palette_sort, Options.DeflateMultithreading);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 11 + Options.palette_sort, Options.DeflateMultithreading);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 12 + Options.palette_sort, Options.DeflateMultithreading);
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, 13 + Options.palette_sort, Options.DeflateMultithreading);
-            if (Options.Allfiltersbrute){
-                Zopflipng(Options.strip, Infile, Options.Strict, _mode, 9 + Options.palette_sort, Options.DeflateMultithreading);
-                Zopflipng(Options.strip, Infile, Options.Strict, _mode, 10 + Options.palette_sort, Options.DeflateMultithreading);
-                Zopflipng(Options.strip, Infile, Options.Strict, _mode, 14 + Options.palette_sort, Options.DeflateMultithreading);
-            }
-        }
-        else if (mode == 9){
-            Zopflipng(Options.strip, Infile, Options.Strict, _mode, filter + Options.palette_sort, Options.DeflateMultithreading);
-        }
-        else {
-            x = Zopflipng(Options.strip, Infile, Options.Strict, _mode, filter + Options.palette_sort, Options.DeflateMultithreading);
-            if(x < 0){
-                return 1;
-            }
+    else if (strncmp(arg, "-gzip", strlen) == 0) {Options.Gzip = true;}
+    else if (strncmp(arg, "-zip", strlen) == 0) {Options.Zip = true; Options.Gzip = true;}
+    else if (strncmp(arg, "-quiet", strlen) == 0) {Options.SavingsCounter = false;}
+    else if (strncmp(arg, "-keep", strlen) == 0) {Options.keep = true;}
+    else if (strcmp(arg, "--disable-jpeg") == 0 || strcmp(arg, "--disable-jpg") == 0 ){Options.JPEG_ACTIVE = false;}
+    else if (strcmp(arg, "--disable-png") == 0){Options.PNG_ACTIVE = false;}
+#ifdef BOOST_SUPPORTED
+    else if (strncmp(arg, "-recurse", strlen) == 0)  {Options.Recurse = 1;}
+#endif
+    else if (strcmp(arg, "--strict") == 0) {Options.Strict = true;}
+    else if (strcmp(arg, "--reuse") == 0) {Options.Reuse = true;}
+    else if (strcmp(arg, "--allfilters") == 0) {Options.Allfilters = true;}
+    else if (strcmp(arg, "--allfilters-b") == 0) {Options.Allfiltersbrute = Options.Allfilters = true;}
+    else if (strcmp(arg, "--allfilters-c") == 0) {Options.Allfilterscheap = true;}
+    else if (strcmp(arg, "--zip-manifest") == 0) {Options.ZipManifest = true;}
+    else if (strncmp(arg, "--pal_sort=", 11) == 0){
+        Options.palette_sort = atoi(arg + 11) << 8;
+        if(Options.palette_sort > 120 << 8){
+            Options.palette_sort = 120 << 8;
         }
     }
-    else {
-        if (filesize(Infile) <= size){
-            unlink(((std::string)Infile).append(".bak").c_str());
+#ifndef NOMULTI
+    else if (strncmp(arg, "--mt-deflate", 12) == 0) {
+        if (strncmp(arg, "--mt-deflate=", 13) == 0){
+            Options.DeflateMultithreading = atoi(arg + 13);
         }
-        else {
-            unlink(Infile);
-            rename(((std::string)Infile).append(".bak").c_str(), Infile);
+        else if (strcmp(arg, "--mt-deflate") == 0) {
+            Options.DeflateMultithreading = std::thread::hardware_concurrency();
         }
     }
-
-    if(Options.strip && x){
-        Optipng(0, Infile, false, 0);
-    }
+#endif
+    else if (strcmp(arg, "--arithmetic") == 0) {Options.Arithmetic = true;}
+    else {return 1;}
     return 0;
 }
 
-static unsigned char OptimizeJPEG(const char * Infile, const ECTOptions& Options){
-    size_t stsize = 0;
-
-    int res = mozjpegtran(Options.Arithmetic, Options.Progressive && (Options.Mode > 1 || filesize(Infile) > 5000), Options.strip, Infile, Infile, &stsize);
-    if (Options.Progressive && Options.Mode > 1 && res != 2){
-        if(res == 1 || (Options.Mode == 2 && stsize < 6500) || (Options.Mode == 3 && stsize < 10000) || (Options.Mode == 4 && stsize < 15000) || (Options.Mode > 4 && stsize < 20000)){
-            res = mozjpegtran(Options.Arithmetic, false, Options.strip, Infile, Infile, &stsize);
-        }
+//Reads a newline or NUL separated list of files, "-" reads it from stdin.
+static int ReadFileList(const char* list, std::deque<std::string>& listed){
+    FILE* f = strcmp(list, "-") == 0 ? stdin : fopen(list, "rb");
+    if(!f){
+        return 1;
     }
-    return res == 2;
-}
-
-#ifdef MP3_SUPPORTED
-static void OptimizeMP3(const char * Infile, const ECTOptions& Options){
-    ID3_Tag orig (Infile);
-    size_t start = orig.Size();
-    ID3_Frame* picFrame = orig.Find(ID3FID_PICTURE);
-    if (picFrame)
-    {
-        ID3_Field* mime = picFrame->GetField(ID3FN_MIMETYPE);
-        if (mime){
-            char mimetxt[20];
-            mime->Get(mimetxt, 19);
-            ID3_Field* pic = picFrame->GetField(ID3FN_DATA);
-            bool ispng = memcmp(mimetxt, "image/png", 9) == 0 || memcmp(mimetxt, "PNG", 3) == 0;
-            if (pic && (memcmp(mimetxt, "image/jpeg", 10) == 0 || ispng)){
-                pic->ToFile("out.jpg");
-                if (ispng){
-                    OptimizePNG("out.jpg", Options);
-                }
-                else{
-                    OptimizeJPEG("out.jpg", Options);
-                }
-                pic->FromFile("out.jpg");
-                unlink("out.jpg");
-                orig.SetPadding(false);
-                //orig.SetCompression(true);
-                if (orig.Size() < start){
-                    orig.Update();
-                }
-            }
-        }
+    std::string data;
+    char buf[65536];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0){
+        data.append(buf, n);
     }
-}
-#endif
-
-unsigned fileHandler(const char * Infile, const ECTOptions& Options, int internal){
-    std::string Ext = Infile;
-    std::string x = Ext.substr(Ext.find_last_of(".") + 1);
-    time_t t;
-    unsigned error = 0;
-
-    if ((Options.PNG_ACTIVE && (x == "PNG" || x == "png")) || (Options.JPEG_ACTIVE && (x == "jpg" || x == "JPG" || x == "JPEG" || x == "jpeg")) || (Options.Gzip && !internal)){
-        if(Options.keep){
-            t = get_file_time(Infile);
+    int error = ferror(f);
+    if(f != stdin){
+        fclose(f);
+    }
+    char sep = data.find('\0') != std::string::npos ? '\0' : '\n';
+    size_t pos = 0;
+    while(pos < data.size()){
+        size_t end = data.find(sep, pos);
+        if(end == std::string::npos){
+            end = data.size();
         }
-        long long size = filesize(Infile);
-        if (size < 0){
-            printf("%s: bad file\n", Infile);
-            return 1;
+        std::string name = data.substr(pos, end - pos);
+        if(sep == '\n' && !name.empty() && name.back() == '\r'){
+            name.pop_back();
         }
-        int statcompressedfile = 0;
-        if (size < 1200000000) {//completely random value
-            if (x == "PNG" || x == "png"){
-                error = OptimizePNG(Infile, Options);
-            }
-            else if (x == "jpg" || x == "JPG" || x == "JPEG" || x == "jpeg"){
-                error = OptimizeJPEG(Infile, Options);
-            }
-            else if (Options.Gzip && !internal){
-                statcompressedfile = ECTGzip(Infile, Options.Mode, Options.DeflateMultithreading, size, Options.Zip, Options.Strict);
-                if (statcompressedfile == 2){
-                    return 1;
-                }
-            }
-            if(Options.SavingsCounter && !internal){
-                processedfiles++;
-                bytes += size;
-                if (!statcompressedfile){
-                savings = savings + size - filesize(Infile);
-                }
-                else if (statcompressedfile){
-                    savings += (size - filesize(((std::string)Infile).append(Options.Zip ? ".zip" : ".gz").c_str()));
-                }
-            }
-        }
-        else{printf("File too big\n");}
-        if(Options.keep && !statcompressedfile){
-            set_file_time(Infile, t);
+        if(!name.empty()){
+            listed.push_back(name);
         }
+        pos = end + 1;
     }
-#ifdef MP3_SUPPORTED
-    else if(x == "mp3"){
-        OptimizeMP3(Infile, Options);
-    }
-#endif
     return error;
 }
 
-unsigned zipHandler(std::vector<int> args, const char * argv[], int files, const ECTOptions& Options){
-#ifdef _WIN32
-#define EXTSEP "\\"
-#else
-#define EXTSEP "/"
-#endif
-    std::string extension = ((std::string)argv[args[0]]).substr(((std::string)argv[args[0]]).find_last_of(".") + 1);
-    std::string zipfilename = argv[args[0]];
-    size_t local_bytes = 0;
-    unsigned i = 0;
-    time_t t = -1;
-    if((extension=="zip" || extension=="ZIP" || IsZIP(argv[args[0]])) && !isDirectory(argv[args[0]])){
-        i++;
-        if(exists(argv[args[0]])){
-            local_bytes += filesize(zipfilename.c_str());
-            if(Options.keep){
-                t = get_file_time(argv[args[0]]);
-            }
-        }
-    }
-    else{
-        //Construct name
-        if(!isDirectory(argv[args[0]])
-#ifdef BOOST_SUPPORTED
-           && boost::filesystem::is_regular_file(argv[args[0]])
-#endif
-           ){
-            if(zipfilename.find_last_of(".") > zipfilename.find_last_of("/\\")) {
-                zipfilename = zipfilename.substr(0, zipfilename.find_last_of("."));
-            }
-        }
-        else if(zipfilename.back() == '/' || zipfilename.back() == '\\'){
-            zipfilename.pop_back();
-        }
-
-        zipfilename += ".zip";
-        if(exists(zipfilename.c_str())){
-            printf("Error: ZIP file for chosen file/folder already exists, but you didn't list it.\n");
-            return 1;
-        }
+//Assigns a file to a shard by the FNV-1a hash of its path, so every machine given the same list and shard count agrees on the split.
+static unsigned FileShard(const char* name, unsigned shards){
+    unsigned long long hash = 14695981039346656037ULL;
+    for(; *name; name++){
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211ULL;
     }
-
-    int error = 0;
-    for(; error == 0 && i < files; i++){
-        if(isDirectory(argv[args[i]])){
-#ifdef BOOST_SUPPORTED
-            std::string fold = boost::filesystem::canonical(argv[args[i]]).string();
-            int substr = boost::filesystem::path(fold).has_parent_path() ? boost::filesystem::path(fold).parent_path().string().length() + 1 : 0;
-
-            boost::filesystem::recursive_directory_iterator a(fold), b;
-            std::vector<boost::filesystem::path> paths(a, b);
-            for(unsigned j = 0; j < paths.size(); j++){
-                std::string newfile = paths[j].string();
-                const char* name = newfile.erase(0, substr).c_str();
-
-                if(isDirectory(paths[j].string().c_str())){
-                    //Only add dir if it is empty to minimize filesize
-                    std::string next = paths[j + 1].string();
-                    if ((next.compare(0, paths[j].string().size() + 1, paths[j].string() + "/") != 0 || next.compare(0, paths[j].string().size() + 1, paths[j].string() + "/") != 0)&& !mz_zip_add_mem_to_archive_file_in_place(zipfilename.c_str(), ((std::string)name + EXTSEP).c_str(), 0, 0, 0, 0, paths[j].string().c_str())) {
-                        printf("can't add directory '%s'\n", argv[args[i]]);
-                    }
-                }
-                else{
-                    long long f = filesize(paths[j].string().c_str());
-                    if(f > UINT_MAX){
-                        printf("%s: file too big\n", paths[j].string().c_str());
-                        continue;
-                    }
-                    if(f < 0){
-                        printf("%s: can't read file\n", paths[j].string().c_str());
-                        continue;
-                    }
-                    char* file = (char*)malloc(f);
-                    if(!file){
-                        exit(1);
-                    }
-                    FILE * stream = fopen (paths[j].string().c_str(), "rb");
-                    if (!stream){
-                        free(file); error = 1; continue;
-                    }
-                    if (fread(file, 1, f, stream) != f){
-                        fclose(stream); free(file); error = 1; continue;
-                    }
-                    fclose(stream);
-                    if(!mz_zip_add_mem_to_archive_file_in_place(zipfilename.c_str(), name, file, f, 0, 0, paths[j].string().c_str())){
-                        printf("can't add file '%s'\n", paths[j].string().c_str());
-                        free(file); error = 1; continue;
-                    }
-                    else{
-                        local_bytes += filesize(paths[j].string().c_str());
-                    }
-                    free(file);
-                }
-            }
-            if(!paths.size()){
-                if (!mz_zip_add_mem_to_archive_file_in_place(zipfilename.c_str(), (fold.erase(0, substr) + EXTSEP).c_str(), 0, 0, 0, 0, argv[args[i]])) {
-                    printf("can't add directory '%s'\n", argv[args[i]]);
-                }
-            }
-#else
-            printf("%s: Zipping folders is not supported\n", argv[args[i]]);
-#endif
-        }
-        else{
-
-            const char* fname = argv[args[i]];
-            long long f = filesize(fname);
-            if(f > UINT_MAX){
-                printf("%s: file too big\n", fname);
-                continue;
-            }
-            if(f < 0){
-                printf("%s: can't read file\n", fname);
-                continue;
-            }
-            char* file = (char*)malloc(f);
-            if(!file){
-                exit(1);
-            }
-
-            FILE * stream = fopen (fname, "rb");
-            if (!stream){
-                free(file); error = 1; continue;
-            }
-            if (fread(file, 1, f, stream) != f){
-                fclose(stream); free(file); error = 1; continue;
-            }
-
-            fclose(stream);
-            if (!mz_zip_add_mem_to_archive_file_in_place(zipfilename.c_str(), ((std::string)argv[args[i]]).substr(((std::string)argv[args[i]]).find_last_of("/\\") + 1).c_str(), file, f, 0, 0, argv[args[i]])
-                ) {
-                printf("can't add file '%s'\n", argv[0]);
-                free(file); error = 1; continue;
-            }
-            local_bytes += filesize(argv[args[i]]);
-
-            free(file);
-
-        }
-    }
-
-    ReZipFile(zipfilename.c_str(), Options, &processedfiles);
-    if(t >= 0){
-        set_file_time(zipfilename.c_str(), t);
-    }
-
-    bytes += local_bytes;
-    savings += local_bytes - filesize(zipfilename.c_str());
-    return error;
+    return hash % shards;
 }
 
 int main(int argc, const char * argv[]) {
@@ -496,105 +187,173 @@ int main(int argc, const char * argv[]) {
     Options.SavingsCounter = true;
     Options.Strict = false;
     Options.DeflateMultithreading = 0;
+    Options.Threads = 0;
     Options.Reuse = 0;
     Options.Allfilters = 0;
     Options.Allfiltersbrute = 0;
     Options.Allfilterscheap = 0;
     Options.palette_sort = 0;
     Options.keep = false;
+    Options.ZipManifest = false;
     std::vector<int> args;
     int files = 0;
+    //File names from argv followed by those read with --files-from, args indexes into this
+    std::vector<const char*> names(argv, argv + argc);
+    std::deque<std::string> listed;
+    bool haslist = false;
+    unsigned shard = 0;
+    unsigned shards = 0;
+    int serve = -1;
+    unsigned long long serve_max = 1024;
+    bool stdio = false;
+    bool zlib = false;
     if (argc >= 2){
         for (int i = 1; i < argc; i++) {
-            int strlen = strnlen(argv[i], 64);  //File names may be longer and are unaffected by this check
-            if (strncmp(argv[i], "-", 1) != 0){
+            if (strcmp(argv[i], "-") == 0) {stdio = true;}
+            else if (strncmp(argv[i], "-", 1) != 0){
                 args.push_back(i);
                 files++;
             }
-            else if (strncmp(argv[i], "-strip", strlen) == 0){Options.strip = true;}
-            else if (strncmp(argv[i], "-progressive", strlen) == 0) {Options.Progressive = true;}
-            else if (argv[i][0] == '-' && isdigit(argv[i][1])) {
-                int l = atoi(argv[i] + 1);
-                if (!l) {
-                    l = 1;
+            else if (strcmp(argv[i], "--zlib") == 0) {zlib = true;}
+            else if (strncmp(argv[i], "--files-from=", 13) == 0) {
+                if(ReadFileList(argv[i] + 13, listed)){
+                    printf("%s: Can't read file list\n", argv[i] + 13);
+                    return 1;
+                }
+                haslist = true;
+            }
+            else if (strncmp(argv[i], "--shard=", 8) == 0) {
+                if(sscanf(argv[i] + 8, "%u/%u", &shard, &shards) != 2 || !shard || shard > shards){
+                    printf("Invalid shard: %s, expected i/N with 1 <= i <= N\n", argv[i] + 8);
+                    return 1;
                 }
-                Options.Mode = l;
             }
-            else if (strncmp(argv[i], "-gzip", strlen) == 0) {Options.Gzip = true;}
-            else if (strncmp(argv[i], "-zip", strlen) == 0) {Options.Zip = true; Options.Gzip = true;}
-            else if (strncmp(argv[i], "-help", strlen) == 0) {Usage(); return 0;}
-            else if (strncmp(argv[i], "-quiet", strlen) == 0) {Options.SavingsCounter = false;}
-            else if (strncmp(argv[i], "-keep", strlen) == 0) {Options.keep = true;}
-            else if (strcmp(argv[i], "--disable-jpeg") == 0 || strcmp(argv[i], "--disable-jpg") == 0 ){Options.JPEG_ACTIVE = false;}
-            else if (strcmp(argv[i], "--disable-png") == 0){Options.PNG_ACTIVE = false;}
-#ifdef BOOST_SUPPORTED
-            else if (strncmp(argv[i], "-recurse", strlen) == 0)  {Options.Recurse = 1;}
-#endif
-            else if (strcmp(argv[i], "--strict") == 0) {Options.Strict = true;}
-            else if (strcmp(argv[i], "--reuse") == 0) {Options.Reuse = true;}
-            else if (strcmp(argv[i], "--allfilters") == 0) {Options.Allfilters = true;}
-            else if (strcmp(argv[i], "--allfilters-b") == 0) {Options.Allfiltersbrute = Options.Allfilters = true;}
-            else if (strcmp(argv[i], "--allfilters-c") == 0) {Options.Allfilterscheap = true;}
-            else if (strncmp(argv[i], "--pal_sort=", 11) == 0){
-                Options.palette_sort = atoi(argv[i] + 11) << 8;
-                if(Options.palette_sort > 120 << 8){
-                    Options.palette_sort = 120 << 8;
+            else if (strncmp(argv[i], "--genetic=", 10) == 0) {
+                unsigned generations = 0, seconds = 0;
+                if(sscanf(argv[i] + 10, "%u,%u", &generations, &seconds) < 1){
+                    printf("Invalid genetic filter limit: %s, expected generations[,seconds]\n", argv[i] + 10);
+                    return 1;
                 }
+                lodepng_set_genetic_limits(generations, seconds);
             }
-
-
-#ifndef NOMULTI
-            else if (strncmp(argv[i], "--mt-deflate", 12) == 0) {
-                if (strncmp(argv[i], "--mt-deflate=", 13) == 0){
-                    Options.DeflateMultithreading = atoi(argv[i] + 13);
+            else if (strcmp(argv[i], "--stats") == 0) {ECT_EnableStats();}
+            else if (strncmp(argv[i], "--trace=", 8) == 0) {
+                if(ECT_OpenTrace(argv[i] + 8)){
+                    printf("%s: Can't write trace\n", argv[i] + 8);
+                    return 1;
                 }
-                else if (strcmp(argv[i], "--mt-deflate") == 0) {
-                    Options.DeflateMultithreading = std::thread::hardware_concurrency();
+            }
+            else if (strncmp(argv[i], "--json-log=", 11) == 0) {
+                if(ECT_OpenJSONLog(argv[i] + 11)){
+                    printf("%s: Can't write JSON log\n", argv[i] + 11);
+                    return 1;
                 }
             }
-#endif
-            else if (strcmp(argv[i], "--arithmetic") == 0) {Options.Arithmetic = true;}
-            else {printf("Unknown flag: %s\n", argv[i]); return 0;}
+            else if (strcmp(argv[i], "--serve") == 0) {serve = 0;}
+            else if (strncmp(argv[i], "--serve=", 8) == 0) {serve = atoi(argv[i] + 8);}
+            else if (strncmp(argv[i], "--serve-max=", 12) == 0) {
+                //Converted to bytes below, so larger values would overflow
+                const unsigned long long limit = ~0ULL >> 20;
+                char* end;
+                serve_max = strtoull(argv[i] + 12, &end, 10);
+                if(argv[i][12] < '0' || argv[i][12] > '9' || *end || !serve_max || serve_max > limit){
+                    printf("Invalid payload limit: %s, expected MB between 1 and %llu\n", argv[i] + 12, limit);
+                    return 1;
+                }
+            }
+            else if (ParseOption(argv[i], Options)){
+                if (strncmp(argv[i], "-help", strnlen(argv[i], 64)) == 0) {Usage(); return 0;}
+                printf("Unknown flag: %s\n", argv[i]); return 0;
+            }
         }
         if(Options.Reuse){
             Options.Allfilters = 0;
         }
-        if(Options.Zip){
-            error |= zipHandler(args, argv, files, Options);
+        for(unsigned i = 0; i < listed.size(); i++){
+            names.push_back(listed[i].c_str());
+            args.push_back(names.size() - 1);
+            files++;
         }
-        else {
-            for (int j = 0; j < files; j++){
-#ifdef BOOST_SUPPORTED
-                if (boost::filesystem::is_regular_file(argv[args[j]])){
-                    error |= fileHandler(argv[args[j]], Options, 0);
+        if(shards){
+            if(Options.Zip){
+                printf("--shard can't be used with -zip\n");
+                return 1;
+            }
+            std::vector<int> selected;
+            for(int j = 0; j < files; j++){
+                if(FileShard(names[args[j]], shards) == shard - 1){
+                    selected.push_back(args[j]);
                 }
-                else if (boost::filesystem::is_directory(argv[args[j]])){
-                    if(Options.Recurse){boost::filesystem::recursive_directory_iterator a(argv[args[j]]), b;
-                        std::vector<boost::filesystem::path> paths(a, b);
-                        for(unsigned i = 0; i < paths.size(); i++){
-                            error |= fileHandler(paths[i].string().c_str(), Options, 0);
+            }
+            args.swap(selected);
+            files = args.size();
+            haslist = true;
+        }
+        if(serve >= 0){
+            return Serve(Options, serve, serve_max << 20);
+        }
+        if(stdio){
+            //stdout carries the compressed stream, so only errors are printed
+            if(files || Options.Zip || !(Options.Gzip || zlib)){
+                fprintf(stderr, "Reading from stdin is only supported with -gzip or --zlib and no other files\n");
+                return 1;
+            }
+            try {
+                if(ZopfliCompressStream(stdin, stdout, Options.Mode, zlib)){
+                    fprintf(stderr, "ECT: can't read from stdin or write to stdout\n");
+                    return 1;
+                }
+            }
+            catch (std::bad_alloc&) {
+                fprintf(stderr, "ECT: memory allocation failure\n");
+                return 1;
+            }
+            return 0;
+        }
+        //Allocation failures inside the compressors are thrown as std::bad_alloc
+        try {
+            if(Options.Zip){
+                error |= zipHandler(args, names.data(), files, Options);
+            }
+            else {
+                for (int j = 0; j < files; j++){
+#ifdef BOOST_SUPPORTED
+                    if (boost::filesystem::is_regular_file(names[args[j]])){
+                        error |= fileHandler(names[args[j]], Options, 0);
+                    }
+                    else if (boost::filesystem::is_directory(names[args[j]])){
+                        if(Options.Recurse){boost::filesystem::recursive_directory_iterator a(names[args[j]]), b;
+                            std::vector<boost::filesystem::path> paths(a, b);
+                            for(unsigned i = 0; i < paths.size(); i++){
+                                error |= fileHandler(paths[i].string().c_str(), Options, 0);
+                            }
+                        }
+                        else{
+                            boost::filesystem::directory_iterator a(names[args[j]]), b;
+                            std::vector<boost::filesystem::path> paths(a, b);
+                            for(unsigned i = 0; i < paths.size(); i++){
+                                error |= fileHandler(paths[i].string().c_str(), Options, 0);
+                            }
                         }
                     }
                     else{
-                        boost::filesystem::directory_iterator a(argv[args[j]]), b;
-                        std::vector<boost::filesystem::path> paths(a, b);
-                        for(unsigned i = 0; i < paths.size(); i++){
-                            error |= fileHandler(paths[i].string().c_str(), Options, 0);
-                        }
+                        error = 1;
                     }
-                }
-                else{
-                    error = 1;
-                }
 #else
-                error |= fileHandler(argv[args[j]], Options, 0);
+                    error |= fileHandler(names[args[j]], Options, 0);
 #endif
+                }
             }
         }
+        catch (std::bad_alloc&) {
+            fprintf(stderr, "ECT: memory allocation failure\n");
+            return 1;
+        }
 
-        if(!files){Usage();}
+        if(!files && !haslist){Usage();}
 
         if(Options.SavingsCounter){ECT_ReportSavings();}
+        ECT_ReportStats();
     }
     else {Usage();}
     return error;
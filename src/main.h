@@ -6,11 +6,15 @@
 //  Copyright (c) 2015 Felix Hanau.
 //
 
+#ifndef __Efficient_Compression_Tool__main__
+#define __Efficient_Compression_Tool__main__
+
 #include <cstdio>
 #include <cstdlib>
 #include <string>
 #include <cstring>
 #include <vector>
+#include <ctime>
 
 #include "gztools.h"
 
@@ -39,14 +43,40 @@ struct ECTOptions{
   bool Recurse;
 #endif
   unsigned DeflateMultithreading;
+  //Threads the PNG trials of one file may use, 0 for one per core
+  unsigned Threads;
   bool keep;
+  //Write a manifest into the comment of optimized ZIP archives, so later runs skip the entries it covers
+  bool ZipManifest;
 };
 
+//Shares deflate results between the Zopflipng trials of one image
+struct PNGTrialCache;
+PNGTrialCache* ZopflipngCreateCache();
+void ZopflipngFreeCache(PNGTrialCache* cache);
+
 int Optipng(unsigned level, const char * Infile, bool force_no_palette, unsigned clean_alpha);
-int Zopflipng(bool strip, const char * Infile, bool strict, unsigned Mode, int filter, unsigned multithreading);
+int Zopflipng(bool strip, const char * Infile, bool strict, unsigned Mode, int filter, unsigned multithreading, unsigned threads, PNGTrialCache* cache);
 int mozjpegtran (bool arithmetic, bool progressive, bool strip, const char * Infile, const char * Outfile, size_t* stripped_outsize);
 int ZopfliGzip(const char* filename, const char* outname, unsigned mode, unsigned multithreading, unsigned ZIP);
+int ZopfliCompressStream(FILE* infile, FILE* outfile, unsigned mode, unsigned zlib);
 void ZopfliBuffer(unsigned mode, unsigned multithreading, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize);
+int ZopfliIncompressible(const unsigned char* in, size_t insize, size_t target);
+bool SkipIncompressible(const unsigned char* in, size_t insize, size_t target);
 unsigned fileHandler(const char * Infile, const ECTOptions& Options, int internal);
 unsigned zipHandler(std::vector<int> args, const char * argv[], int files, const ECTOptions& Options);
 void ReZipFile(const char* file_path, const ECTOptions& Options, size_t* files);
+void MarkZipFile(const char* file_path, const ECTOptions& Options);
+void ECT_ReportSavings();
+int ParseOption(const char* arg, ECTOptions& Options);
+int Serve(const ECTOptions& Options, unsigned threads, unsigned long long max_payload);
+
+//In-memory versions used by libect
+int ZopflipngBuffer(bool strip, std::vector<unsigned char>& png, bool strict, unsigned Mode, int filter, unsigned multithreading, unsigned threads, PNGTrialCache* cache, bool verbose);
+int mozjpegtranBuffer (bool arithmetic, bool progressive, bool strip, const unsigned char* in, size_t insize, std::vector<unsigned char>* out, size_t* stripped_outsize);
+void ZopfliGzipBuffer(unsigned mode, unsigned multithreading, const unsigned char* in, size_t insize, time_t mtime, unsigned char** out, size_t* outsize);
+void ZopfliZlibBuffer(unsigned mode, unsigned multithreading, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize);
+unsigned bufferHandler(std::vector<unsigned char>& data, const char* extension, const ECTOptions& Options);
+size_t ReZipBuffer(unsigned char* data, size_t size, const ECTOptions& Options, size_t* files);
+
+#endif /* defined(__Efficient_Compression_Tool__main__) */
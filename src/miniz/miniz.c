@@ -516,6 +516,27 @@ mz_uint mz_zip_reader_get_num_files(mz_zip_archive *pZip)
   return pZip ? pZip->m_total_files : 0;
 }
 
+mz_uint mz_zip_reader_get_filename(mz_zip_archive *pZip, mz_uint file_index, char *pFilename, mz_uint filename_buf_size)
+{
+  mz_uint n;
+  const mz_uint8 *p;
+  if ((!pZip) || (!pZip->m_pState) || (file_index >= pZip->m_total_files) || (pZip->m_zip_mode != MZ_ZIP_MODE_READING))
+  {
+    if (filename_buf_size)
+      pFilename[0] = '\0';
+    return 0;
+  }
+  p = &MZ_ZIP_ARRAY_ELEMENT(&pZip->m_pState->m_central_dir, mz_uint8, MZ_ZIP_ARRAY_ELEMENT(&pZip->m_pState->m_central_dir_offsets, mz_uint32, file_index));
+  n = MZ_READ_LE16(p + MZ_ZIP_CDH_FILENAME_LEN_OFS);
+  if (filename_buf_size)
+  {
+    n = MZ_MIN(n, filename_buf_size - 1);
+    memcpy(pFilename, p + MZ_ZIP_CENTRAL_DIR_HEADER_SIZE, n);
+    pFilename[n] = '\0';
+  }
+  return n + 1;
+}
+
 mz_bool mz_zip_reader_end(mz_zip_archive *pZip)
 {
   if ((!pZip) || (!pZip->m_pState) || (pZip->m_zip_mode != MZ_ZIP_MODE_READING))
@@ -794,7 +815,8 @@ static void AddNonCompressedBlock(const unsigned char* in, size_t insize, unsign
 
 mz_bool mz_zip_writer_add_mem_ex(mz_zip_archive *pZip, const char *pArchive_name, const void *pBuf, size_t buf_size, const void *pComment, mz_uint16 comment_size, const char* location)
 {
-  void * data;
+  void * data = 0;
+  mz_bool status;
   mz_uint32 uncomp_crc32 = (mz_uint32)crc32(MZ_CRC32_INIT, (const mz_uint8*)pBuf, buf_size);
   mz_uint64 uncomp_size = buf_size;
   buf_size = uncomp_size ? uncomp_size + 5 * ((uncomp_size / 65535) + !!(uncomp_size % 65535)) : 0;
@@ -805,8 +827,14 @@ mz_bool mz_zip_writer_add_mem_ex(mz_zip_archive *pZip, const char *pArchive_name
     }
     AddNonCompressedBlock((const unsigned char*)pBuf, uncomp_size, data);
   }
+  status = mz_zip_writer_add_compressed_mem(pZip, pArchive_name, data, buf_size, uncomp_size, uncomp_crc32, buf_size ? MZ_DEFLATED : 0, pComment, comment_size, location);
+  free(data);
+  return status;
+}
 
-  mz_uint16 method = 0, dos_time = 0, dos_date = 0;
+mz_bool mz_zip_writer_add_compressed_mem(mz_zip_archive *pZip, const char *pArchive_name, const void *pBuf, size_t buf_size, mz_uint64 uncomp_size, mz_uint32 uncomp_crc32, mz_uint16 method, const void *pComment, mz_uint16 comment_size, const char* location)
+{
+  mz_uint16 dos_time = 0, dos_date = 0;
   mz_uint ext_attributes = 0, num_alignment_padding_bytes;
   mz_uint64 local_dir_header_ofs = pZip->m_archive_size, cur_archive_file_ofs = pZip->m_archive_size;
   size_t archive_name_size;
@@ -868,16 +896,10 @@ mz_bool mz_zip_writer_add_mem_ex(mz_zip_archive *pZip, const char *pArchive_name
 
   if (buf_size)
   {
-    if (mz_zip_file_write_func(pZip->m_pIO_opaque, cur_archive_file_ofs, data, buf_size) != buf_size)
-    {
-      free(data);
+    if (mz_zip_file_write_func(pZip->m_pIO_opaque, cur_archive_file_ofs, pBuf, buf_size) != buf_size)
       return MZ_FALSE;
-    }
-    free(data);
 
     cur_archive_file_ofs += buf_size;
-
-    method = MZ_DEFLATED;
   }
 
   // no zip64 support yet
@@ -153,6 +153,9 @@ extern "C" {
   // Returns the total number of files in the archive.
   mz_uint mz_zip_reader_get_num_files(mz_zip_archive *pZip);
 
+  // Copies the name of the file_index-th file to pFilename and returns the number of bytes needed to store it, including the terminator.
+  mz_uint mz_zip_reader_get_filename(mz_zip_archive *pZip, mz_uint file_index, char *pFilename, mz_uint filename_buf_size);
+
   // Ends archive reading, freeing all allocations, and closing the input archive file if mz_zip_reader_init_file() was used.
   mz_bool mz_zip_reader_end(mz_zip_archive *pZip);
 
@@ -180,6 +183,10 @@ extern "C" {
   // level_and_flags - compression level (0-10, see MZ_BEST_SPEED, MZ_BEST_COMPRESSION, etc.) logically OR'd with zero or more mz_zip_flags, or just set to MZ_DEFAULT_COMPRESSION.
   mz_bool mz_zip_writer_add_mem_ex(mz_zip_archive *pZip, const char *pArchive_name, const void *pBuf, size_t buf_size, const void *pComment, mz_uint16 comment_size, const char* location);
 
+  // Adds buf_size bytes that are already compressed with method (0 for store or MZ_DEFLATED) and decompress to uncomp_size bytes with the given CRC-32.
+  // The modification time is taken from the file at location.
+  mz_bool mz_zip_writer_add_compressed_mem(mz_zip_archive *pZip, const char *pArchive_name, const void *pBuf, size_t buf_size, mz_uint64 uncomp_size, mz_uint32 uncomp_crc32, mz_uint16 method, const void *pComment, mz_uint16 comment_size, const char* location);
+
   // Finalizes the archive by writing the central directory records followed by the end of central directory record.
   // After an archive is finalized, the only valid call on the mz_zip_archive struct is mz_zip_writer_end().
   // An archive must be manually finalized by calling this function for it to be valid.
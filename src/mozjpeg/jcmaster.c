@@ -802,8 +802,10 @@ select_scans (j_compress_ptr cinfo, int next_scan_number)
     
     /* free the memory allocated for buffers */
     for (i = 0; i < cinfo->num_scans; i++)
-      if (master->scan_buffer[i])
+      if (master->scan_buffer[i]) {
         free(master->scan_buffer[i]);
+        master->scan_buffer[i] = NULL;
+      }
   }
 }
 
@@ -147,6 +147,9 @@ empty_mem_output_buffer (j_compress_ptr cinfo)
     free(dest->newbuffer);
 
   dest->newbuffer = nextbuffer;
+  /* Keep the caller's pointer current, so the buffer can still be freed if
+     the compressor exits with an error before term_mem_destination. */
+  *dest->outbuffer = nextbuffer;
 
   dest->pub.next_output_byte = nextbuffer + dest->bufsize;
   dest->pub.free_in_buffer = dest->bufsize;
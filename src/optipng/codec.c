@@ -26,7 +26,7 @@
  * See cexcept.h for more info
  */
 define_exception_type(const char *);
-static struct exception_context the_exception_context[1];
+static _Thread_local struct exception_context the_exception_context[1];
 
 /*
  * The chunk signatures recognized and handled by this codec.
@@ -32,6 +32,7 @@
 #include "image.h"
 #include "../support.h"
 #include "../main.h"
+#include "../stats.h"
 
 //The user options structure
 struct opng_options
@@ -153,7 +154,11 @@ static int opng_write_file(struct opng_session *session, FILE *stream, int filte
                             &session->out_stats,
                             session->transformer);
     context.no_write = no_write;
-    return opng_encode_image(&context, filter, stream, session->Outfile, mode);
+    ECTStatsTimer timer;
+    ECT_StatsStart(&timer);
+    int result = opng_encode_image(&context, filter, stream, session->Outfile, mode);
+    ECT_StatsStop(&timer, ECT_STAGE_OPTIPNG_TRIAL, 0, session->out_stats.idat_size, 0);
+    return result;
 }
 
 // PNG file copying
@@ -306,7 +311,11 @@ int Optipng(unsigned level, const char * Infile, bool force_no_palette, unsigned
   options.clean_alpha = clean_alpha;
   the_optimizer->options = options;
   the_optimizer->transformer = the_transformer;
+  ECTStatsTimer timer;
+  ECT_StatsStart(&timer);
+  long long insize = filesize(Infile);
   int val = opng_optimize_file(the_optimizer, Infile, force_no_palette);
+  ECT_StatsStop(&timer, ECT_STAGE_OPTIPNG, insize < 0 ? 0 : insize, 0, 0);
   free(the_optimizer);
   free(the_transformer);
   return val;
@@ -0,0 +1,337 @@
+//  serve.cpp
+//  Efficient Compression Tool
+//
+//  Server mode: reads jobs from stdin and writes results to stdout, so the
+//  process, its threads and allocations stay alive across many files.
+//
+//  Request:  <id> <type> <length> [options...]\n followed by length bytes of payload
+//            type is "file" (payload is a path that is optimized in place) or one of
+//            "png", "jpeg", "gzip", "zlib", "zip" (payload is the data itself)
+//  Response: <id> <ok|error|nomem> <insize> <outsize> <ms>\n followed by outsize
+//            bytes of output for successful data jobs
+//
+//  Jobs run concurrently and responses are written as jobs finish, not in request order.
+//  Payloads larger than the configured maximum are skipped and answered with an error.
+
+#include "main.h"
+#include "support.h"
+#include "libect.h"
+#include <chrono>
+#include <deque>
+#include <new>
+#include <utility>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#define dup _dup
+#define dup2 _dup2
+#define fileno _fileno
+#define fdopen _fdopen
+#endif
+
+#ifndef NOMULTI
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
+struct ServeJob{
+    std::string id;
+    std::string type;
+    std::vector<std::string> flags;
+    std::vector<unsigned char> payload;
+    //Status of a job whose payload wasn't read, 0 otherwise
+    const char* rejected;
+};
+
+static FILE* response_stream;
+#ifndef NOMULTI
+static std::mutex response_mutex;
+#endif
+
+static void Respond(const ServeJob& job, const char* status, size_t insize, const unsigned char* out, size_t outsize, long long ms){
+#ifndef NOMULTI
+    std::lock_guard<std::mutex> lock(response_mutex);
+#endif
+    fprintf(response_stream, "%s %s %zu %zu %lld\n", job.id.c_str(), status, insize, outsize, ms);
+    if(out && outsize){
+        fwrite(out, 1, outsize, response_stream);
+    }
+    fflush(response_stream);
+}
+
+static ECTLibOptions ToLibOptions(const ECTOptions& Options){
+    ECTLibOptions options;
+    options.Mode = Options.Mode;
+    options.palette_sort = Options.palette_sort >> 8;
+    options.strip = Options.strip;
+    options.Progressive = Options.Progressive;
+    options.Strict = Options.Strict;
+    options.Arithmetic = Options.Arithmetic;
+    options.Reuse = Options.Reuse;
+    options.Allfilters = Options.Allfilters;
+    options.Allfiltersbrute = Options.Allfiltersbrute;
+    options.Allfilterscheap = Options.Allfilterscheap;
+    options.DeflateMultithreading = Options.DeflateMultithreading;
+    options.Threads = Options.Threads;
+    return options;
+}
+
+//Optimizes a file in place, returns 0 on success.
+static int RunFileJob(const std::string& path, const ECTOptions& Options, size_t* insize, size_t* outsize){
+    long long size = filesize(path.c_str());
+    if(size < 0 || isDirectory(path.c_str())){
+        return 1;
+    }
+    *insize = size;
+    if(Options.Zip){
+        if(!IsZIP(path.c_str())){
+            return 1;
+        }
+        size_t files = 0;
+        ReZipFile(path.c_str(), Options, &files);
+        *outsize = filesize(path.c_str());
+        return 0;
+    }
+    bool gzipped = Options.Gzip && !IsGzip(path.c_str());
+    if(fileHandler(path.c_str(), Options, 0)){
+        return 1;
+    }
+    long long newsize = filesize(gzipped ? (path + ".gz").c_str() : path.c_str());
+    if(newsize < 0){
+        return 1;
+    }
+    *outsize = newsize;
+    return 0;
+}
+
+static void RunJob(const ServeJob& job, const ECTOptions& BaseOptions){
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ECTOptions Options = BaseOptions;
+    const char* status = "error";
+    size_t insize = job.payload.size();
+    size_t outsize = 0;
+    unsigned char* out = 0;
+
+    bool valid = true;
+    for(unsigned i = 0; i < job.flags.size(); i++){
+        if(ParseOption(job.flags[i].c_str(), Options)){
+            fprintf(stderr, "%s: Unknown flag: %s\n", job.id.c_str(), job.flags[i].c_str());
+            valid = false;
+        }
+    }
+    Options.SavingsCounter = false;
+    if(Options.Reuse){
+        Options.Allfilters = 0;
+    }
+
+    try {
+        if(!valid){}
+        else if(job.type == "file"){
+            std::string path(job.payload.begin(), job.payload.end());
+            insize = 0;
+            if(!RunFileJob(path, Options, &insize, &outsize)){
+                status = "ok";
+            }
+        }
+        else{
+            ECTLibOptions options = ToLibOptions(Options);
+            int (*optimize)(const unsigned char*, size_t, const ECTLibOptions*, unsigned char**, size_t*) = 0;
+            if(job.type == "png"){optimize = ECT_OptimizePNG;}
+            else if(job.type == "jpeg" || job.type == "jpg"){optimize = ECT_OptimizeJPEG;}
+            else if(job.type == "gzip"){optimize = ECT_Gzip;}
+            else if(job.type == "zlib"){optimize = ECT_Zlib;}
+            else if(job.type == "zip"){optimize = ECT_OptimizeZIP;}
+            else {fprintf(stderr, "%s: Unknown job type: %s\n", job.id.c_str(), job.type.c_str());}
+            if(optimize){
+                int res = optimize(job.payload.data(), job.payload.size(), &options, &out, &outsize);
+                status = res == ECT_OK ? "ok" : res == ECT_OUT_OF_MEMORY ? "nomem" : "error";
+                if(res != ECT_OK){
+                    outsize = 0;
+                }
+            }
+        }
+    }
+    catch (std::bad_alloc&) {
+        status = "nomem";
+        outsize = 0;
+    }
+
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    Respond(job, status, insize, out, outsize, ms);
+    ECT_Free(out);
+}
+
+//Reads and drops a payload that isn't processed, so the next request header is found.
+static bool SkipPayload(unsigned long long length){
+    char buf[65536];
+    while(length){
+        size_t len = length < sizeof(buf) ? length : sizeof(buf);
+        if(fread(buf, 1, len, stdin) != len){
+            return false;
+        }
+        length -= len;
+    }
+    return true;
+}
+
+//Reads a request header, returns 0 on EOF and -1 if it is malformed.
+static int ReadJob(ServeJob* job, unsigned long long max_payload){
+    std::string line;
+    int c;
+    while((c = getchar()) != EOF && c != '\n'){
+        if(line.size() > 65536){
+            return -1;
+        }
+        line.push_back(c);
+    }
+    if(c == EOF && line.empty()){
+        return 0;
+    }
+    if(!line.empty() && line.back() == '\r'){
+        line.pop_back();
+    }
+
+    std::vector<std::string> tokens;
+    size_t pos = 0;
+    while(pos < line.size()){
+        size_t end = line.find(' ', pos);
+        if(end == std::string::npos){
+            end = line.size();
+        }
+        if(end > pos){
+            tokens.push_back(line.substr(pos, end - pos));
+        }
+        pos = end + 1;
+    }
+    if(tokens.size() < 3){
+        return -1;
+    }
+    char* endptr;
+    unsigned long long length = strtoull(tokens[2].c_str(), &endptr, 10);
+    if(*endptr || tokens[2][0] == '-'){
+        return -1;
+    }
+    job->id = tokens[0];
+    job->type = tokens[1];
+    job->flags.assign(tokens.begin() + 3, tokens.end());
+    job->rejected = 0;
+    if(length > max_payload){
+        fprintf(stderr, "%s: Payload of %llu bytes exceeds the limit of %llu\n", job->id.c_str(), length, max_payload);
+        job->rejected = "error";
+    }
+    else{
+        try {
+            job->payload.resize(length);
+        }
+        catch (std::bad_alloc&) {
+            job->rejected = "nomem";
+        }
+    }
+    if(job->rejected){
+        job->payload.clear();
+        return SkipPayload(length) ? 1 : -1;
+    }
+    if(length && fread(job->payload.data(), 1, length, stdin) != length){
+        return -1;
+    }
+    return 1;
+}
+
+int Serve(const ECTOptions& Options, unsigned threads, unsigned long long max_payload){
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    //Responses get a private copy of stdout, messages printed by the optimizers go to stderr
+    fflush(stdout);
+    int fd = dup(fileno(stdout));
+    if(fd < 0 || !(response_stream = fdopen(fd, "wb"))){
+        fprintf(stderr, "ECT: can't open response stream\n");
+        return 1;
+    }
+    dup2(fileno(stderr), fileno(stdout));
+
+    int error = 0;
+#ifndef NOMULTI
+    if(!threads){
+        threads = std::thread::hardware_concurrency();
+    }
+    if(threads < 1){
+        threads = 1;
+    }
+    //Jobs run side by side, so each gets its share of the threads for its PNG trials
+    ECTOptions JobOptions = Options;
+    unsigned budget = Options.Threads ? Options.Threads : std::thread::hardware_concurrency();
+    JobOptions.Threads = budget / threads > 1 ? budget / threads : 1;
+    //The reader waits while this many jobs are pending, which bounds the memory held by payloads
+    size_t max_pending = threads * 2;
+    std::deque<ServeJob> queue;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::condition_variable space_cv;
+    bool done = false;
+
+    std::vector<std::thread> workers;
+    for(unsigned i = 0; i < threads; i++){
+        workers.push_back(std::thread([&]{
+            while(true){
+                ServeJob job;
+                {
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    queue_cv.wait(lock, [&]{return done || !queue.empty();});
+                    if(queue.empty()){
+                        return;
+                    }
+                    job = std::move(queue.front());
+                    queue.pop_front();
+                }
+                space_cv.notify_one();
+                RunJob(job, JobOptions);
+            }
+        }));
+    }
+#else
+    (void)threads;
+#endif
+
+    while(true){
+        ServeJob job;
+        int res = ReadJob(&job, max_payload);
+        if(res < 0){
+            fprintf(stderr, "ECT: malformed request\n");
+            error = 1;
+        }
+        if(res <= 0){
+            break;
+        }
+        if(job.rejected){
+            Respond(job, job.rejected, 0, 0, 0, 0);
+            continue;
+        }
+#ifndef NOMULTI
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            space_cv.wait(lock, [&]{return queue.size() < max_pending;});
+            queue.push_back(std::move(job));
+        }
+        queue_cv.notify_one();
+#else
+        RunJob(job, Options);
+#endif
+    }
+
+#ifndef NOMULTI
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        done = true;
+    }
+    queue_cv.notify_all();
+    for(unsigned i = 0; i < workers.size(); i++){
+        workers[i].join();
+    }
+#endif
+    fclose(response_stream);
+    return error;
+}
@@ -0,0 +1,490 @@
+//
+//  stats.cpp
+//  Efficient Compression Tool
+//
+//  Collects the numbers printed by --stats and writes --json-log and --trace, see stats.h.
+//
+
+#include "stats.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#ifndef NOMULTI
+#include <mutex>
+#endif
+
+namespace {
+
+struct StageTotals {
+    size_t calls;
+    double wall;
+    double cpu;
+    unsigned long long in;
+    unsigned long long out;
+    unsigned long long count;
+};
+
+struct FileTotals {
+    size_t files;
+    double wall;
+    double cpu;
+    unsigned long long in;
+    unsigned long long out;
+};
+
+//Threads come and go with every parallel section, so their numbers are collected per lane: a thread takes the
+//lowest lane no running thread uses. Lane i then shows the work of the i-th thread of each parallel section.
+struct Lane {
+    StageTotals stages[ECT_STAGES];
+    size_t index;
+    size_t threads;
+    double cpu;  //Of the threads that finished
+    bool busy;
+};
+
+struct LaneHandle {
+    Lane* lane;
+    ~LaneHandle();
+};
+
+//File a worker thread inherited and its CPU time when it did
+struct FileHandle {
+    unsigned long long file;
+    double cpu;
+    ~FileHandle();
+};
+
+const char* const stage_names[ECT_STAGES] = {"optipng", "optipng trial", "png trial", "palette rank", "png filter", "block split", "squeeze", "match finder", "mozjpegtran"};
+const char* const count_names[ECT_STAGES] = {"", "", "", "", "rows", "blocks", "", "lookups", "progressive"};
+const char* const type_names[ECT_FILE_TYPES] = {"PNG", "JPEG", "GZIP", "ZIP"};
+const char* const filter_names[16] = {"zero", "sub", "up", "average", "paeth", "brute force", "predefined", "entropy",
+    "distinct bigrams", "distinct bytes", "minsum", "incremental", "incremental2", "incremental3", "genetic", "all cheap"};
+
+bool enabled;
+FileTotals files[ECT_FILE_TYPES];
+std::vector<Lane*> lanes;
+#ifndef NOMULTI
+std::mutex lanes_mutex;
+#endif
+thread_local LaneHandle current = {0};
+FILE* jsonlog;
+FILE* trace;
+double trace_origin;
+bool trace_empty = true;
+#ifndef NOMULTI
+std::mutex jsonlog_mutex;
+std::mutex trace_mutex;
+#endif
+//CPU time of the exited worker threads of the files being logged
+std::map<unsigned long long, double> workercpu;
+unsigned long long lastfile;
+#ifndef NOMULTI
+std::mutex workercpu_mutex;
+#endif
+thread_local unsigned long long currentfile;
+thread_local FileHandle inherited = {0, 0};
+
+double WallTime(){
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double CPUTime(bool process){
+#if defined(CLOCK_THREAD_CPUTIME_ID) && defined(CLOCK_PROCESS_CPUTIME_ID)
+    timespec ts;
+    if(!clock_gettime(process ? CLOCK_PROCESS_CPUTIME_ID : CLOCK_THREAD_CPUTIME_ID, &ts)){
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+    }
+#endif
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+LaneHandle::~LaneHandle(){
+    if(lane){
+        double cpu = CPUTime(false);
+#ifndef NOMULTI
+        std::lock_guard<std::mutex> lock(lanes_mutex);
+#endif
+        lane->cpu += cpu;
+        lane->busy = false;
+    }
+}
+
+FileHandle::~FileHandle(){
+    if(file){
+        double used = CPUTime(false) - cpu;
+#ifndef NOMULTI
+        std::lock_guard<std::mutex> lock(workercpu_mutex);
+#endif
+        std::map<unsigned long long, double>::iterator it = workercpu.find(file);
+        if(it != workercpu.end()){
+            it->second += used;
+        }
+    }
+}
+
+//Returns the CPU time of the worker threads of the file, which also counts for the file it is nested in
+double FinishFile(const ECTStatsTimer* timer){
+    double cpu = 0;
+    if(timer->file){
+#ifndef NOMULTI
+        std::lock_guard<std::mutex> lock(workercpu_mutex);
+#endif
+        std::map<unsigned long long, double>::iterator it = workercpu.find(timer->file);
+        if(it != workercpu.end()){
+            cpu = it->second;
+            workercpu.erase(it);
+        }
+        it = workercpu.find(timer->parent);
+        if(it != workercpu.end()){
+            it->second += cpu;
+        }
+    }
+    currentfile = timer->parent;
+    return cpu;
+}
+
+Lane* CurrentLane(){
+    if(!current.lane){
+#ifndef NOMULTI
+        std::lock_guard<std::mutex> lock(lanes_mutex);
+#endif
+        for(size_t i = 0; i < lanes.size() && !current.lane; i++){
+            if(!lanes[i]->busy){
+                current.lane = lanes[i];
+            }
+        }
+        if(!current.lane){
+            current.lane = new Lane();
+            current.lane->index = lanes.size();
+            lanes.push_back(current.lane);
+        }
+        current.lane->busy = true;
+        current.lane->threads++;
+    }
+    return current.lane;
+}
+
+//Peak resident memory of the process so far in KB, 0 if unknown
+long PeakMemory(){
+#ifndef _WIN32
+    rusage usage;
+    if(!getrusage(RUSAGE_SELF, &usage)){
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return 0;
+}
+
+//Length of the UTF-8 sequence at str, 0 if it is invalid
+size_t UTF8Length(const unsigned char* str){
+    unsigned c = str[0];
+    size_t len;
+    unsigned min;
+    if(c < 0x80){
+        return 1;
+    }
+    else if(c >= 0xC2 && c < 0xE0){
+        len = 2;
+        min = 0x80;
+        c &= 0x1F;
+    }
+    else if(c >= 0xE0 && c < 0xF0){
+        len = 3;
+        min = 0x800;
+        c &= 0x0F;
+    }
+    else if(c >= 0xF0 && c < 0xF5){
+        len = 4;
+        min = 0x10000;
+        c &= 0x07;
+    }
+    else{
+        return 0;
+    }
+    for(size_t i = 1; i < len; i++){
+        if((str[i] & 0xC0) != 0x80){
+            return 0;
+        }
+        c = c << 6 | (str[i] & 0x3F);
+    }
+    if(c < min || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000)){
+        return 0;
+    }
+    return len;
+}
+
+//Paths aren't always UTF-8, bytes of invalid sequences are written as \u00XX
+std::string JSONString(const char* str){
+    const unsigned char* s = (const unsigned char*)str;
+    std::string out = "\"";
+    while(*s){
+        unsigned char c = *s;
+        size_t len = UTF8Length(s);
+        if(c == '"' || c == '\\'){
+            out += '\\';
+            out += c;
+            s++;
+        }
+        else if(c < 0x20 || !len){
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+            s++;
+        }
+        else{
+            out.append((const char*)s, len);
+            s += len;
+        }
+    }
+    return out + "\"";
+}
+
+//Writes a complete event, name and args must be JSON. Threads are shown as lanes like in --stats, so a
+//thread of the viewer is a slot of the parallel sections rather than one of their short lived threads.
+void TraceEvent(const std::string& name, const char* category, double start, double end, const char* args){
+    char buf[512];
+    snprintf(buf, sizeof(buf), ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{%s}}",
+             category, CurrentLane()->index, (start - trace_origin) * 1e6, (end - start) * 1e6, args);
+#ifndef NOMULTI
+    std::lock_guard<std::mutex> lock(trace_mutex);
+#endif
+    fputs(trace_empty ? "[\n{\"name\":" : ",\n{\"name\":", trace);
+    fputs(name.c_str(), trace);
+    fputs(buf, trace);
+    trace_empty = false;
+}
+
+void FinishTrace(){
+    fputs(trace_empty ? "[]\n" : "\n]\n", trace);
+    fclose(trace);
+}
+
+void PrintStage(const char* name, const StageTotals& s, const char* countname){
+    //Stages only counted with ECT_StatsCount have no times or sizes
+    if(!s.wall && !s.in && !s.out){
+        printf("%-14s %9zu %11s %11s %11s %11s", name, s.calls, "-", "-", "-", "-");
+    }
+    else{
+        printf("%-14s %9zu %11.1f %11.1f %11.1f %11.1f", name, s.calls, s.wall * 1000, s.cpu * 1000, s.in / 1024.0, s.out / 1024.0);
+    }
+    if(*countname){
+        printf(" %11llu %s", s.count, countname);
+    }
+    printf("\n");
+}
+
+}
+
+void ECT_EnableStats(void){
+    enabled = true;
+}
+
+void ECT_StatsStart(ECTStatsTimer* timer){
+    if(enabled || trace){
+        timer->wall = WallTime();
+        timer->cpu = enabled ? CPUTime(false) : 0;
+    }
+}
+
+void ECT_StatsStop(const ECTStatsTimer* timer, enum ECTStage stage, size_t in, size_t out, size_t count){
+    if(enabled || trace){
+        double now = WallTime();
+        if(enabled){
+            StageTotals& s = CurrentLane()->stages[stage];
+            s.calls++;
+            s.wall += now - timer->wall;
+            s.cpu += CPUTime(false) - timer->cpu;
+            s.in += in;
+            s.out += out;
+            s.count += count;
+        }
+        if(trace){
+            char args[128];
+            snprintf(args, sizeof(args), "\"in\":%zu,\"out\":%zu,\"count\":%zu", in, out, count);
+            TraceEvent(std::string("\"") + stage_names[stage] + "\"", "stage", timer->wall, now, args);
+        }
+    }
+}
+
+void ECT_StatsCount(enum ECTStage stage, size_t count){
+    if(enabled){
+        StageTotals& s = CurrentLane()->stages[stage];
+        s.calls++;
+        s.count += count;
+    }
+}
+
+void ECT_StatsFileStart(ECTStatsTimer* timer){
+    if(enabled || jsonlog || trace){
+        timer->wall = WallTime();
+        timer->cpu = CPUTime(true);
+        timer->threadcpu = CPUTime(false);
+    }
+    timer->file = 0;
+    timer->parent = currentfile;
+    if(jsonlog){
+#ifndef NOMULTI
+        std::lock_guard<std::mutex> lock(workercpu_mutex);
+#endif
+        timer->file = ++lastfile;
+        workercpu[timer->file] = 0;
+        currentfile = timer->file;
+    }
+}
+
+void ECT_StatsFileStop(const ECTStatsTimer* timer, enum ECTFileType type, size_t in, size_t out){
+    if(enabled){
+#ifndef NOMULTI
+        std::lock_guard<std::mutex> lock(lanes_mutex);
+#endif
+        FileTotals& f = files[type];
+        f.files++;
+        f.wall += WallTime() - timer->wall;
+        f.cpu += CPUTime(true) - timer->cpu;
+        f.in += in;
+        f.out += out;
+    }
+}
+
+unsigned long long ECT_StatsCurrentFile(void){
+    return currentfile;
+}
+
+void ECT_StatsInheritFile(unsigned long long file){
+    if(file){
+        currentfile = file;
+        inherited.file = file;
+        inherited.cpu = CPUTime(false);
+    }
+}
+
+void ECT_StatsFileEnd(const ECTStatsTimer* timer){
+    FinishFile(timer);
+}
+
+void ECT_ReportStats(void){
+    if(!enabled){
+        return;
+    }
+    //The calling thread is still running, its lane only has the CPU time of the threads before it
+    const Lane* own = current.lane;
+    double owncpu = CPUTime(false);
+#ifndef NOMULTI
+    std::lock_guard<std::mutex> lock(lanes_mutex);
+#endif
+    printf("\n%-14s %9s %11s %11s %11s %11s\n", "File type", "files", "wall ms", "CPU ms", "in KB", "out KB");
+    for(unsigned t = 0; t < ECT_FILE_TYPES; t++){
+        if(files[t].files){
+            printf("%-14s %9zu %11.1f %11.1f %11.1f %11.1f\n", type_names[t], files[t].files, files[t].wall * 1000, files[t].cpu * 1000, files[t].in / 1024.0, files[t].out / 1024.0);
+        }
+    }
+
+    StageTotals totals[ECT_STAGES] = {};
+    printf("\n%-14s %9s %11s %11s %11s %11s %11s\n", "Stage", "calls", "wall ms", "CPU ms", "in KB", "out KB", "count");
+    for(unsigned k = 0; k < ECT_STAGES; k++){
+        StageTotals& total = totals[k];
+        for(size_t i = 0; i < lanes.size(); i++){
+            const StageTotals& s = lanes[i]->stages[k];
+            total.calls += s.calls;
+            total.wall += s.wall;
+            total.cpu += s.cpu;
+            total.in += s.in;
+            total.out += s.out;
+            total.count += s.count;
+        }
+        if(total.calls){
+            PrintStage(stage_names[k], total, count_names[k]);
+        }
+    }
+
+    if(lanes.size() > 1){
+        printf("\nCPU ms per thread, thread i is the i-th thread of each parallel section\n");
+        printf("%-14s %9s %11s", "Thread", "threads", "total");
+        for(unsigned k = 0; k < ECT_STAGES; k++){
+            if(totals[k].cpu > 0){
+                printf(" %14s", stage_names[k]);
+            }
+        }
+        printf("\n");
+        for(size_t i = 0; i < lanes.size(); i++){
+            const Lane* lane = lanes[i];
+            printf("%-14zu %9zu %11.1f", i, lane->threads, (lane->cpu + (lane == own ? owncpu : 0)) * 1000);
+            for(unsigned k = 0; k < ECT_STAGES; k++){
+                if(totals[k].cpu > 0){
+                    printf(" %14.1f", lane->stages[k].cpu * 1000);
+                }
+            }
+            printf("\n");
+        }
+    }
+}
+
+int ECT_OpenJSONLog(const char* path){
+    jsonlog = fopen(path, "ab");
+    return !jsonlog;
+}
+
+int ECT_JSONLogActive(void){
+    return jsonlog != 0;
+}
+
+int ECT_OpenTrace(const char* path){
+    trace = fopen(path, "wb");
+    if(!trace){
+        return 1;
+    }
+    trace_origin = WallTime();
+    atexit(FinishTrace);
+    return 0;
+}
+
+void ECT_LogFile(const ECTStatsTimer* timer, const ECTFileRecord* record){
+    if(trace){
+        char args[128];
+        snprintf(args, sizeof(args), "\"type\":\"%s\",\"in\":%lld,\"out\":%lld,\"error\":%u", type_names[record->type], record->in, record->out, record->error);
+        TraceEvent(JSONString(record->path), "file", timer->wall, WallTime(), args);
+    }
+    double workers = FinishFile(timer);
+    if(!jsonlog){
+        return;
+    }
+    double wall = WallTime() - timer->wall;
+    double cpu = CPUTime(false) - timer->threadcpu + workers;
+    std::string line = "{\"path\":" + JSONString(record->path);
+    if(record->archive){
+        line += ",\"archive\":" + JSONString(record->archive);
+    }
+    char buf[512];
+    snprintf(buf, sizeof(buf), ",\"type\":\"%s\",\"in\":%lld,\"out\":%lld", type_names[record->type], record->in, record->out);
+    line += buf;
+    if(record->filter >= 0 && record->filter < 16){
+        line += ",\"filter\":" + JSONString(filter_names[record->filter]);
+    }
+    if(record->colortype >= 0){
+        snprintf(buf, sizeof(buf), ",\"color_type\":%d,\"bit_depth\":%d", record->colortype, record->bitdepth);
+        line += buf;
+    }
+    if(record->progressive >= 0){
+        line += record->progressive ? ",\"progressive\":true" : ",\"progressive\":false";
+    }
+    snprintf(buf, sizeof(buf), ",\"mode\":%u,\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"process_peak_rss_kb\":%ld,\"error\":%u}\n",
+             record->mode, wall * 1000, cpu * 1000, PeakMemory(), record->error);
+    line += buf;
+#ifndef NOMULTI
+    std::lock_guard<std::mutex> lock(jsonlog_mutex);
+#endif
+    fwrite(line.data(), 1, line.size(), jsonlog);
+    fflush(jsonlog);
+}
@@ -0,0 +1,111 @@
+//
+//  stats.h
+//  Efficient Compression Tool
+//
+//  Per stage timing and counters printed by --stats, the per file records of --json-log and the timeline
+//  of --trace. Callable from the C parts of the compressors, all functions return immediately unless these
+//  options are given.
+//
+
+#ifndef __Efficient_Compression_Tool__stats__
+#define __Efficient_Compression_Tool__stats__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Stages nest, e.g. squeeze runs inside png trial, so their times overlap
+enum ECTStage {
+    ECT_STAGE_OPTIPNG,
+    ECT_STAGE_OPTIPNG_TRIAL,
+    ECT_STAGE_PNG_TRIAL,
+    ECT_STAGE_PALETTE_RANK,
+    ECT_STAGE_PNG_FILTER,
+    ECT_STAGE_BLOCKSPLIT,
+    ECT_STAGE_SQUEEZE,
+    ECT_STAGE_MATCHFINDER,
+    ECT_STAGE_JPEG,
+    ECT_STAGES
+};
+
+enum ECTFileType {
+    ECT_FILE_PNG,
+    ECT_FILE_JPEG,
+    ECT_FILE_GZIP,
+    ECT_FILE_ZIP,
+    ECT_FILE_TYPES
+};
+
+typedef struct ECTStatsTimer {
+    double wall;
+    double cpu;
+    double threadcpu;      //Set by ECT_StatsFileStart for ECT_LogFile
+    unsigned long long file;
+    unsigned long long parent;
+} ECTStatsTimer;
+
+void ECT_EnableStats(void);
+
+void ECT_StatsStart(ECTStatsTimer* timer);
+
+//Adds the time since ECT_StatsStart to the stage. in and out are byte counts, count is the stage specific
+//counter: rows for png filter, blocks for block split, lookups for match finder, progressive encodes for
+//JPEG.
+void ECT_StatsStop(const ECTStatsTimer* timer, enum ECTStage stage, size_t in, size_t out, size_t count);
+
+//Counts a call of an untimed stage
+void ECT_StatsCount(enum ECTStage stage, size_t count);
+
+//Like ECT_StatsStart/Stop for a whole file, which is timed with the CPU time of all threads. The timer is
+//also used by ECT_LogFile.
+void ECT_StatsFileStart(ECTStatsTimer* timer);
+void ECT_StatsFileStop(const ECTStatsTimer* timer, enum ECTFileType type, size_t in, size_t out);
+
+//Ends a file that isn't passed to ECT_LogFile
+void ECT_StatsFileEnd(const ECTStatsTimer* timer);
+
+//Threads working on a file call ECT_StatsInheritFile first with the ECT_StatsCurrentFile of the thread
+//that started them. Their CPU time is added to the --json-log record of the file when they exit.
+unsigned long long ECT_StatsCurrentFile(void);
+void ECT_StatsInheritFile(unsigned long long file);
+
+void ECT_ReportStats(void);
+
+//A line of --json-log, numbers that don't apply to the file are -1
+typedef struct ECTFileRecord {
+    const char* path;
+    const char* archive;   //Archive a ZIP entry was added to, or 0
+    enum ECTFileType type;
+    long long in;
+    long long out;
+    int filter;            //LodePNGFilterStrategy of the PNG that was written
+    int colortype;
+    int bitdepth;
+    int progressive;
+    unsigned mode;
+    unsigned error;
+} ECTFileRecord;
+
+//Starts appending --json-log to path, returns 1 if it can't be opened. Every record is flushed, so the log
+//is complete even if ECT is killed.
+int ECT_OpenJSONLog(const char* path);
+
+int ECT_JSONLogActive(void);
+
+//Starts writing a Chrome trace event file of the files and the timed stages to path, it is completed when
+//ECT exits. Returns 1 if the file can't be opened.
+int ECT_OpenTrace(const char* path);
+
+//Writes record with the time since ECT_StatsFileStart to --json-log and --trace. cpu_ms is the CPU time of
+//the calling thread and the threads that inherited the file, so files and ZIP entries optimized side by side
+//don't count each other's work. process_peak_rss_kb is the peak of the whole process so far, not of the
+//file, as the OS doesn't track memory per file.
+void ECT_LogFile(const ECTStatsTimer* timer, const ECTFileRecord* record);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* defined(__Efficient_Compression_Tool__stats__) */
@@ -43,6 +43,70 @@
 #define MOD28(a) a %= BASE
 #endif
 
+#ifdef Z_X86_SIMD
+#include <immintrin.h>
+
+/*
+ * Sums blocks of 32 bytes with SSSE3: psadbw adds up the bytes for adler,
+ * pmaddubsw weighs them by 32..1 for sum2, which also gets 32 times the
+ * adler before each block.  Chunks stay under NMAX bytes so one modulo per
+ * chunk is enough.
+ */
+__attribute__((target("ssse3")))
+static uLong adler32_ssse3(uLong adler, const Byte *buf, unsigned len)
+{
+    unsigned long sum2 = (adler >> 16) & 0xffff;
+    unsigned blocks = len / 32;
+    adler &= 0xffff;
+    len -= blocks * 32;
+
+    while (blocks) {
+        unsigned n = NMAX / 32;
+        if (n > blocks)
+            n = blocks;
+        blocks -= n;
+
+        const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+        const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi16(1);
+        __m128i v_ps = _mm_cvtsi32_si128((int)(adler * n)); /* adler before each block */
+        __m128i v_s2 = _mm_cvtsi32_si128((int)sum2);
+        __m128i v_s1 = zero;
+        do {
+            const __m128i bytes1 = _mm_loadu_si128((const __m128i *)buf);
+            const __m128i bytes2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+            v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+            buf += 32;
+        } while (--n);
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        /* add up the lanes */
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+        adler += (unsigned)_mm_cvtsi128_si32(v_s1);
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum2 = (unsigned)_mm_cvtsi128_si32(v_s2);
+        MOD(adler);
+        MOD(sum2);
+    }
+
+    if (len) {
+        while (len--) {
+            adler += *buf++;
+            sum2 += adler;
+        }
+        MOD(adler);
+        MOD(sum2);
+    }
+    return adler | (sum2 << 16);
+}
+#endif /* Z_X86_SIMD */
+
 /* ========================================================================= */
 uLong adler32(adler, buf, len)
     uLong adler;
@@ -71,6 +135,11 @@ uLong adler32(adler, buf, len)
     if (buf == Z_NULL)
         return 1L;
 
+#ifdef Z_X86_SIMD
+    if (len >= 64 && (x86_cpu_features() & Z_X86_SSSE3))
+        return adler32_ssse3(adler | (sum2 << 16), buf, len);
+#endif
+
     /* in case short lengths are provided, keep it somewhat fast */
     if (len < 16) {
         while (len--) {
@@ -699,6 +699,108 @@ int ZEXPORT deflateCopy (z_stream* dest, z_stream* source, unsigned char alloc)
   return Z_OK;
 }
 
+/* =========================================================================
+ * Checkpoints for size-only tests. Compressing len bytes inserts strings at
+ * positions below strstart + lookahead + len only, so only the prev entries
+ * and window bytes of that range and the head entries of their hashes change.
+ */
+struct deflate_checkpoint_s {
+    z_stream strm;
+    deflate_state state;
+    uint32_t start;     /* first position whose prev entry is saved */
+    uint32_t count;     /* number of saved prev entries */
+    uint32_t wstart;    /* first saved window byte */
+    uint32_t wcount;    /* number of saved window bytes */
+    uint32_t maxlen;
+    Pos *prev;
+    uint8_t *window;
+};
+
+deflate_checkpoint* ZEXPORT deflateCheckpointAlloc (z_streamp strm, unsigned maxlen)
+{
+    deflate_checkpoint *cp;
+    if (strm == Z_NULL || strm->state == Z_NULL) return Z_NULL;
+    cp = (deflate_checkpoint *)malloc(sizeof(deflate_checkpoint));
+    if (cp == Z_NULL) return Z_NULL;
+    cp->maxlen = maxlen;
+    cp->prev = (Pos *)malloc((maxlen + 2 * MIN_LOOKAHEAD) * sizeof(Pos));
+    cp->window = (uint8_t *)malloc(maxlen + 2 * MIN_LOOKAHEAD);
+    if (cp->prev == Z_NULL || cp->window == Z_NULL) {
+        deflateCheckpointFree(cp);
+        return Z_NULL;
+    }
+    return cp;
+}
+
+void ZEXPORT deflateCheckpointFree (deflate_checkpoint* cp)
+{
+    if (cp == Z_NULL) return;
+    free(cp->prev);
+    free(cp->window);
+    free(cp);
+}
+
+int ZEXPORT deflateCheckpoint (z_streamp strm, deflate_checkpoint* cp, unsigned len)
+{
+    deflate_state *s = strm->state;
+    uint64_t end = (uint64_t)s->strstart + s->lookahead + len;
+
+    /* A slide rewrites the whole hash table */
+    if (len > cp->maxlen || s->lookahead >= MIN_LOOKAHEAD || s->insert >= MIN_LOOKAHEAD ||
+        len + 2 * MIN_LOOKAHEAD >= s->w_size || end >= s->w_size + MAX_DIST(s)) {
+        return Z_BUF_ERROR;
+    }
+    memcpy(&cp->strm, strm, sizeof(z_stream));
+    memcpy(&cp->state, s, sizeof(deflate_state));
+
+    cp->start = s->strstart - s->insert;
+    cp->count = (uint32_t)(end - cp->start);
+    {
+        uint32_t i;
+        for (i = 0; i < cp->count; i++) {
+            cp->prev[i] = s->prev[(cp->start + i) & s->w_mask];
+        }
+    }
+
+    /* new input and the WIN_INIT zeroed bytes behind it */
+    cp->wstart = s->strstart + s->lookahead;
+    cp->wcount = len + WIN_INIT;
+    if (cp->wcount > s->window_size - cp->wstart) cp->wcount = s->window_size - cp->wstart;
+    memcpy(cp->window, s->window + cp->wstart, cp->wcount);
+    return Z_OK;
+}
+
+void ZEXPORT deflateRollback (z_streamp strm, deflate_checkpoint* cp)
+{
+    deflate_state *s = strm->state;
+    uint32_t end = cp->start + cp->count;
+    uint32_t i;
+
+    /* Strings were inserted in increasing order, undo them newest first:
+     * the prev entry of an inserted string holds the head it replaced.
+     */
+    for (i = end; i-- > cp->start;) {
+        uint32_t h;
+        if (i + MIN_MATCH > s->window_size) continue;
+#ifdef __SSE4_2__
+        h = x86_compute_hash(s, &s->window[i]);
+#else
+        INIT_HASH(s, h, &s->window[i]);
+        UPDATE_HASH(s, h, &s->window[i + 2]);
+#endif
+        if (s->head[h] == (Pos)i) {
+            s->head[h] = s->prev[i & s->w_mask];
+        }
+    }
+    for (i = 0; i < cp->count; i++) {
+        s->prev[(cp->start + i) & s->w_mask] = cp->prev[i];
+    }
+    memcpy(s->window + cp->wstart, cp->window, cp->wcount);
+
+    memcpy(strm, &cp->strm, sizeof(z_stream));
+    memcpy(s, &cp->state, sizeof(deflate_state));
+}
+
 /* ===========================================================================
  * Read a new buffer from the current input stream, update the adler32
  * and total number of bytes read.  All deflate() input goes through
@@ -124,7 +124,7 @@
 
 /* default i/o buffer size -- double this for output when reading (this and
    twice this must be able to fit in an unsigned type) */
-#define GZBUFSIZE 8192
+#define GZBUFSIZE 131072 /* ungz() reads whole files, fewer read() calls */
 
 /* gzip modes, also provide a little integrity check on the passed structure */
 #define GZ_NONE 0
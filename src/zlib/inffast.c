@@ -24,8 +24,8 @@
    Entry assumptions:
 
         state->mode == LEN
-        strm->avail_in >= 6
-        strm->avail_out >= 258
+        strm->avail_in >= INFLATE_FAST_MIN_INPUT
+        strm->avail_out >= INFLATE_FAST_MIN_OUTPUT
         start >= strm->avail_out
         state->bits < 8
 
@@ -79,7 +79,7 @@ void ZLIB_INTERNAL inflate_fast(z_streamp strm, unsigned start /* inflate()'s st
     /* copy state to local variables */
     state = (struct inflate_state *)strm->state;
     in = strm->next_in - OFF;
-    last = in + (strm->avail_in - 5);
+    last = in + (strm->avail_in - (INFLATE_FAST_MIN_INPUT - 1));
     out = strm->next_out - OFF;
     beg = out - (start - strm->avail_out);
     end = out + (strm->avail_out - 257);
@@ -100,12 +100,26 @@ void ZLIB_INTERNAL inflate_fast(z_streamp strm, unsigned start /* inflate()'s st
     /* decode literals and length/distances until end-of-block or not enough
        input data or output space */
     do {
+#ifdef INFLATE_FAST64
+        /* load the next eight bytes whole, keeping at least 56 bits, which is
+           enough for a length/distance pair without further refills.  The
+           bits above bits in hold are from the next byte and get or'ed in
+           again by the following refill. */
+        if (bits < 48) {
+            unsigned long next;
+            zmemcpy(&next, in + OFF, 8);
+            hold |= next << bits;
+            in += (63 - bits) >> 3;
+            bits |= 56;
+        }
+#else
         if (bits < 15) {
             hold += (unsigned long)(PUP(in)) << bits;
             bits += 8;
             hold += (unsigned long)(PUP(in)) << bits;
             bits += 8;
         }
+#endif
         here = lcode[hold & lmask];
       dolen:
         op = (unsigned)(here.bits);
@@ -119,20 +133,24 @@ void ZLIB_INTERNAL inflate_fast(z_streamp strm, unsigned start /* inflate()'s st
             len = (unsigned)(here.val);
             op &= 15;                           /* number of extra bits */
             if (op) {
+#ifndef INFLATE_FAST64
                 if (bits < op) {
                     hold += (unsigned long)(PUP(in)) << bits;
                     bits += 8;
                 }
+#endif
                 len += (unsigned)hold & ((1U << op) - 1);
                 hold >>= op;
                 bits -= op;
             }
+#ifndef INFLATE_FAST64
             if (bits < 15) {
                 hold += (unsigned long)(PUP(in)) << bits;
                 bits += 8;
                 hold += (unsigned long)(PUP(in)) << bits;
                 bits += 8;
             }
+#endif
             here = dcode[hold & dmask];
           dodist:
             op = (unsigned)(here.bits);
@@ -142,6 +160,7 @@ void ZLIB_INTERNAL inflate_fast(z_streamp strm, unsigned start /* inflate()'s st
             if (op & 16) {                      /* distance base */
                 dist = (unsigned)(here.val);
                 op &= 15;                       /* number of extra bits */
+#ifndef INFLATE_FAST64
                 if (bits < op) {
                     hold += (unsigned long)(PUP(in)) << bits;
                     bits += 8;
@@ -150,6 +169,7 @@ void ZLIB_INTERNAL inflate_fast(z_streamp strm, unsigned start /* inflate()'s st
                         bits += 8;
                     }
                 }
+#endif
                 dist += (unsigned)hold & ((1U << op) - 1);
 #ifdef INFLATE_STRICT
                 if (dist > dmax) {
@@ -244,6 +264,25 @@ void ZLIB_INTERNAL inflate_fast(z_streamp strm, unsigned start /* inflate()'s st
                 }
                 else {
                     from = out - dist;          /* copy direct from output */
+#ifdef INFLATE_FAST64
+                    /* eight bytes at a time may write up to seven bytes past
+                       the match, so only when the output has room for it */
+                    if (dist >= 8 && len + 7 <= (unsigned)(end - out) + 257) {
+                        unsigned char *stop = out + len;
+                        do {
+                            zmemcpy(out + OFF, from + OFF, 8);
+                            out += 8;
+                            from += 8;
+                        } while (out < stop);
+                        out = stop;
+                        continue;
+                    }
+                    if (dist == 1) {            /* run of the last byte */
+                        memset(out + OFF, *out, len);
+                        out += len;
+                        continue;
+                    }
+#endif
                     do {                        /* minimum length is three */
                         PUP(out) = PUP(from);
                         PUP(out) = PUP(from);
@@ -291,7 +330,8 @@ void ZLIB_INTERNAL inflate_fast(z_streamp strm, unsigned start /* inflate()'s st
     /* update state and return */
     strm->next_in = in + OFF;
     strm->next_out = out + OFF;
-    strm->avail_in = (unsigned)(in < last ? 5 + (last - in) : 5 - (in - last));
+    strm->avail_in = (unsigned)(in < last ? (INFLATE_FAST_MIN_INPUT - 1) + (last - in) :
+                                (INFLATE_FAST_MIN_INPUT - 1) - (in - last));
     strm->avail_out = (unsigned)(out < end ?
                                  257 + (end - out) : 257 - (out - end));
     state->hold = hold;
@@ -8,4 +8,17 @@
    subject to change. Applications should only use zlib.h.
  */
 
+/* On 64-bit little endian targets inflate_fast() refills the bit buffer
+   eight bytes at a time and copies matches in eight byte chunks, which needs
+   a little more input and output than the byte at a time version. */
+#if defined(__LP64__) && (defined(__x86_64__) || defined(__aarch64__)) && \
+    defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define INFLATE_FAST64
+#  define INFLATE_FAST_MIN_INPUT 8
+#  define INFLATE_FAST_MIN_OUTPUT 258
+#else
+#  define INFLATE_FAST_MIN_INPUT 6
+#  define INFLATE_FAST_MIN_OUTPUT 258
+#endif
+
 void ZLIB_INTERNAL inflate_fast (z_streamp strm, unsigned start);
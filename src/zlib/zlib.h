@@ -593,6 +593,20 @@ ZEXTERN int ZEXPORT deflateCopy OF((z_streamp dest, z_streamp source, unsigned c
  destination.
  */
 
+typedef struct deflate_checkpoint_s deflate_checkpoint;
+ZEXTERN deflate_checkpoint* ZEXPORT deflateCheckpointAlloc OF((z_streamp strm, unsigned maxlen));
+ZEXTERN void ZEXPORT deflateCheckpointFree OF((deflate_checkpoint* cp));
+ZEXTERN int ZEXPORT deflateCheckpoint OF((z_streamp strm, deflate_checkpoint* cp, unsigned len));
+ZEXTERN void ZEXPORT deflateRollback OF((z_streamp strm, deflate_checkpoint* cp));
+/*
+ Cheap alternative to deflateCopy for size-only tests with deflate_nooutput:
+ deflateCheckpoint saves only the parts of the state that compressing up to
+ len more bytes can change, deflateRollback restores them afterwards. len must
+ not exceed the maxlen given to deflateCheckpointAlloc. deflateCheckpoint
+ returns Z_BUF_ERROR if the test could slide the window, use deflateCopy then.
+ The pending buffer is not saved, so the stream must not produce output.
+ */
+
 ZEXTERN int ZEXPORT deflateReset OF((z_streamp strm));
 /*
      This function is equivalent to deflateEnd followed by deflateInit,
@@ -28,3 +28,22 @@ void ZLIB_INTERNAL zcfree (void* opaque, void* ptr)
     (void)opaque;
     free(ptr);
 }
+
+#ifdef Z_X86_SIMD
+#include <cpuid.h>
+
+int ZLIB_INTERNAL x86_cpu_features(void)
+{
+    static int features = -1;
+    if (features < 0) {
+        unsigned eax, ebx, ecx, edx;
+        int found = 0;
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+            if ((ecx & bit_PCLMUL) && (ecx & bit_SSE4_1)) found |= Z_X86_PCLMUL;
+            if (ecx & bit_SSSE3) found |= Z_X86_SSSE3;
+        }
+        features = found;
+    }
+    return features;
+}
+#endif
@@ -220,4 +220,12 @@ extern z_const char * const z_errmsg[10]; /* indexed by 2-zlib_error */
 #define ZSWAP32(q) ((((q) >> 24) & 0xff) + (((q) >> 8) & 0xff00) + \
                     (((q) & 0xff00) << 8) + (((q) & 0xff) << 24))
 
+/* x86 features for the checksum kernels in crc32.c and adler32.c, checked once */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define Z_X86_SIMD
+#  define Z_X86_PCLMUL 1 /* PCLMULQDQ and SSE4.1 */
+#  define Z_X86_SSSE3  2
+   int ZLIB_INTERNAL x86_cpu_features OF((void));
+#endif
+
 #endif /* ZUTIL_H */
@@ -28,6 +28,7 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "deflate.h"
 #include "lz77.h"
 #include "util.h"
+#include "../stats.h"
 
 typedef struct SplitCostContext {
   const unsigned short* litlens;
@@ -232,7 +233,7 @@ static void ZopfliBlockSplitLZ77(const unsigned short* litlens,
   size_t llpos;
   int splittingleft = 0;
   unsigned char* done = (unsigned char*)calloc(llsize, 1);
-  if (!done) exit(1); /* Allocation failed. */
+  if (!done) ZopfliOutOfMemory(); /* Allocation failed. */
   size_t lstart = 0;
   size_t lend = llsize;
   for (;;) {
@@ -290,6 +291,8 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
   size_t nlz77points = 0;
   size_t prevpoints = *npoints;
   ZopfliLZ77Store store;
+  ECTStatsTimer timer;
+  ECT_StatsStart(&timer);
 
   /* Unintuitively, Using a simple LZ77 method here instead of ZopfliLZ77Optimal
   results in better blocks. */
@@ -310,6 +313,7 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
     *stats = (SymbolStats*)malloc(sizeof(SymbolStats));
     GetStatistics(&store, *stats);
     ZopfliCleanLZ77Store(&store);
+    ECT_StatsStop(&timer, ECT_STAGE_BLOCKSPLIT, inend - instart, 0, 1);
     return;
   }
 
@@ -317,7 +321,7 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
 
   *stats = (SymbolStats*)realloc(*stats, (nlz77points + prevpoints + 1) * sizeof(SymbolStats));
   if (!(*stats)){
-    exit(1);
+    ZopfliOutOfMemory();
   }
 
   /* Convert LZ77 positions to positions in the uncompressed input. */
@@ -375,4 +379,5 @@ void ZopfliBlockSplit(const ZopfliOptions* options,
 
   free(lz77splitpoints);
   ZopfliCleanLZ77Store(&store);
+  ECT_StatsStop(&timer, ECT_STAGE_BLOCKSPLIT, inend - instart, 0, nlz77points + 1);
 }
@@ -25,19 +25,26 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "lz77.h"
 #include "squeeze.h"
 #include "katajainen.h"
+#include "../stats.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <math.h>
+#include <new>
 
 #ifndef NOMULTI
 #include <thread>
 #include <vector>
 #include <mutex>
+#include <exception>
 #endif
 
+void ZopfliOutOfMemory(void) {
+  throw std::bad_alloc();
+}
+
 /*
 bp = bitpointer, always in range [0, 7].
 The outsize is number of necessary bytes to encode the bits.
@@ -134,7 +141,7 @@ static void ZopfliLengthsToSymbols(const unsigned* lengths, size_t n, unsigned m
   unsigned* bl_count = (unsigned*)calloc(maxbits + 1, sizeof(unsigned));
   unsigned* next_code = (unsigned*)malloc(sizeof(unsigned) * (maxbits + 1));
   if (!bl_count || !next_code){
-    exit(1);
+    ZopfliOutOfMemory();
   }
   unsigned i;
 
@@ -579,7 +586,7 @@ void OptimizeHuffmanCountsForRle(int length, size_t* counts) {
   // with an rle code.
   unsigned char* good_for_rle = (unsigned char*)calloc(length, 1);
   if (!good_for_rle) {
-    exit(1);
+    ZopfliOutOfMemory();
   }
 
   // Let's not spoil any of the existing good rle codes.
@@ -891,7 +898,7 @@ static unsigned char ReplaceBadCodes(unsigned short** litlens,
   unsigned short* litlens2 = (unsigned short*)malloc(end * 3 * sizeof(unsigned short));
   unsigned short* dists2 = (unsigned short*)malloc(end * 3 * sizeof(unsigned short));
   if (!(litlens2 && dists2)){
-    exit(1);
+    ZopfliOutOfMemory();
   }
 
   size_t pos = instart;
@@ -1017,7 +1024,7 @@ static void AddLZ77Block(int btype, int final,
   outpred += *outsize * 8 + *bp -((*bp != 0) * 8);
   (*out) = (unsigned char*)realloc(*out, outpred / 8 + 1 + 8);
   if (!(*out)){
-    exit(1);
+    ZopfliOutOfMemory();
   }
   memset(&((*out)[*outsize]), 0, outpred / 8 + (!!(outpred & 7)) - (*outsize) + 8);
 
@@ -1057,7 +1064,8 @@ static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
                                 const unsigned char* in,
                                 size_t instart, size_t inend,
                                 unsigned char* bp,
-                                unsigned char** out, size_t* outsize, unsigned char* costmodelnotinited, SymbolStats* statsp, unsigned char twiceMode, ZopfliLZ77Store* twiceStore, unsigned mfinexport) {
+                                unsigned char** out, size_t* outsize, unsigned char* costmodelnotinited, SymbolStats* statsp, unsigned char twiceMode, ZopfliLZ77Store* twiceStore, unsigned mfinexport,
+                                const ZopfliLZ77Store* seed, int seediterations) {
   size_t blocksize = inend - instart;
   ZopfliLZ77Store store;
   int btype = 2;
@@ -1068,6 +1076,9 @@ static void DeflateDynamicBlock(const ZopfliOptions* options, int final,
     btype = 1;
     ZopfliLZ77OptimalFixed(options, in, instart, inend, &store, mfinexport);
   }
+  else if (seed){
+    ZopfliLZ77OptimalSeeded(options, in, instart, inend, seed, seediterations, &store, mfinexport);
+  }
   else{
     ZopfliLZ77Optimal2(options, in, instart, inend, &store, *costmodelnotinited, statsp, mfinexport);
   }
@@ -1188,12 +1199,28 @@ static void DeflateSplittingFirst2(
   BlockData* data = &d[0];
   BlockData* blockend = data + numblocks;
   std::mutex mtx;
+  //An allocation failure in a worker is rethrown here once all workers are done
+  std::exception_ptr error;
+  unsigned long long file = ECT_StatsCurrentFile();
   for (i = 0; i < threads; i++) {
-    multi[i % threads] = std::thread(DeflateDynamicBlock2,options, in, &data, blockend, std::ref(mtx));
+    multi[i % threads] = std::thread([&]{
+      ECT_StatsInheritFile(file);
+      try {
+        DeflateDynamicBlock2(options, in, &data, blockend, mtx);
+      }
+      catch (...) {
+        std::lock_guard<std::mutex> lock(mtx);
+        error = std::current_exception();
+        data = blockend;
+      }
+    });
   }
   for (size_t j = 0; j < threads; j++){
     multi[j].join();
   }
+  if (error){
+    std::rethrow_exception(error);
+  }
 
   if (twiceMode & 1){
     int j = 0;
@@ -1298,7 +1325,8 @@ static void DeflateSplittingFirst(const ZopfliOptions* options,
                                   const unsigned char* in,
                                   size_t instart, size_t inend,
                                   unsigned char* bp,
-                                  unsigned char** out, size_t* outsize, unsigned char* costmodelnotinited, unsigned char twiceMode, ZopfliLZ77Store* twiceStore) {
+                                  unsigned char** out, size_t* outsize, unsigned char* costmodelnotinited, unsigned char twiceMode, ZopfliLZ77Store* twiceStore,
+                                  const ZopfliLZ77Store* seed, int seediterations) {
   size_t* splitpoints = 0;
   size_t npoints = 0;
   SymbolStats* statsp = 0;
@@ -1308,15 +1336,20 @@ static void DeflateSplittingFirst(const ZopfliOptions* options,
   if (twiceMode & 1){
     stores = (ZopfliLZ77Store*)malloc((npoints + 1) * sizeof(ZopfliLZ77Store));
     if(!stores){
-      exit(1);
+      ZopfliOutOfMemory();
     }
   }
   for (size_t i = 0; i <= npoints; i++) {
     size_t start = i == 0 ? instart : splitpoints[i - 1];
     size_t end = i == npoints ? inend : splitpoints[i];
     unsigned x = npoints == 0 ? 0 : i == 0 ? 2 : i == npoints ? 1 : 3;
+    ZopfliLZ77Store range;
+    if (seed){
+      ZopfliLZ77SymbolRange(seed, start, end, &range);
+    }
     DeflateDynamicBlock(options, i == npoints && final, in, start, end,
-                        bp, out, outsize, costmodelnotinited, &(statsp[i]), twiceMode, stores ? stores + i : 0, x);
+                        bp, out, outsize, costmodelnotinited, &(statsp[i]), twiceMode, stores ? stores + i : 0, x,
+                        seed ? &range : 0, seediterations);
   }
   if (twiceMode & 1){
     ZopfliInitLZ77Store(twiceStore);
@@ -1350,7 +1383,34 @@ static void ZopfliDeflatePart(const ZopfliOptions* options, int final,
                        const unsigned char* in, size_t instart, size_t inend,
                        unsigned char* bp, unsigned char** out,
                        size_t* outsize, unsigned char* costmodelnotinited, unsigned char twiceMode, ZopfliLZ77Store* twiceStore) {
-  DeflateSplittingFirst(options, final, in, instart, inend, bp, out, outsize, costmodelnotinited, twiceMode, twiceStore);
+  DeflateSplittingFirst(options, final, in, instart, inend, bp, out, outsize, costmodelnotinited, twiceMode, twiceStore, 0, 0);
+}
+
+size_t ZopfliMasterBlockSize(const ZopfliOptions* options) {
+  size_t msize = ZOPFLI_MASTER_BLOCK_SIZE;
+  if (!options->isPNG && options->numiterations == 1){
+    msize /= 5;
+  }
+  return msize;
+}
+
+void ZopfliDeflateMasterBlock(const ZopfliOptions* options, int final,
+                              const unsigned char* in, size_t instart, size_t inend,
+                              unsigned char* bp, unsigned char** out, size_t* outsize,
+                              unsigned char* costmodelnotinited) {
+  ZopfliLZ77Store lf;
+  ZopfliInitLZ77Store(&lf);
+  if (!options->twice){
+    ZopfliDeflatePart(options, final, in, instart, inend, bp, out, outsize, costmodelnotinited, 0, &lf);
+  }
+  else{
+    unsigned char cache = *costmodelnotinited;
+    ZopfliDeflatePart(options, final, in, instart, inend, bp, out, outsize, costmodelnotinited, 1, &lf);
+    for (int it = 0; it < options->twice; it++) {
+      *costmodelnotinited = cache;
+      ZopfliDeflatePart(options, final, in, instart, inend, bp, out, outsize, costmodelnotinited, 2 + (it != options->twice - 1), &lf);
+    }
+  }
 }
 
 /*TODO: in needs to be alloc'd 8 bytes past inend. This may cause crashes if code is modified and nonstandard alloc function is used for allocation of in*/
@@ -1374,29 +1434,37 @@ void ZopfliDeflate(const ZopfliOptions* options, int final,
   ZopfliDeflatePart(options, final, in, 0, insize, bp, out, outsize, &costmodelnotinited);
 #else
   size_t i = 0;
-  size_t msize = ZOPFLI_MASTER_BLOCK_SIZE;
+  size_t msize = ZopfliMasterBlockSize(options);
   unsigned char costmodelnotinited = 1;
-  if (!options->isPNG && options->numiterations == 1){
-    msize /= 5;
-  }
   while (i < insize) {
     int masterfinal = (i + msize >= insize);
     int final2 = final && masterfinal;
     size_t size = masterfinal ? insize - i : msize;
-    ZopfliLZ77Store lf;
-    ZopfliInitLZ77Store(&lf);
-    if (!options->twice){
-      ZopfliDeflatePart(options, final2, in, i, i + size, bp, out, outsize, &costmodelnotinited, 0, &lf);
-    }
-    else{
-      unsigned char cache = costmodelnotinited;
-      ZopfliDeflatePart(options, final2, in, i, i + size, bp, out, outsize, &costmodelnotinited, 1, &lf);
-      for (int it = 0; it < options->twice; it++) {
-        costmodelnotinited = cache;
-        ZopfliDeflatePart(options, final2, in, i, i + size, bp, out, outsize, &costmodelnotinited, 2 + (it != options->twice - 1), &lf);
-      }
-    }
+    ZopfliDeflateMasterBlock(options, final2, in, i, i + size, bp, out, outsize, &costmodelnotinited);
     i += size;
   }
 #endif
 }
+
+void ZopfliDeflateSeeded(const ZopfliOptions* options, int final,
+                         const unsigned char* in, size_t insize,
+                         const ZopfliLZ77Store* seed, int iterations,
+                         unsigned char* bp, unsigned char** out, size_t* outsize) {
+  if (!insize || insize > ZopfliMasterBlockSize(options) || options->multithreading > 1 || options->twice){
+    ZopfliDeflate(options, final, in, insize, bp, out, outsize);
+    return;
+  }
+  /* The block splitter frees the parse it is given. ZopfliLZ77Counts reads a
+  few symbols past the end. */
+  ZopfliLZ77Store split;
+  ZopfliInitLZ77Store(&split);
+  split.litlens = (unsigned short*)calloc(seed->size + 16, sizeof(unsigned short));
+  split.dists = (unsigned short*)calloc(seed->size + 16, 1);
+  if (!split.litlens || !split.dists) ZopfliOutOfMemory();
+  memcpy(split.litlens, seed->litlens, sizeof(unsigned short) * seed->size);
+  memcpy(split.dists, seed->dists, seed->size);
+  split.size = seed->size;
+  split.symbols = 1;
+  unsigned char costmodelnotinited = 1;
+  DeflateSplittingFirst(options, final, in, 0, insize, bp, out, outsize, &costmodelnotinited, 2, &split, seed, iterations);
+}
@@ -28,6 +28,7 @@ Functions to compress according to the DEFLATE specification, using the
 */
 
 #include "zopfli.h"
+#include "lz77.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -56,6 +57,37 @@ void ZopfliDeflate(const ZopfliOptions* options, int final,
                    const unsigned char* in, size_t insize,
                    unsigned char* bp, unsigned char** out, size_t* outsize);
 
+/*
+Like ZopfliDeflate, but starts from seed, a lazy LZ77 parse of in in symbol
+form like ZopfliLZ77Lazy makes. It replaces the parse of the block splitter and
+gives the first cost model of each block, which then gets at most iterations
+squeeze passes. Falls back to ZopfliDeflate for input that needs more than one
+master block, with block multithreading and in twice mode.
+*/
+void ZopfliDeflateSeeded(const ZopfliOptions* options, int final,
+                         const unsigned char* in, size_t insize,
+                         const ZopfliLZ77Store* seed, int iterations,
+                         unsigned char* bp, unsigned char** out, size_t* outsize);
+
+/*
+Size of the master blocks ZopfliDeflate splits its input into. Match finding
+continues across master blocks, everything else is done per master block.
+*/
+size_t ZopfliMasterBlockSize(const ZopfliOptions* options);
+
+/*
+Compresses in[instart, inend) as one master block and appends the result to
+the output, see ZopfliDeflate. The ZOPFLI_WINDOW_SIZE bytes before instart must
+be in memory as they are used as dictionary, and 8 bytes past inend must be
+allocated. costmodelnotinited must initially be 1 and be reused for consecutive
+master blocks of the same stream. Allows streaming input through a window of
+ZOPFLI_WINDOW_SIZE + ZopfliMasterBlockSize() bytes.
+*/
+void ZopfliDeflateMasterBlock(const ZopfliOptions* options, int final,
+                              const unsigned char* in, size_t instart, size_t inend,
+                              unsigned char* bp, unsigned char** out, size_t* outsize,
+                              unsigned char* costmodelnotinited);
+
 /*
 Calculates block size in bits.
 litlens: lz77 lit/lengths
@@ -45,7 +45,7 @@ void ZopfliCopyLZ77Store(const ZopfliLZ77Store* source, ZopfliLZ77Store* dest) {
   dest->litlens = (unsigned short*)malloc(sizeof(*dest->litlens) * source->size);
   dest->dists = (unsigned short*)malloc(sizeof(*dest->dists) * source->size);
 
-  if (!dest->litlens || !dest->dists) exit(1); /* Allocation failed. */
+  if (!dest->litlens || !dest->dists) ZopfliOutOfMemory(); /* Allocation failed. */
 
   dest->size = source->size;
 
@@ -553,3 +553,39 @@ void ZopfliLZ77Counts(const unsigned short* litlens, const unsigned short* dists
     d_count[i] = dc[i] + dc2[i];
   }
 }
+
+void ZopfliLZ77MapLiterals(const ZopfliLZ77Store* store, const unsigned char* map,
+                           size_t stride, unsigned short* litlens) {
+  const unsigned char* dists = (const unsigned char*)store->dists;
+  size_t pos = 0;
+  for (size_t i = 0; i < store->size; i++) {
+    unsigned short ll = store->litlens[i];
+    if (dists[i]) {
+      litlens[i] = ll;
+      pos += symtox(ll & 511) + (ll >> 9);
+    }
+    else {
+      litlens[i] = pos % stride ? map[ll] : ll;
+      pos++;
+    }
+  }
+}
+
+void ZopfliLZ77SymbolRange(const ZopfliLZ77Store* store, size_t start, size_t end,
+                           ZopfliLZ77Store* range) {
+  size_t pos = 0;
+  size_t i = 0;
+  for (; i < store->size && pos < start; i++) {
+    unsigned short ll = store->litlens[i];
+    pos += ll < 256 ? 1 : symtox(ll & 511) + (ll >> 9);
+  }
+  size_t first = i;
+  for (; i < store->size && pos < end; i++) {
+    unsigned short ll = store->litlens[i];
+    pos += ll < 256 ? 1 : symtox(ll & 511) + (ll >> 9);
+  }
+  range->litlens = store->litlens + first;
+  range->dists = (unsigned short*)((unsigned char*)store->dists + first);
+  range->size = i - first;
+  range->symbols = 1;
+}
@@ -88,6 +88,24 @@ void ZopfliLZ77Lazy(const ZopfliOptions* options, const unsigned char* in,
                       size_t instart, size_t inend,
                       ZopfliLZ77Store* store);
 
+/*
+Copies the lit/lens of a store made by ZopfliLZ77Lazy to litlens, replacing
+each literal by map[literal]. Literals at positions that are a multiple of
+stride, such as PNG filter type bytes, are copied unchanged. Matches are copied
+as they are, so the result is only a parse of the mapped data as long as no
+match mixes bytes at such positions with others whose value the map changes.
+*/
+void ZopfliLZ77MapLiterals(const ZopfliLZ77Store* store, const unsigned char* map,
+                           size_t stride, unsigned short* litlens);
+
+/*
+Points range at the symbols of store, a parse made by ZopfliLZ77Lazy from
+position 0, that cover the input positions [start, end). The arrays are shared
+with store. start and end must be symbol boundaries, like block split points.
+*/
+void ZopfliLZ77SymbolRange(const ZopfliLZ77Store* store, size_t start, size_t end,
+                           ZopfliLZ77Store* range);
+
 #ifdef __cplusplus
 }
 #endif
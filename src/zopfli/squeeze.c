@@ -32,6 +32,7 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "squeeze.h"
 #include "match.h"
 #include "../LzFind.h"
+#include "../stats.h"
 
 static void CopyStats(const SymbolStats* source, SymbolStats* dest) {
   memcpy(dest->litlens, source->litlens, 288 * sizeof(dest->litlens[0]));
@@ -115,7 +116,7 @@ static void CreateCache(size_t len, LZCache* c){
   c->size = len + 513;
   c->cache = (unsigned short*)malloc(c->size * sizeof(unsigned short));
   if (!c->cache){
-    exit(1);
+    ZopfliOutOfMemory();
   }
   c->pointer = 0;
 }
@@ -124,8 +125,9 @@ static void CleanCache(LZCache* c){
   free(c->cache);
 }
 
-CMatchFinder mf;
-int right;
+//Match finder state handed from one master block to the next, per thread
+static _Thread_local CMatchFinder mf;
+static _Thread_local int right;
 
 #include <stdint.h>
 typedef  uint8_t BYTE;
@@ -225,7 +227,7 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
   float* disttable = (float*)malloc(ZOPFLI_WINDOW_SIZE * sizeof(float));
   float* literals = costcontext->ll_symbols;
   if (!disttable){
-    exit(1);
+    ZopfliOutOfMemory();
   }
     for (i = 3; i < 259; i++){
       litlentable[i] = costcontext->ll_symbols[ZopfliGetLengthSymbol(i)] + ZopfliGetLengthExtraBits(i);
@@ -277,7 +279,7 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
   size_t blocksize = inend - instart;
 
   float* costs = (float*)malloc(sizeof(float) * (blocksize + 1));
-  if (!costs) exit(1); /* Allocation failed. */
+  if (!costs) ZopfliOutOfMemory(); /* Allocation failed. */
   costs[0] = 0;  /* Because it's the start. */
   memset(costs + 1, 127, sizeof(float) * blocksize);
 
@@ -377,13 +379,14 @@ static void GetBestLengths2(const unsigned char* in, size_t instart, size_t inen
 static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend,
                            SymbolStats* costcontext, unsigned* length_array, unsigned char storeincache, LZCache* c, unsigned mfinexport) {
   size_t i;
+  size_t lookups = 0;
 
   /*TODO: Put this in seperate function*/
   float litlentable [259];
   float* disttable = (float*)malloc(ZOPFLI_WINDOW_SIZE * sizeof(float));
   float* literals;
   if (!disttable){
-    exit(1);
+    ZopfliOutOfMemory();
   }
   if (costcontext){  /* Dynamic Block */
 
@@ -446,7 +449,7 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
   else {
     literals = (float*)malloc(256 * sizeof(float));
     if (!literals){
-      exit(1);
+      ZopfliOutOfMemory();
     }
 
     for (i = 0; i < 144; i++){
@@ -481,7 +484,7 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
   size_t blocksize = inend - instart;
 
   float* costs = (float*)malloc(sizeof(float) * (blocksize + 1));
-  if (!costs) exit(1); /* Allocation failed. */
+  if (!costs) ZopfliOutOfMemory(); /* Allocation failed. */
   costs[0] = 0;  /* Because it's the start. */
   memset(costs + 1, 127, sizeof(float) * blocksize);
 
@@ -563,6 +566,7 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
     int numPairs;
     if (!storeincache){
       numPairs = Bt3Zip_MatchFinder_GetMatches(&p, matches);
+      lookups++;
     }
     else{
         if (c->size < c->pointer + (ZOPFLI_MAX_MATCH - ZOPFLI_MIN_MATCH + 1) * 2 + 1){
@@ -571,6 +575,7 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
         }
         matches = c->cache + c->pointer + 1;
         numPairs = Bt3Zip_MatchFinder_GetMatches(&p, matches);
+        lookups++;
         *(matches - 1) = numPairs;
         c->pointer += numPairs + 1;
     }
@@ -628,6 +633,7 @@ static void GetBestLengths(const ZopfliOptions* options, const unsigned char* in
   if (storeincache){
     c->pointer = 0;
   }
+  ECT_StatsCount(ECT_STAGE_MATCHFINDER, lookups);
 
   if (!costcontext){
     free(literals);
@@ -642,7 +648,7 @@ static void GetBestLengthsultra2(const unsigned char* in, size_t instart, size_t
   unsigned char litlentable [259];
   unsigned char* disttable = (unsigned char*)malloc(ZOPFLI_WINDOW_SIZE);
   if (!disttable){
-    exit(1);
+    ZopfliOutOfMemory();
   }
   unsigned char* literals = costcontext->ll_symbols;
   for (i = 3; i < 259; i++){
@@ -655,7 +661,7 @@ static void GetBestLengthsultra2(const unsigned char* in, size_t instart, size_t
   size_t blocksize = inend - instart;
 
   unsigned* costs = (unsigned*)malloc(sizeof(unsigned) * (blocksize + 1));
-  if (!costs) exit(1); /* Allocation failed. */
+  if (!costs) ZopfliOutOfMemory(); /* Allocation failed. */
   costs[0] = 0;  /* Because it's the start. */
   memset(costs + 1, 127, sizeof(float) * blocksize);
 
@@ -763,7 +769,7 @@ static void FollowPath(unsigned* path, size_t pathsize, ZopfliLZ77Store* store)
   store->litlens = (unsigned short*)malloc(pathsize * sizeof(unsigned short));
   store->dists = (unsigned short*)malloc(pathsize * sizeof(unsigned short));
   if (!store->litlens || !store->dists){
-    exit(1);
+    ZopfliOutOfMemory();
   }
 
   /*pathsize contains matches in reverted order.*/
@@ -848,6 +854,8 @@ returns the cost that was, according to the costmodel, needed to get to the end.
     This is not the actual cost.
 */
 static void LZ77OptimalRun(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend, unsigned* length_array, void* costcontext, ZopfliLZ77Store* store, unsigned char storeincache, LZCache* c, unsigned mfinexport, unsigned ultra2) {
+  ECTStatsTimer timer;
+  ECT_StatsStart(&timer);
   if (ultra2) {
     GetBestLengthsultra2(in, instart, inend, costcontext, length_array);
   }
@@ -865,10 +873,76 @@ static void LZ77OptimalRun(const ZopfliOptions* options, const unsigned char* in
   TraceBackwards(inend - instart, length_array, &path, &pathsize);
   FollowPath(path, pathsize, store);
   free(path);
+  ECT_StatsStop(&timer, ECT_STAGE_SQUEEZE, inend - instart, 0, 0);
 }
 
 /*TODO: Replace this w/ proper implementation. This performs bad on files w/ changing redundancy */
-static SymbolStats st;
+static _Thread_local SymbolStats st;
+
+void ZopfliResetCostModel(void) {
+  memset(&st, 0, sizeof(st));
+}
+
+void ZopfliGetCostModel(SymbolStats* stats) {
+  *stats = st;
+}
+
+void ZopfliSetCostModel(const SymbolStats* stats) {
+  st = *stats;
+}
+
+/*
+Corrects the cost model of a lazy LZ77 parse for the optimal parse of PNG data.
+lengthbias is added to the cost of long length symbols.
+*/
+static void CorrectPNGCostModel(SymbolStats* stats, size_t blocksize, double lengthbias) {
+  /*TODO:Corrections for cost model inaccuracies. There is still much potential here
+   Enable this in Mode 4 too, though less aggressive*/
+  for (unsigned i = 0; i < 256; i++){
+    stats->ll_symbols[i] -= .2;
+  }
+  if (blocksize < 1000){
+    for (unsigned i = 0; i < 256; i++){
+      stats->ll_symbols[i] -= 0.2;
+    }
+  }
+  stats->ll_symbols[0] -= 1.2;
+  stats->ll_symbols[1] -= 0.4;
+  stats->d_symbols[0] -= 1.5;
+  stats->d_symbols[3] -= 1.4;
+  stats->ll_symbols[255] -= 0.5;
+  stats->ll_symbols[257] -= .8;
+  stats->ll_symbols[258] += 0.3;
+  stats->ll_symbols[272] += 1.2;
+  stats->ll_symbols[282] += 0.2;
+  stats->ll_symbols[283] += 0.2;
+  stats->ll_symbols[284] += 0.4;
+  stats->ll_symbols[285] += 0.3;
+
+  for (unsigned i = 270; i < 286; i++){
+    stats->ll_symbols[i] += lengthbias;
+  }
+  for (unsigned i = 0; i < 286; i++){
+    if (stats->ll_symbols[i] < 1){
+      stats->ll_symbols[i] = 1;
+    }
+  }
+  for (unsigned i = 0; i < 30; i++){
+    if (stats->d_symbols[i] < 1){
+      stats->d_symbols[i] = 1;
+    }
+  }
+  for (unsigned i = 0; i < 286; i++){
+    if (stats->ll_symbols[i] > 15){
+      stats->ll_symbols[i] = 15;
+    }
+  }
+  for (unsigned i = 0; i < 30; i++){
+    if (stats->d_symbols[i] > 15){
+      stats->d_symbols[i] = 15;
+    }
+  }
+}
 
 static void ZopfliLZ77Optimal(const ZopfliOptions* options,
                        const unsigned char* in, size_t instart, size_t inend,
@@ -884,7 +958,7 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
   RanState ran_state;
   int lastrandomstep = -1;
 
-  if (!length_array) exit(1); /* Allocation failed. */
+  if (!length_array) ZopfliOutOfMemory(); /* Allocation failed. */
 
   InitRanState(&ran_state);
   ZopfliInitLZ77Store(&currentstore);
@@ -902,52 +976,7 @@ static void ZopfliLZ77Optimal(const ZopfliOptions* options,
   }
 
   if (options->isPNG && options->numiterations < 9){
-    /*TODO:Corrections for cost model inaccuracies. There is still much potential here
-     Enable this in Mode 4 too, though less aggressive*/
-    for (unsigned i = 0; i < 256; i++){
-      stats.ll_symbols[i] -= .2;
-    }
-    if (inend - instart < 1000){
-      for (unsigned i = 0; i < 256; i++){
-        stats.ll_symbols[i] -= 0.2;
-      }
-    }
-    stats.ll_symbols[0] -= 1.2;
-    stats.ll_symbols[1] -= 0.4;
-    stats.d_symbols[0] -= 1.5;
-    stats.d_symbols[3] -= 1.4;
-    stats.ll_symbols[255] -= 0.5;
-    stats.ll_symbols[257] -= .8;
-    stats.ll_symbols[258] += 0.3;
-    stats.ll_symbols[272] += 1.2;
-    stats.ll_symbols[282] += 0.2;
-    stats.ll_symbols[283] += 0.2;
-    stats.ll_symbols[284] += 0.4;
-    stats.ll_symbols[285] += 0.3;
-
-    for (unsigned i = 270; i < 286; i++){
-      stats.ll_symbols[i] += .4;
-    }
-    for (unsigned i = 0; i < 286; i++){
-      if (stats.ll_symbols[i] < 1){
-        stats.ll_symbols[i] = 1;
-      }
-    }
-    for (unsigned i = 0; i < 30; i++){
-      if (stats.d_symbols[i] < 1){
-        stats.d_symbols[i] = 1;
-      }
-    }
-    for (unsigned i = 0; i < 286; i++){
-      if (stats.ll_symbols[i] > 15){
-        stats.ll_symbols[i] = 15;
-      }
-    }
-    for (unsigned i = 0; i < 30; i++){
-      if (stats.d_symbols[i] > 15){
-        stats.d_symbols[i] = 15;
-      }
-    }
+    CorrectPNGCostModel(&stats, inend - instart, .4);
   }
 
   LZCache c;
@@ -1123,52 +1152,7 @@ void ZopfliLZ77Optimal2(const ZopfliOptions* options,
     CopyStats(&fromBlocksplitting, &stats);
 
     if (options->isPNG){
-      /*TODO:Corrections for cost model inaccuracies. There is still much potential here
-       Enable this in Mode 4 too, though less aggressive*/
-      for (unsigned i = 0; i < 256; i++){
-        stats.ll_symbols[i] -= .2;
-      }
-      if (inend - instart < 1000){
-        for (unsigned i = 0; i < 256; i++){
-          stats.ll_symbols[i] -= 0.2;
-        }
-      }
-      stats.ll_symbols[0] -= 1.2;
-      stats.ll_symbols[1] -= 0.4;
-      stats.d_symbols[0] -= 1.5;
-      stats.d_symbols[3] -= 1.4;
-      stats.ll_symbols[255] -= 0.5;
-      stats.ll_symbols[257] -= .8;
-      stats.ll_symbols[258] += 0.3;
-      stats.ll_symbols[272] += 1.2;
-      stats.ll_symbols[282] += 0.2;
-      stats.ll_symbols[283] += 0.2;
-      stats.ll_symbols[284] += 0.4;
-      stats.ll_symbols[285] += 0.3;
-
-      for (unsigned i = 270; i < 286; i++){
-          stats.ll_symbols[i] += .35;
-      }
-      for (unsigned i = 0; i < 286; i++){
-        if (stats.ll_symbols[i] < 1){
-          stats.ll_symbols[i] = 1;
-        }
-      }
-      for (unsigned i = 0; i < 30; i++){
-        if (stats.d_symbols[i] < 1){
-          stats.d_symbols[i] = 1;
-        }
-      }
-      for (unsigned i = 0; i < 286; i++){
-        if (stats.ll_symbols[i] > 15){
-          stats.ll_symbols[i] = 15;
-        }
-      }
-      for (unsigned i = 0; i < 30; i++){
-        if (stats.d_symbols[i] > 15){
-          stats.d_symbols[i] = 15;
-        }
-      }
+      CorrectPNGCostModel(&stats, inend - instart, .35);
     }
     if (!costmodelnotinited && !options->multithreading){
       MixCostmodels(&st, &stats, .2);
@@ -1182,7 +1166,7 @@ void ZopfliLZ77Optimal2(const ZopfliOptions* options,
   ZopfliInitLZ77Store(store);
   /* Dist to get to here with smallest cost. */
   unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (inend - instart + 1));
-  if (!length_array) exit(1); /* Allocation failed. */
+  if (!length_array) ZopfliOutOfMemory(); /* Allocation failed. */
   LZ77OptimalRun(options, in, instart, inend, length_array, options->reuse_costmodel ? &st : &stats, store, 0, 0, mfinexport, 0);
   free(length_array);
 
@@ -1191,6 +1175,48 @@ void ZopfliLZ77Optimal2(const ZopfliOptions* options,
   }
 }
 
+void ZopfliLZ77OptimalSeeded(const ZopfliOptions* options,
+                             const unsigned char* in, size_t instart, size_t inend,
+                             const ZopfliLZ77Store* seed, int iterations,
+                             ZopfliLZ77Store* store, unsigned mfinexport) {
+  SymbolStats stats;
+  GetStatistics(seed, &stats);
+  if (options->isPNG){
+    CorrectPNGCostModel(&stats, inend - instart, .4);
+  }
+
+  unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (inend - instart + 1));
+  if (!length_array) ZopfliOutOfMemory(); /* Allocation failed. */
+  LZCache c;
+  unsigned char usecache = options->useCache && iterations > 1;
+  if (usecache){
+    CreateCache(inend - instart, &c);
+  }
+  ZopfliLZ77Store currentstore;
+  ZopfliInitLZ77Store(&currentstore);
+  ZopfliInitLZ77Store(store);
+  double bestcost = ZOPFLI_LARGE_FLOAT;
+  for (int i = 1; i < iterations + 1; i++) {
+    ZopfliCleanLZ77Store(&currentstore);
+    ZopfliInitLZ77Store(&currentstore);
+    LZ77OptimalRun(options, in, instart, inend, length_array, &stats, &currentstore, usecache ? i == 1 ? 1 : 2 : 0, &c, mfinexport, 0);
+    double cost = ZopfliCalculateBlockSize(currentstore.litlens, currentstore.dists, 0, currentstore.size, 2, options->searchext, currentstore.symbols);
+    if (cost < bestcost) {
+      ZopfliCopyLZ77Store(&currentstore, store);
+      bestcost = cost;
+    }
+    else{
+      break;
+    }
+    GetStatistics(&currentstore, &stats);
+  }
+  if (usecache){
+    CleanCache(&c);
+  }
+  free(length_array);
+  ZopfliCleanLZ77Store(&currentstore);
+}
+
 void ZopfliLZ77OptimalFixed(const ZopfliOptions* options,
                             const unsigned char* in,
                             size_t instart, size_t inend,
@@ -1198,7 +1224,7 @@ void ZopfliLZ77OptimalFixed(const ZopfliOptions* options,
 {
   /* Dist to get to here with smallest cost. */
   unsigned* length_array = (unsigned*)malloc(sizeof(unsigned) * (inend - instart + 1));
-  if (!length_array) exit(1); /* Allocation failed. */
+  if (!length_array) ZopfliOutOfMemory(); /* Allocation failed. */
 
   /* Shortest path for fixed tree This one should give the shortest possible
   result for fixed tree, no repeated runs are needed since the tree is known. */
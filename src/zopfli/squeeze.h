@@ -56,6 +56,20 @@ typedef struct SymbolStats {
 
 void GetStatistics(const ZopfliLZ77Store* store, SymbolStats* stats);
 
+/*
+Resets the cost model that is carried from one Deflate call to the next when
+reuse_costmodel is set. Used where a result must not depend on what the same
+thread compressed before, like buffers passed to the library.
+*/
+void ZopfliResetCostModel(void);
+
+/*
+Copy the cost model of the calling thread, so work spread over several threads
+can start from the same model.
+*/
+void ZopfliGetCostModel(SymbolStats* stats);
+void ZopfliSetCostModel(const SymbolStats* stats);
+
 /*
 Calculates lit/len and dist pairs for given data.
 If instart is larger than 0, it uses values before instart as starting
@@ -64,6 +78,13 @@ dictionary.
 
 void ZopfliLZ77Optimal2(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend, ZopfliLZ77Store* store, unsigned char first, SymbolStats* statsp, unsigned mfinexport);
 
+/*
+Like ZopfliLZ77Optimal2, but the first cost model comes from seed, a lazy parse
+of the same range in symbol form, instead of the block splitter. Runs at most
+iterations passes and stops once a pass doesn't improve.
+*/
+void ZopfliLZ77OptimalSeeded(const ZopfliOptions* options, const unsigned char* in, size_t instart, size_t inend, const ZopfliLZ77Store* seed, int iterations, ZopfliLZ77Store* store, unsigned mfinexport);
+
 /*
 Does the same as ZopfliLZ77Optimal, but optimized for the fixed tree of the
 deflate standard.
@@ -86,6 +86,12 @@ unsigned ZopfliGetDistExtraBits(unsigned dist);
 /* Gets value of the extra bits for the given dist, cfr. the DEFLATE spec. */
 unsigned ZopfliGetDistExtraBitsValue(unsigned dist);
 
+/*
+Called when an allocation fails. Throws std::bad_alloc, so the C files must be
+compiled with -fexceptions for it to unwind back to the caller.
+*/
+void ZopfliOutOfMemory(void);
+
 #ifdef __GNUC__
 #define likely(x)      __builtin_expect(!!(x), 1)
 #define unlikely(x)    __builtin_expect(!!(x), 0)
@@ -103,15 +109,17 @@ data: pointer to the dynamic array to append to, type T**
 size: pointer to the size of the array to append to, type size_t*. This is the
 size that you consider the array to be, not the internal allocation size.
 Precondition: allocated size of data is at least a power of two greater than or
-equal than *size.
+equal than *size. If the allocation fails, data is left as it is so the caller
+can free it, and ZopfliOutOfMemory is called.
 */
 #ifdef __cplusplus /* C++ cannot assign void* from malloc to *data */
 #define ZOPFLI_APPEND_DATA(/* T */ value, /* T** */ data, /* size_t* */ size) {\
   if (!((*size) & ((*size) - 1))) {\
     /*double alloc size if it's a power of two*/\
-    void** data_void = reinterpret_cast<void**>(data);\
-    *data_void = (*size) == 0 ? malloc(sizeof(**data))\
-                              : realloc((*data), (*size) * 2 * sizeof(**data));\
+    void* grown = (*size) == 0 ? malloc(sizeof(**data))\
+                               : realloc((*data), (*size) * 2 * sizeof(**data));\
+    if (!grown) ZopfliOutOfMemory();\
+    *reinterpret_cast<void**>(data) = grown;\
   }\
   (*data)[(*size)] = (value);\
   (*size)++;\
@@ -120,8 +128,10 @@ equal than *size.
 #define ZOPFLI_APPEND_DATA(/* T */ value, /* T** */ data, /* size_t* */ size) {\
   if (!((*size) & ((*size) - 1))) {\
     /*double alloc size if it's a power of two*/\
-    (*data) = (*size) == 0 ? malloc(sizeof(**data))\
-                           : realloc((*data), (*size) * 2 * sizeof(**data));\
+    void* grown = (*size) == 0 ? malloc(sizeof(**data))\
+                               : realloc((*data), (*size) * 2 * sizeof(**data));\
+    if (!grown) ZopfliOutOfMemory();\
+    (*data) = grown;\
   }\
   (*data)[(*size)] = (value);\
   (*size)++;\
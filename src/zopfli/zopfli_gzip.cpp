@@ -24,15 +24,17 @@ Author: jyrki.alakuijala@gmail.com (Jyrki Alakuijala)
 #include "zopfli.h"
 #include "../zlib/zlib.h"
 #include "deflate.h"
-#include "zopfli.h"
+#include "lz77.h"
+#include "squeeze.h"
+#include "util.h"
 #include "zlib_container.h"
 #include "../main.h"
 #include <time.h>
-
-#define ZOPFLI_APPEND_DATA(/* T */ value, /* T** */ data, /* size_t* */ size) {\
-(*data)[(*size)] = (value);\
-(*size)++;\
-}
+#include <math.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 static void ZopfliZipCompress(const ZopfliOptions* options,
                               const unsigned char* in, size_t insize, time_t time, std::string name,
@@ -48,7 +50,6 @@ static void ZopfliZipCompress(const ZopfliOptions* options,
   const char* infilename = x.c_str();
   unsigned char bp = 0;
   size_t max = x.size();
-  *out = (unsigned char*)realloc(*out, 200);
 
   struct tm* times = localtime(&time);
   unsigned long dostime = times->tm_year < 80 ? 0x00210000 : times->tm_year > 207 ? 0xFF9FBF7D : (
@@ -83,7 +84,11 @@ static void ZopfliZipCompress(const ZopfliOptions* options,
   unsigned long rawdeflsize = *outsize;
 
   ZopfliDeflate(options, 1, in, insize, &bp, out, outsize);
-  *out = (unsigned char*)realloc(*out, 200 + *outsize);
+  /* ZopfliDeflate leaves no spare room, make some for the central directory and end record */
+  *out = (unsigned char*)realloc(*out, *outsize + 68 + max);
+  if (!*out) {
+    ZopfliOutOfMemory();
+  }
 
   rawdeflsize = *outsize - rawdeflsize;
 
@@ -142,6 +147,9 @@ static void ZopfliGzipCompress(const ZopfliOptions* options,
   unsigned char bp = 0;
 
   (*out) = (unsigned char*)malloc(20);
+  if (!*out) {
+    ZopfliOutOfMemory();
+  }
   (*out)[*outsize] = 31; (*outsize)++;  /* ID1 */
   (*out)[*outsize] = 139; (*outsize)++; /* ID2 */
   (*out)[*outsize] = 8; (*outsize)++;   /* CM  */
@@ -154,7 +162,11 @@ static void ZopfliGzipCompress(const ZopfliOptions* options,
   (*out)[*outsize] = 3; (*outsize)++;  /* OS follows Unix conventions. */
 
   ZopfliDeflate(options, 1, in, insize, &bp, out, outsize);
-  (*out) = (unsigned char*)realloc(*out, *outsize + 8);
+  unsigned char* grown = (unsigned char*)realloc(*out, *outsize + 8);
+  if (!grown) {
+    ZopfliOutOfMemory();
+  }
+  (*out) = grown;
 
   /* CRC */
   *(unsigned*)(&(*out)[*outsize]) = crcvalue; (*outsize) += 4;
@@ -173,7 +185,7 @@ static void ZopfliCompress(const ZopfliOptions* options, ZopfliFormat output_typ
     ZopfliZipCompress(options, in, insize, time, name, out, outsize);
   }
   else if (output_type == ZOPFLI_FORMAT_ZLIB) {
-    //ZopfliZlibCompress(options, in, insize, out, outsize);
+    ZopfliZlibCompress(options, in, insize, out, outsize);
   }
   else if (output_type == ZOPFLI_FORMAT_DEFLATE) {
     unsigned char bp = 0;
@@ -195,7 +207,7 @@ static void LoadFile(const char* filename,
 
   *out = (unsigned char*)malloc(*outsize + 8);
   if (!*out && *outsize){
-    exit(1);
+    ZopfliOutOfMemory();
   }
   if (*outsize) {
     size_t testsize = fread(*out, 1, *outsize, file);
@@ -272,3 +284,189 @@ void ZopfliBuffer(unsigned mode, unsigned multithreading, const unsigned char* i
   unsigned char bp = 0;
   ZopfliDeflate(&options, 1, in, insize, &bp, out, outsize);
 }
+
+void ZopfliGzipBuffer(unsigned mode, unsigned multithreading, const unsigned char* in, size_t insize, time_t mtime, unsigned char** out, size_t* outsize) {
+  ZopfliOptions options;
+  ZopfliInitOptions(&options, mode, multithreading, 0);
+  ZopfliCompress(&options, ZOPFLI_FORMAT_GZIP, in, insize, mtime, "", out, outsize);
+}
+
+void ZopfliZlibBuffer(unsigned mode, unsigned multithreading, const unsigned char* in, size_t insize, unsigned char** out, size_t* outsize) {
+  ZopfliOptions options;
+  ZopfliInitOptions(&options, mode, multithreading, 0);
+  ZopfliCompress(&options, ZOPFLI_FORMAT_ZLIB, in, insize, 0, "", out, outsize);
+}
+
+/*
+ Cheap check whether deflating in can't get below target bytes, so the squeeze can be
+ skipped for already compressed data. Returns 1 if it predicts no gain.
+ */
+int ZopfliIncompressible(const unsigned char* in, size_t insize, size_t target) {
+  //Small inputs are cheap enough to just try
+  if (insize < 4096) {
+    return 0;
+  }
+
+  //Order-0 entropy of up to 64 evenly spaced 1 KB samples
+  size_t counts[256] = {0};
+  size_t sampled = 0;
+  size_t stride = insize / 64 > 1024 ? insize / 64 : 1024;
+  for (size_t pos = 0; pos + 1024 <= insize; pos += stride) {
+    for (size_t i = pos; i < pos + 1024; i++) {
+      counts[in[i]]++;
+    }
+    sampled += 1024;
+  }
+  double entropy = 0;
+  for (unsigned i = 0; i < 256; i++) {
+    if (counts[i]) {
+      double p = (double)counts[i] / sampled;
+      entropy -= p * log2(p);
+    }
+  }
+  if (entropy < 7.9) {
+    return 0;
+  }
+
+  //High entropy data can still contain long repeats, look for them with a lazy pass over the start
+  size_t probesize = insize < (1 << 20) ? insize : (1 << 20);
+  ZopfliOptions options;
+  ZopfliInitOptions(&options, 4, 0, 0);
+  ZopfliLZ77Store store;
+  ZopfliInitLZ77Store(&store);
+  ZopfliLZ77Lazy(&options, in, 0, probesize, &store);
+  //The lazy matcher stores distance symbols as bytes
+  const unsigned char* dists = (const unsigned char*)store.dists;
+  size_t literals = 0;
+  for (size_t i = 0; i < store.size; i++) {
+    literals += !dists[i];
+  }
+  double bits = ZopfliCalculateBlockSize(store.litlens, store.dists, 0, store.size, 2, 0, 1);
+  ZopfliCleanLZ77Store(&store);
+
+  //Better parsing only pays off when matches cover a noticeable part of the input
+  if (probesize - literals > probesize / 100) {
+    return 0;
+  }
+  return bits / 8 * ((double)insize / probesize) >= target;
+}
+
+/*
+ Writes all complete bytes of out to file and keeps a trailing partial byte, which
+ the next deflate block is appended to.
+ */
+static int FlushStream(FILE* file, unsigned char* out, size_t* outsize, unsigned char bp) {
+  size_t complete = bp ? *outsize - 1 : *outsize;
+  if (complete && fwrite(out, 1, complete, file) != complete) {
+    return 1;
+  }
+  if (bp) {
+    out[0] = out[complete];
+  }
+  *outsize -= complete;
+  return fflush(file) != 0;
+}
+
+int ZopfliCompressStream(FILE* infile, FILE* outfile, unsigned mode, unsigned zlib) {
+#ifdef _WIN32
+  _setmode(_fileno(infile), _O_BINARY);
+  _setmode(_fileno(outfile), _O_BINARY);
+#endif
+  ZopfliOptions options;
+  ZopfliInitOptions(&options, mode, 0, 0);
+  size_t msize = ZopfliMasterBlockSize(&options);
+  ZopfliResetCostModel();
+
+  //The window keeps the last ZOPFLI_WINDOW_SIZE bytes of the previous master block as dictionary
+  unsigned char* window = (unsigned char*)malloc(ZOPFLI_WINDOW_SIZE + msize + 8);
+  if (!window) {
+    ZopfliOutOfMemory();
+  }
+  unsigned char* out = 0;
+  size_t outsize = 0;
+  unsigned char bp = 0;
+  unsigned char costmodelnotinited = 1;
+  unsigned long checksum = zlib ? adler32(0, 0, 0) : crc32(0, 0, 0);
+  unsigned long long total = 0;
+  size_t history = 0;
+  int error = 0;
+
+  if (zlib) {
+    unsigned cmfflg = 256 * 120 + 3 * 64;
+    cmfflg += 31 - cmfflg % 31;
+    out = (unsigned char*)malloc(2);
+    if (!out) {
+      free(window);
+      ZopfliOutOfMemory();
+    }
+    out[outsize++] = cmfflg / 256;
+    out[outsize++] = cmfflg % 256;
+  }
+  else {
+    //Like gzip, use no timestamp for data read from a pipe
+    static const unsigned char header[10] = {31, 139, 8, 0, 0, 0, 0, 0, 2, 3};
+    out = (unsigned char*)malloc(sizeof(header));
+    if (!out) {
+      free(window);
+      ZopfliOutOfMemory();
+    }
+    memcpy(out, header, sizeof(header));
+    outsize = sizeof(header);
+  }
+
+  while (!error) {
+    size_t size = fread(window + history, 1, msize, infile);
+    int c = size == msize ? getc(infile) : EOF;
+    if (c != EOF) {
+      ungetc(c, infile);
+    }
+    if (ferror(infile)) {
+      error = 1;
+      break;
+    }
+    int final = c == EOF;
+    if (size) {
+      checksum = zlib ? adler32(checksum, window + history, size) : crc32(checksum, window + history, size);
+      ZopfliDeflateMasterBlock(&options, final, window, history, history + size, &bp, &out, &outsize, &costmodelnotinited);
+    }
+    else if (!total) {
+      ZopfliDeflate(&options, 1, window, 0, &bp, &out, &outsize);
+    }
+    total += size;
+    if (final) {
+      break;
+    }
+    error = FlushStream(outfile, out, &outsize, bp);
+
+    size_t keep = history + size < ZOPFLI_WINDOW_SIZE ? history + size : ZOPFLI_WINDOW_SIZE;
+    memmove(window, window + history + size - keep, keep);
+    history = keep;
+  }
+  free(window);
+
+  if (!error) {
+    unsigned char* grown = (unsigned char*)realloc(out, outsize + 8);
+    if (!grown) {
+      free(out);
+      ZopfliOutOfMemory();
+    }
+    out = grown;
+    if (zlib) {
+      for (int i = 24; i >= 0; i -= 8) {
+        out[outsize++] = (checksum >> i) % 256;
+      }
+    }
+    else {
+      for (int i = 0; i < 32; i += 8) {
+        out[outsize++] = (checksum >> i) % 256;
+      }
+      /* ISIZE is the input size modulo 2^32 */
+      for (int i = 0; i < 32; i += 8) {
+        out[outsize++] = (total >> i) % 256;
+      }
+    }
+    error = FlushStream(outfile, out, &outsize, 0);
+  }
+  free(out);
+  return error;
+}
@@ -19,17 +19,29 @@
 
 /*Modified by Felix Hanau*/
 
+#include <algorithm>
 #include <cstdio>
 #include <cassert>
-#include <unordered_set>
+#include <map>
 #include <vector>
 #include <string>
+#ifndef NOMULTI
+#include <exception>
+#include <mutex>
+#include <thread>
+#endif
 
 #include "lodepng/lodepng_util.h"
 #include "zopfli/deflate.h"
+#include "zopfli/lz77.h"
+#include "zopfli/squeeze.h"
+#include "zlib/zlib.h"
 #include "main.h"
+#include "stats.h"
 #include "lodepng/lodepng.h"
 
+struct PaletteParse;
+
 struct ZopfliPNGOptions {
   ZopfliPNGOptions();
 
@@ -47,37 +59,269 @@ struct ZopfliPNGOptions {
   //Use per block multithreading
   unsigned multithreading;
 
+  //Threads the palette trials may use, 0 for one per core
+  unsigned threads;
+
+  // Deflate results of earlier trials on the same image, may be null
+  PNGTrialCache* cache;
+
+  // Parse of a palette ordering that seeds the encode of other orderings, may be null
+  const PaletteParse* parse;
+
+  // Print decoding and encoding errors, libect reports them through its return value only
+  bool verbose;
 };
 
 ZopfliPNGOptions::ZopfliPNGOptions()
 : lossy_transparent(true)
 , lossy_8bit(false)
 , strip(false)
+, threads(0)
+, cache(0)
+, parse(0)
+, verbose(false)
 {
 }
 
+// Filter strategies often pick the same filter for every row, which gives
+// the same filtered data. The deflate result is kept together with that data
+// under a fingerprint of it and reused instead of compressing it again.
+struct PNGTrialCache {
+  struct Key {
+    size_t size;
+    unsigned long crc;
+    unsigned long adler;
+    unsigned mode;
+    bool operator<(const Key& other) const {
+      if (size != other.size) return size < other.size;
+      if (crc != other.crc) return crc < other.crc;
+      if (adler != other.adler) return adler < other.adler;
+      return mode < other.mode;
+    }
+  };
+
+  struct Result {
+    std::vector<unsigned char> in;
+    std::vector<unsigned char> out;
+  };
+
+  std::map<Key, Result> results;
+#ifndef NOMULTI
+  std::mutex mutex;
+#endif
+};
+
+PNGTrialCache* ZopflipngCreateCache() {
+  return new PNGTrialCache;
+}
+
+void ZopflipngFreeCache(PNGTrialCache* cache) {
+  delete cache;
+}
+
+// Fingerprints the filtered data, the first bytes of every row are the filter
+// types chosen by the strategy and the rest is determined by them and the
+// color mode.
+static PNGTrialCache::Key TrialKey(const unsigned char* in, size_t insize, unsigned mode) {
+  PNGTrialCache::Key key;
+  key.size = insize;
+  key.crc = crc32(0, 0, 0);
+  key.adler = adler32(0, 0, 0);
+  key.mode = mode;
+  for (size_t i = 0; i < insize; i += 1 << 30) {
+    unsigned len = insize - i < 1 << 30 ? insize - i : 1 << 30;
+    key.crc = crc32(key.crc, in + i, len);
+    key.adler = adler32(key.adler, in + i, len);
+  }
+  return key;
+}
+
+// Lazy LZ77 parse of the first palette ordering ranked. With filter 0 the
+// other orderings only permute the pixel bytes, so the parse is reused with
+// mapped literals instead of finding the matches again. The filter type bytes
+// keep their value, so if pixel value 0 is remapped, matches that mix them
+// with pixel bytes no longer hold exactly. The mapped parse is only used for
+// estimates and cost models, where that doesn't matter.
+struct PaletteParse {
+  PaletteParse() : stride(0) {
+    ZopfliInitLZ77Store(&store);
+  }
+  ~PaletteParse() {
+    ZopfliCleanLZ77Store(&store);
+  }
+
+  // Bytes per filtered scanline, 0 to not reuse the parse
+  size_t stride;
+  std::vector<unsigned char> data;
+  ZopfliLZ77Store store;
+};
+
+// Maps the lit/lens of the reference parse to in, returns false unless in is
+// the reference data with its pixel bytes permuted.
+static bool MapParse(const PaletteParse& parse, const unsigned char* in, size_t insize, std::vector<unsigned short>* litlens) {
+  if (!parse.stride || insize != parse.data.size()) {
+    return false;
+  }
+  int map[256];
+  std::fill(map, map + 256, -1);
+  const unsigned char* ref = &parse.data[0];
+  for (size_t y = 0; y < insize; y += parse.stride) {
+    if (in[y] != ref[y]) {
+      return false;
+    }
+    for (size_t i = y + 1; i < y + parse.stride; i++) {
+      if (map[ref[i]] < 0) {
+        map[ref[i]] = in[i];
+      }
+      else if (map[ref[i]] != in[i]) {
+        return false;
+      }
+    }
+  }
+  unsigned char bytes[256];
+  for (unsigned i = 0; i < 256; i++) {
+    bytes[i] = map[i] < 0 ? i : map[i];
+  }
+  // ZopfliLZ77Counts reads a few symbols past the end
+  litlens->resize(parse.store.size + 8);
+  ZopfliLZ77MapLiterals(&parse.store, bytes, parse.stride, &(*litlens)[0]);
+  return true;
+}
+
 // Deflate compressor passed as fuction pointer to LodePNG to have it use Zopfli
 // as its compression backend.
 static unsigned CustomPNGDeflate(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize, const LodePNGCompressSettings* settings) {
   const ZopfliPNGOptions* png_options = static_cast<const ZopfliPNGOptions*>(settings->custom_context);
+  PNGTrialCache* cache = png_options->cache;
+  PNGTrialCache::Key key;
+  if (cache) {
+    key = TrialKey(in, insize, png_options->Mode);
+#ifndef NOMULTI
+    std::lock_guard<std::mutex> lock(cache->mutex);
+#endif
+    std::map<PNGTrialCache::Key, PNGTrialCache::Result>::const_iterator it = cache->results.find(key);
+    // The fingerprint only finds the candidate, the data itself has to match
+    if (it != cache->results.end() && (!insize || !memcmp(it->second.in.data(), in, insize))) {
+      *outsize = it->second.out.size();
+      *out = (unsigned char*)malloc(*outsize);
+      if (!*out) {
+        return 83;
+      }
+      memcpy(*out, it->second.out.data(), *outsize);
+      return 0;
+    }
+  }
+
   unsigned char bp = 0;
   ZopfliOptions options;
   ZopfliInitOptions(&options, png_options->Mode, png_options->multithreading, 1);
-  ZopfliDeflate(&options, 1, in, insize, &bp, out, outsize);
+  std::vector<unsigned short> litlens;
+  if (png_options->parse && MapParse(*png_options->parse, in, insize, &litlens)) {
+    // Another palette ordering of the same image, its mapped parse replaces the first lazy parse.
+    // A second squeeze pass from it is cheap and recovers more than the single pass of the fast modes.
+    ZopfliLZ77Store seed = png_options->parse->store;
+    seed.litlens = &litlens[0];
+    seed.symbols = 1;
+    ZopfliDeflateSeeded(&options, 1, in, insize, &seed, std::max(options.numiterations, 2), &bp, out, outsize);
+  }
+  else {
+    ZopfliDeflate(&options, 1, in, insize, &bp, out, outsize);
+  }
+  if (cache) {
+#ifndef NOMULTI
+    std::lock_guard<std::mutex> lock(cache->mutex);
+#endif
+    PNGTrialCache::Result& result = cache->results[key];
+    result.in.assign(in, in + insize);
+    result.out.assign(*out, *out + *outsize);
+  }
   return 0;
 }
 
+// Images with at least this much filtered data are compressed a master block at a time, see
+// CustomPNGDeflateChunk.
+static const size_t kChunkedThreshold = 64 << 20;
+
+// Counterpart of CustomPNGDeflate for large images that LodePNG filters and compresses in chunks, so that
+// the filtered image is never in memory at once. Gives the same result as compressing it all at once.
+static unsigned CustomPNGDeflateChunk(unsigned char** out, size_t* outsize, const unsigned char* in, size_t instart, size_t inend,
+                                      int final, unsigned char* stream, const LodePNGCompressSettings* settings) {
+  const ZopfliPNGOptions* png_options = static_cast<const ZopfliPNGOptions*>(settings->custom_context);
+  ZopfliOptions options;
+  ZopfliInitOptions(&options, png_options->Mode, png_options->multithreading, 1);
+  unsigned char costmodelnotinited = !stream[1];
+  ZopfliDeflateMasterBlock(&options, final, in, instart, inend, &stream[0], out, outsize, &costmodelnotinited);
+  stream[1] = !costmodelnotinited;
+  return 0;
+}
+
+// Stand-in for CustomPNGDeflate used to rank palette orderings: outputs a
+// zeroed buffer as large as a lazy LZ77 parse of the data would compress to.
+static unsigned EstimatePNGDeflate(unsigned char** out, size_t* outsize, const unsigned char* in, size_t insize, const LodePNGCompressSettings* settings) {
+  PaletteParse* parse = const_cast<PaletteParse*>(static_cast<const PaletteParse*>(settings->custom_context));
+  size_t bits = 0;
+  std::vector<unsigned short> litlens;
+  if (MapParse(*parse, in, insize, &litlens)) {
+    bits = ZopfliCalculateBlockSize(&litlens[0], parse->store.dists, 0, parse->store.size, 2, 0, 1);
+  }
+  if (!bits) {
+    ZopfliOptions options;
+    ZopfliInitOptions(&options, 4, 0, 0);
+    ZopfliLZ77Store store;
+    ZopfliInitLZ77Store(&store);
+    ZopfliLZ77Lazy(&options, in, 0, insize, &store);
+    bits = ZopfliCalculateBlockSize(store.litlens, store.dists, 0, store.size, 2, 0, 1);
+    if (parse->stride && parse->data.empty() && insize && insize % parse->stride == 0) {
+      parse->data.assign(in, in + insize);
+      std::swap(parse->store, store);
+    }
+    ZopfliCleanLZ77Store(&store);
+  }
+  *outsize = (bits + 7) / 8 + 1;
+  *out = (unsigned char*)calloc(*outsize, 1);
+  return *out ? 0 : 83;
+}
+
 // Returns 32-bit integer value for RGBA color.
 static unsigned ColorIndex(const unsigned char* color) {
   return color[0] + (color[1] << 8) + (color[2] << 16) + (color[3] << 24);
 }
 
+// Set of up to 257 colors in a fixed size hash table. Unlike a std::unordered_set
+// it doesn't allocate, which showed up when optimizing many small images.
+struct ColorSet {
+  static const unsigned kSlots = 512;  // Power of two, twice the colors stored.
+  unsigned colors[kSlots];
+  bool used[kSlots];
+  size_t count;
+
+  void clear() {
+    memset(used, 0, sizeof(used));
+    count = 0;
+  }
+  size_t size() const { return count; }
+  // Returns the slot of the color, or the empty slot it would be stored in.
+  unsigned slot(unsigned color) const {
+    unsigned i = (color * 2654435761u) >> 23;
+    while (used[i] && colors[i] != color) i = (i + 1) & (kSlots - 1);
+    return i;
+  }
+  bool contains(unsigned color) const { return used[slot(color)]; }
+  void insert(unsigned color) {
+    unsigned i = slot(color);
+    if (!used[i]) {
+      used[i] = true;
+      colors[i] = color;
+      count++;
+    }
+  }
+};
+
 // Counts amount of colors in the image, up to 257. If transparent_counts_as_one
 // is enabled, any color with alpha channel 0 is treated as a single color with
 // index 0.
-static void CountColors(std::unordered_set<unsigned>* unique, const unsigned char* image, unsigned w, unsigned h, bool transparent_counts_as_one) {
+static void CountColors(ColorSet* unique, const unsigned char* image, unsigned w, unsigned h, bool transparent_counts_as_one) {
   unique->clear();
-  unique->reserve(512);
   unsigned prev = ~*(unsigned*)(image);
   for (size_t i = 0; i < w * h; i++) {
     unsigned index = ColorIndex(&image[i * 4]);
@@ -93,7 +337,7 @@ static void CountColors(std::unordered_set<unsigned>* unique, const unsigned cha
 // Remove RGB information from pixels with alpha=0
 static void LossyOptimizeTransparent(lodepng::State* inputstate, unsigned char* image,
                                      unsigned w, unsigned h, int filter) {
-  std::unordered_set<unsigned> count;  // Color count, up to 257.
+  ColorSet count;  // Color count, up to 257.
 
   // If true, means palette is possible so avoid using different RGB values for
   // the transparent color.
@@ -359,7 +603,7 @@ static void LossyOptimizeTransparent(lodepng::State* inputstate, unsigned char*
       std::vector<unsigned char> palette_out;
       unsigned char* palette_in = inputstate->info_png.color.palette;
       for (size_t i = 0; i < inputstate->info_png.color.palettesize; i++) {
-        if (count.count(ColorIndex(&palette_in[i * 4])) != 0) {
+        if (count.contains(ColorIndex(&palette_in[i * 4]))) {
           palette_out.push_back(palette_in[i * 4]);
           palette_out.push_back(palette_in[i * 4 + 1]);
           palette_out.push_back(palette_in[i * 4 + 2]);
@@ -374,69 +618,238 @@ static void LossyOptimizeTransparent(lodepng::State* inputstate, unsigned char*
   }
 }
 
-// Tries to optimize given a single PNG filter strategy.
-// Returns 0 if ok, other value for error
-static unsigned TryOptimize(std::vector<unsigned char>& image, unsigned w, unsigned h, bool bit16, const lodepng::State& inputstate,
-                            const ZopfliPNGOptions* png_options, std::vector<unsigned char>* out, int best_filter, std::vector<unsigned char> filters, unsigned palette_filter) {
-  lodepng::State state;
-  state.encoder.zlibsettings.custom_deflate = CustomPNGDeflate;
-  state.encoder.zlibsettings.custom_context = png_options;
-  state.encoder.clean_alpha = png_options->lossy_transparent;
+// Sets up state to encode with the given options and PNG filter strategy.
+static void InitEncoderState(lodepng::State* state, const lodepng::State& inputstate, const ZopfliPNGOptions* png_options,
+                             bool bit16, int best_filter, std::vector<unsigned char>& filters) {
+  state->encoder.zlibsettings.custom_deflate = CustomPNGDeflate;
+  state->encoder.zlibsettings.custom_context = png_options;
+  state->encoder.clean_alpha = png_options->lossy_transparent;
 
   ZopfliOptions dummyoptions;
+  // Multithreaded deflate works on all master blocks at once
+  if (png_options->multithreading <= 1) {
+    ZopfliInitOptions(&dummyoptions, png_options->Mode, 0, 1);
+    state->encoder.zlibsettings.custom_deflate_chunk = CustomPNGDeflateChunk;
+    state->encoder.zlibsettings.chunk_size = ZopfliMasterBlockSize(&dummyoptions);
+    state->encoder.chunked_threshold = kChunkedThreshold;
+  }
   ZopfliInitOptions(&dummyoptions, png_options->Mode, 0, 0);
-  state.encoder.filter_style = dummyoptions.filter_style;
-  state.encoder.text_compression = 0;
+  state->encoder.filter_style = dummyoptions.filter_style;
+  state->encoder.text_compression = 0;
   if (bit16) {
-    state.info_raw.bitdepth = 16;
+    state->info_raw.bitdepth = 16;
   }
 
-  state.encoder.filter_strategy = (LodePNGFilterStrategy)best_filter;
+  state->encoder.filter_strategy = (LodePNGFilterStrategy)best_filter;
+  state->encoder.threads = png_options->threads;
+  state->encoder.verbose = png_options->verbose;
   if (best_filter == 6)
   {
-    state.encoder.predefined_filters = &filters[0];
-    state.encoder.auto_convert = 0;
-    lodepng_color_mode_copy(&state.info_png.color, &inputstate.info_png.color);
+    state->encoder.predefined_filters = &filters[0];
+    state->encoder.auto_convert = 0;
+    lodepng_color_mode_copy(&state->info_png.color, &inputstate.info_png.color);
   }
+  state->div = png_options->Mode == 2 ? 6 : png_options->Mode < 8 ? 3 : 2;
+}
+
+// Threads RunTrials runs count trials on, up to png_options->threads.
+static unsigned TrialThreads(const ZopfliPNGOptions* png_options, size_t count) {
+#ifndef NOMULTI
+  unsigned threads = png_options->threads ? png_options->threads : std::thread::hardware_concurrency();
+  //Each trial already uses that many threads with --mt-deflate
+  if (png_options->multithreading > 1) {
+    threads /= png_options->multithreading;
+  }
+  if (threads > count) {
+    threads = count;
+  }
+  return threads < 1 ? 1 : threads;
+#else
+  return 1;
+#endif
+}
+
+// Splits [0, count) into contiguous ranges and calls trials(begin, end) for
+// each, on TrialThreads threads.
+template<typename Trials>
+static void RunTrials(const ZopfliPNGOptions* png_options, size_t count, Trials trials) {
+#ifndef NOMULTI
+  unsigned threads = TrialThreads(png_options, count);
+  if (threads > 1) {
+    std::exception_ptr exception;
+    std::mutex exception_mutex;
+    std::vector<std::thread> workers;
+    unsigned long long file = ECT_StatsCurrentFile();
+    for (unsigned j = 0; j < threads; j++) {
+      workers.push_back(std::thread([&, j]{
+        ECT_StatsInheritFile(file);
+        try {
+          trials(count * j / threads, count * (j + 1) / threads);
+        }
+        catch (...) {
+          std::lock_guard<std::mutex> lock(exception_mutex);
+          if (!exception) {
+            exception = std::current_exception();
+          }
+        }
+      }));
+    }
+    for (unsigned j = 0; j < threads; j++) {
+      workers[j].join();
+    }
+    if (exception) {
+      std::rethrow_exception(exception);
+    }
+    return;
+  }
+#endif
+  trials(0, count);
+}
+
+// lodepng::encode, counted as stage by --stats
+static unsigned TimedEncode(std::vector<unsigned char>& out, unsigned char* image, unsigned w, unsigned h, bool bit16,
+                            lodepng::State& state, LodePNGPaletteSettings p, ECTStage stage) {
+  ECTStatsTimer timer;
+  ECT_StatsStart(&timer);
+  unsigned error = lodepng::encode(out, image, w, h, state, p);
+  ECT_StatsStop(&timer, stage, (size_t)w * h * (bit16 ? 8 : 4), out.size(), 0);
+  return error;
+}
+
+// Tries to optimize given a single PNG filter strategy.
+// Returns 0 if ok, other value for error
+static unsigned TryOptimize(unsigned char* image, unsigned w, unsigned h, bool bit16, const lodepng::State& inputstate,
+                            const ZopfliPNGOptions* png_options, std::vector<unsigned char>* out, int best_filter, std::vector<unsigned char> filters, unsigned palette_filter) {
+  lodepng::State state;
+  InitEncoderState(&state, inputstate, png_options, bit16, best_filter, filters);
 
   LodePNGPaletteSettings p;
   p.order = LPOS_NONE;
-  state.div = png_options->Mode == 2 ? 6 : png_options->Mode < 8 ? 3 : 2;
-  unsigned error = lodepng::encode(*out, image, w, h, state, p);
+  unsigned error = TimedEncode(*out, image, w, h, bit16, state, p, ECT_STAGE_PNG_TRIAL);
   // For very small output, also try without palette, it may be smaller thanks
   // to no palette storage overhead.
 
-  if (!error && state.out_mode.colortype == LCT_PALETTE && palette_filter && state.out_mode.palettesize > 1) {
-    p._first = 1;
-    std::vector<unsigned char> out2;
-    int tries = 0;
-    for (int k4 = 0; k4 < 4; k4++){
+  if (!error && best_filter != 6 && state.out_mode.colortype == LCT_PALETTE && palette_filter && state.out_mode.palettesize > 1) {
+    std::vector<LodePNGPaletteSettings> orders;
+    bool alpha = lodepng_can_have_alpha(&state.out_mode);
+    for (int k4 = 0; k4 < 4 && orders.size() < palette_filter; k4++){
       p.order = (LodePNGPaletteOrderStrategy)k4;
-      for (int k3 = 0; k3 < 5; k3++){
+      for (int k3 = 0; k3 < 5 && orders.size() < palette_filter; k3++){
         p.priority = (LodePNGPalettePriorityStrategy)k3;
-        for (int k2 = 0; k2 < 3; k2++){
+        for (int k2 = 0; k2 < (alpha ? 3 : 1) && orders.size() < palette_filter; k2++){
           p.trans = (LodePNGPaletteTransparencyStrategy)k2;
-          if (!lodepng_can_have_alpha(&state.out_mode)){
-            k2 = 3;
-          }
-
-          for (int k1 = 0; k1 < 2; k1++){
+          for (int k1 = 0; k1 < 2 && orders.size() < palette_filter; k1++){
             p.direction = (LodePNGPaletteDirectionStrategy)k1;
+            orders.push_back(p);
+          }
+        }
+      }
+    }
 
-            lodepng_color_mode_cleanup(&state.out_mode);
-            p._first += ((tries + 1) == palette_filter) << 1;
-            lodepng::encode(out2, image, w, h, state, p);
-            p._first = 0;
-
-            if (out2.size() < out->size() && !state.note){
-              out->swap(out2);
-            }
-            out2.clear();
-            if (++tries == palette_filter){
-              k1 = k2 = k3 = k4 = 5;
-            }
+    // The orderings are tried on several threads, each with its own state.
+    // Every encode starts from the same cost model and duplicate palettes are
+    // resolved by ordering index, so the result doesn't depend on the number
+    // of threads.
+    SymbolStats costmodel;
+    ZopfliGetCostModel(&costmodel);
+
+    // With many orderings, rank them by the lazy LZ77 size of cheaply filtered
+    // data first and only give the most promising ones the full encode.
+    size_t full = orders.size() > 4 ? 4 + orders.size() / 15 : orders.size();
+    std::vector<size_t> chosen;
+    PaletteParse parse;
+    if (full < orders.size()) {
+      LodePNGFilterStrategy rankfilter = best_filter > LFS_PAETH ? LFS_ZERO : (LodePNGFilterStrategy)best_filter;
+      if (rankfilter == LFS_ZERO) {
+        parse.stride = w + 1;
+      }
+      std::vector<size_t> sizes(orders.size(), 0);
+      std::vector<std::vector<unsigned char> > palettes(orders.size());
+      // lodepng skips orderings whose palette was already seen in the same range
+      auto rank = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          lodepng::State trial;
+          InitEncoderState(&trial, inputstate, png_options, bit16, best_filter, filters);
+          trial.encoder.zlibsettings.custom_deflate = EstimatePNGDeflate;
+          trial.encoder.zlibsettings.custom_deflate_chunk = 0;
+          trial.encoder.zlibsettings.custom_context = &parse;
+          trial.encoder.filter_strategy = rankfilter;
+          LodePNGPaletteSettings trialp = orders[i];
+          trialp._first = (i == begin) | (i + 1 == end) << 1;
+          std::vector<unsigned char> png;
+          if (!TimedEncode(png, image, w, h, bit16, trial, trialp, ECT_STAGE_PALETTE_RANK)) {
+            sizes[i] = trial.note ? 0 : png.size();
+            palettes[i].assign(trial.out_mode.palette, trial.out_mode.palette + trial.out_mode.palettesize * 4);
+            lodepng_color_mode_cleanup(&trial.out_mode);
           }
         }
+      };
+      // The first ordering provides the parse the others are estimated with
+      rank(0, 1);
+      if (parse.data.empty()) {
+        parse.stride = 0;
+      }
+      RunTrials(png_options, orders.size() - 1, [&](size_t begin, size_t end) {rank(begin + 1, end + 1);});
+
+      // Orderings with the same palette give the same result, rank each
+      // palette once under its first ordering.
+      std::map<std::vector<unsigned char>, std::pair<size_t, size_t> > unique;
+      for (size_t i = 0; i < orders.size(); i++){
+        if (palettes[i].empty()){
+          continue;
+        }
+        std::pair<size_t, size_t>& entry = unique.insert(std::make_pair(palettes[i], std::make_pair(size_t(0), i))).first->second;
+        if (!entry.first){
+          entry.first = sizes[i];
+        }
+      }
+      std::vector<std::pair<size_t, size_t> > ranked;
+      for (auto it = unique.begin(); it != unique.end(); ++it){
+        // Not encoded anywhere if lodepng mistook it for another palette
+        ranked.push_back(std::make_pair(it->second.first ? it->second.first : (size_t)-1, it->second.second));
+      }
+      std::sort(ranked.begin(), ranked.end());
+      for (size_t i = 0; i < ranked.size() && i < full; i++){
+        chosen.push_back(ranked[i].second);
+      }
+    }
+    else {
+      for (size_t i = 0; i < orders.size(); i++){
+        chosen.push_back(i);
+      }
+    }
+
+    // The full encodes start from the ranking parse where their filtered data maps to it
+    ZopfliPNGOptions seeded = *png_options;
+    if (parse.stride) {
+      seeded.parse = &parse;
+    }
+#ifndef NOMULTI
+    // The threads of the incremental and genetic filters come out of the same budget as the trials
+    unsigned budget = png_options->threads ? png_options->threads : std::thread::hardware_concurrency();
+    seeded.threads = std::max(budget / TrialThreads(png_options, chosen.size()), 1u);
+#endif
+    std::vector<std::vector<unsigned char> > results(chosen.size());
+    RunTrials(png_options, chosen.size(), [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        lodepng::State trial;
+        InitEncoderState(&trial, inputstate, &seeded, bit16, best_filter, filters);
+        LodePNGPaletteSettings trialp = orders[chosen[i]];
+        trialp._first = 3;
+        ZopfliSetCostModel(&costmodel);
+        if (TimedEncode(results[i], image, w, h, bit16, trial, trialp, ECT_STAGE_PNG_TRIAL)) {
+          results[i].clear();
+        }
+        else {
+          lodepng_color_mode_cleanup(&trial.out_mode);
+        }
+      }
+    });
+    ZopfliSetCostModel(&costmodel);
+    // Ties go to the earliest ordering
+    for (size_t i = 0; i < results.size(); i++){
+      if (!results[i].empty() && results[i].size() < out->size()){
+        out->swap(results[i]);
       }
     }
  }
@@ -472,7 +885,7 @@ static unsigned TryOptimize(std::vector<unsigned char>& image, unsigned w, unsig
       else{if (has_alpha){state.info_png.color.colortype = LCT_RGBA;}
       else{state.info_png.color.colortype = LCT_RGB;}
       }
-      error = lodepng::encode(out2, image, w, h, state, p);
+      error = TimedEncode(out2, image, w, h, bit16, state, p, ECT_STAGE_PNG_TRIAL);
       if (out2.size() < out->size()){
         out->swap(out2);
       }
@@ -480,7 +893,9 @@ static unsigned TryOptimize(std::vector<unsigned char>& image, unsigned w, unsig
     }
   }
   if (error) {
-    printf("Encoding error %u: %s\n", error, lodepng_error_text(error));
+    if (png_options->verbose) {
+      printf("Encoding error %u: %s\n", error, lodepng_error_text(error));
+    }
     return error;
   }
   if(best_filter != 6){
@@ -491,33 +906,36 @@ static unsigned TryOptimize(std::vector<unsigned char>& image, unsigned w, unsig
 
 static unsigned ZopfliPNGOptimize(const std::vector<unsigned char>& origpng, const ZopfliPNGOptions& png_options, std::vector<unsigned char>* resultpng, int best_filter,
                                   std::vector<unsigned char> filters, unsigned palette_filter) {
-  std::vector<unsigned char> image;
+  unsigned char* image = 0;
   unsigned w, h;
   lodepng::State inputstate;
 
-  unsigned error = lodepng::decode(image, w, h, inputstate, origpng);
+  // The header tells whether to decode as 16-bit, rather than decoding twice. The image stays in the
+  // buffer lodepng decodes it into, copying it into a vector would need twice the memory.
+  const unsigned char* in = origpng.empty() ? 0 : &origpng[0];
+  bool bit16 = false;  // Using 16-bit per channel raw image
+  if (!lodepng_inspect(&w, &h, &inputstate, in, origpng.size())
+      && inputstate.info_png.color.bitdepth == 16 && !png_options.lossy_8bit) {
+    inputstate.info_raw.bitdepth = 16;
+    bit16 = true;
+  }
+  unsigned error = lodepng_decode(&image, &w, &h, &inputstate, in, origpng.size());
 
   if (error) {
-    printf("Decoding error %i: %s\n", error, lodepng_error_text(error));
-
+    if (png_options.verbose) {
+      printf("Decoding error %i: %s\n", error, lodepng_error_text(error));
+    }
+    free(image);
     return error;
   }
 
-  bool bit16 = false;  // Using 16-bit per channel raw image
-  if (inputstate.info_png.color.bitdepth == 16 && !png_options.lossy_8bit) {
-    // Decode as 16-bit
-    image.clear();
-    error = lodepng::decode(image, w, h, origpng, LCT_RGBA, 16);
-    bit16 = true;
-  }
-  if (!error) {
-    // If lossy_transparent, remove RGB information from pixels with alpha=0
-    if (png_options.lossy_transparent && !bit16) {
-      LossyOptimizeTransparent(&inputstate, &image[0], w, h, best_filter < 5 ? best_filter : 1);
-    }
+  // If lossy_transparent, remove RGB information from pixels with alpha=0
+  if (png_options.lossy_transparent && !bit16) {
+    LossyOptimizeTransparent(&inputstate, image, w, h, best_filter < 5 ? best_filter : 1);
   }
   std::vector<unsigned char> temp;
   error = TryOptimize(image, w, h, bit16, inputstate, &png_options, &temp, best_filter, filters, palette_filter);
+  free(image);
   if (!error) {
     (*resultpng).swap(temp);  // Store best result so far in the output.
   }
@@ -530,28 +948,41 @@ static unsigned ZopfliPNGOptimize(const std::vector<unsigned char>& origpng, con
   return error;
 }
 
-int Zopflipng(bool strip, const char * Infile, bool strict, unsigned Mode, int filter, unsigned multithreading) {
+int ZopflipngBuffer(bool strip, std::vector<unsigned char>& png, bool strict, unsigned Mode, int filter, unsigned multithreading, unsigned threads, PNGTrialCache* cache, bool verbose) {
   ZopfliPNGOptions png_options;
   png_options.Mode = Mode;
   png_options.multithreading = multithreading;
+  png_options.threads = threads;
+  png_options.cache = cache;
+  png_options.verbose = verbose;
   unsigned palette_filter = (filter & 0xFF00) >> 8;
   filter &= 0xFF;
   png_options.lossy_transparent = !strict && filter != 6;
   png_options.strip = strip;
-  std::vector<unsigned char> origpng;
 
   std::vector<unsigned char> filters;
-  lodepng::load_file(origpng, Infile);
   if (filter == 6){
-    lodepng::getFilterTypes(filters, origpng);
+    lodepng::getFilterTypes(filters, png);
     if(!filters.size()){
-      printf("Could not load PNG filters\n");
+      if (verbose) {
+        printf("Could not load PNG filters\n");
+      }
       return -1;
     }
   }
   std::vector<unsigned char> resultpng;
-  if (ZopfliPNGOptimize(origpng, png_options, &resultpng, filter, filters, palette_filter)) {return -1;}
-  if (resultpng.size() >= origpng.size()) {return 1;}
-  lodepng::save_file(resultpng, Infile);
+  if (ZopfliPNGOptimize(png, png_options, &resultpng, filter, filters, palette_filter)) {return -1;}
+  if (resultpng.size() >= png.size()) {return 1;}
+  png.swap(resultpng);
   return 0;
 }
+
+int Zopflipng(bool strip, const char * Infile, bool strict, unsigned Mode, int filter, unsigned multithreading, unsigned threads, PNGTrialCache* cache) {
+  std::vector<unsigned char> png;
+  lodepng::load_file(png, Infile);
+  int x = ZopflipngBuffer(strip, png, strict, Mode, filter, multithreading, threads, cache, true);
+  if (!x) {
+    lodepng::save_file(png, Infile);
+  }
+  return x;
+}